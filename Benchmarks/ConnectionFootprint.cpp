@@ -0,0 +1,141 @@
+// Measures the memory each NetworkConnection costs while idle, and after it has received some traffic
+//
+// Usage: ConnectionFootprint [connections]
+// Prints a single JSON object, so results can be compared across builds.
+
+#include "NetworkConnection.h"
+
+#include <boost/asio.hpp>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#if !defined _WIN32 && !defined _WIN64
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using boost::asio::ip::tcp;
+
+namespace {
+	//! Resident set size of the process, in bytes. Zero where it can't be read
+	size_t residentSize()
+	{
+#ifdef __linux__
+		std::ifstream statm("/proc/self/statm");
+		size_t pages = 0, resident = 0;
+		if (statm >> pages >> resident)
+			return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		return 0;
+	}
+
+	//! Raises the descriptor limit as far as allowed, returning how many connections fit. Each one takes two descriptors
+	size_t maxConnections(size_t wanted)
+	{
+#if !defined _WIN32 && !defined _WIN64
+		rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+			getrlimit(RLIMIT_NOFILE, &limit);
+
+			size_t available = limit.rlim_cur > 64 ? (size_t)(limit.rlim_cur - 64) / 2 : 0;
+			if (available < wanted) return available;
+		}
+#endif
+		return wanted;
+	}
+
+	//! Keeps reading frames. The handler is stored in the connection, so it holds a plain pointer rather than a shared
+	//! one, which would keep the connection alive forever; main owns the connections
+	void read(NetworkConnection *connection, size_t &frames)
+	{
+		connection->beginReading([connection, &frames](PacketPtr, boost::system::error_code error) {
+			if (error) return;
+
+			++frames;
+			read(connection, frames);
+		});
+	}
+
+	void poll(boost::asio::io_service &ioService)
+	{
+		ioService.poll();
+		ioService.reset();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t wanted = argc > 1 ? (size_t)std::strtoul(argv[1], nullptr, 10) : 10000;
+	size_t count = maxConnections(wanted);
+	if (count < wanted)
+		std::cerr << "Descriptor limit only allows " << count << " connections" << std::endl;
+	if (count == 0) return 1;
+
+	boost::asio::io_service ioService;
+	tcp::acceptor acceptor(ioService, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	acceptor.listen(boost::asio::socket_base::max_connections);
+
+	// Both ends of every connection exist before anything is measured, so only the connection objects are counted
+	std::vector<std::unique_ptr<tcp::socket>> clients, accepted;
+	clients.reserve(count);
+	accepted.reserve(count);
+
+	for (size_t i = 0; i < count; ++i) {
+		clients.emplace_back(new tcp::socket(ioService));
+		clients.back()->connect(acceptor.local_endpoint());
+
+		accepted.emplace_back(new tcp::socket(ioService));
+		acceptor.accept(*accepted.back());
+	}
+
+	std::vector<NetworkConnectionPtr> connections;
+	connections.reserve(count);
+	size_t frames = 0;
+
+	size_t before = residentSize();
+
+	for (auto &socket : accepted) {
+		NetworkConnectionPtr connection(new NetworkConnection(ioService));
+		connection->socket() = std::move(*socket);
+		connections.push_back(connection);
+
+		read(connection.get(), frames);
+	}
+	accepted.clear();
+	poll(ioService);
+
+	size_t idle = residentSize();
+
+	// A frame to each connection, which is dispatched and leaves the connection idle again
+	const uint8_t frame[] = { 4, 0, 0, 0, 0, 0 };
+	for (auto &client : clients)
+		boost::asio::write(*client, boost::asio::buffer(frame));
+
+	while (frames < count) {
+		ioService.run_one();
+		ioService.reset();
+	}
+	poll(ioService);
+
+	size_t drained = residentSize();
+
+	std::cout << "{\"benchmark\":\"connection_footprint\""
+		<< ",\"connections\":" << count
+		<< ",\"sizeof_connection\":" << sizeof(NetworkConnection)
+		<< ",\"idle_bytes_per_connection\":" << (idle > before ? (idle - before) / count : 0)
+		<< ",\"drained_bytes_per_connection\":" << (drained > before ? (drained - before) / count : 0)
+		<< "}" << std::endl;
+
+	// The aborted reads run, and drop their references, before the connections go
+	for (auto &connection : connections)
+		connection->close();
+	poll(ioService);
+
+	return 0;
+}
@@ -0,0 +1,552 @@
+// Drives a running server with thousands of simulated clients, speaking the real protocols, and reports throughput
+// and latency percentiles
+//
+// Usage: LoadGenerator login|interserver [--option value]...
+//
+//   login        Each client logs in like the game client does: protocol byte, version header, both RSA blocks and
+//                the XTEA key exchange, all checksummed. It waits for the character list (or the error), then closes
+//                and logs in again. Latency covers connecting up to the reply.
+//   interserver  Each client connects to the interserver with the 0xF1 handshake, then keeps relaying Account
+//                requests to the account capability. Latency covers one request and its reply.
+//
+// Unless --backend is 0, the generator also registers with the interserver as a stand-in account backend that
+// accepts every account, so no database is involved and everything runs offline. Every simulated client comes from
+// the same address, so the server's admission limits (admissionAddressRate and friends) must stay at their default of
+// 0, or the generator measures the limits instead of the server.
+//
+// Options, with their defaults:
+//   --host 127.0.0.1 --port 7171         Service to load: the login service, or the interserver
+//   --interserver-host ::1 --interserver-port 7878
+//                                        Interserver the stand-in backend registers with
+//   --interserver-username "" --interserver-password ""
+//                                        Interserver credentials, as they go on the wire
+//   --clients 1000 --duration 10 --threads <logical processors>
+//   --rsa data/rsa.pem --pem-key ""      Key the login service decrypts with; its public half is used here
+//   --version 1053                       Client version sent in the login header
+//   --backend 1
+//
+// Prints a single JSON object, so results can be compared across builds.
+
+#include "NetworkConnection.h"
+#include "NetworkDefinitions.h"
+#include "Packet.h"
+
+#include <boost/asio.hpp>
+
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	struct Options
+	{
+		std::string mode;
+		tcp::endpoint target;
+		tcp::endpoint interserver;
+		std::string interserverUsername;
+		std::string interserverPassword;
+		size_t clients;
+		unsigned int duration;
+		unsigned int threads;
+		std::string rsa;
+		std::string pemKey;
+		uint16_t version;
+		bool backend;
+	};
+
+	//! What a single simulated client went through. Only touched by that client's handlers, which never overlap
+	struct Results
+	{
+		uint64_t completed;
+		uint64_t rejected;
+		uint64_t failed;
+		//! Microseconds each completed exchange took
+		std::vector<uint32_t> latencies;
+
+		Results() : completed(0), rejected(0), failed(0) {}
+	};
+
+	//! Connection that checksums its frames, like the game client and the interserver client
+	class SimulatedConnection
+		: public NetworkConnection
+	{
+	public:
+		SimulatedConnection(boost::asio::io_service &ioService) : NetworkConnection(ioService) {}
+
+	protected:
+		virtual bool needChecksum() { return true; }
+	};
+
+	std::atomic<bool> g_stopping(false);
+
+	PacketPtr handshake(const Options &options)
+	{
+		PacketPtr packet = Packet::create();
+		packet->push<uint8_t>(0xF1)
+			.push<uint16_t>(0x0001)
+			.push(options.interserverUsername)
+			.push(options.interserverPassword);
+
+		return packet;
+	}
+
+	//! Logs in again and again, each time on a new connection
+	class LoginClient
+		: public std::enable_shared_from_this<LoginClient>
+	{
+	public:
+		LoginClient(boost::asio::io_service &ioService, const Options &options, RSA *rsa, size_t index)
+			: m_ioService(ioService), m_options(options), m_rsa(rsa), m_retry(ioService), m_random((uint32_t)index)
+		{
+			m_account = "load" + std::to_string(index);
+		}
+
+		void start()
+		{
+			if (g_stopping) return;
+
+			auto self = shared_from_this();
+			m_connection = std::make_shared<SimulatedConnection>(m_ioService);
+			m_started = Clock::now();
+
+			m_connection->socket().async_connect(m_options.target, [this, self](boost::system::error_code error) {
+				if (error) {
+					fail();
+					return;
+				}
+
+				std::array<uint32_t, 4> keys = { { (uint32_t)m_random(), (uint32_t)m_random(), (uint32_t)m_random(), (uint32_t)m_random() } };
+				m_connection->send(login(keys));
+
+				// The reply is encrypted with the keys just sent
+				m_connection->setKeys(keys);
+				m_connection->beginReading([this, self](PacketPtr packet, boost::system::error_code error) {
+					if (error || !packet->validChecksum()) {
+						fail();
+						return;
+					}
+
+					packet->skip(4);
+					uint8_t opcode = packet->pop<uint8_t>();
+					if (opcode == 0x14) {
+						m_results.completed++;
+						m_results.latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_started).count());
+					}
+					else m_results.rejected++;
+
+					m_connection->close();
+					start();
+				});
+			});
+		}
+
+		const Results& results() const { return m_results; }
+
+	private:
+		boost::asio::io_service &m_ioService;
+		const Options &m_options;
+		RSA *m_rsa;
+		boost::asio::deadline_timer m_retry;
+		std::mt19937 m_random;
+		std::string m_account;
+		std::shared_ptr<SimulatedConnection> m_connection;
+		Clock::time_point m_started;
+		Results m_results;
+
+		//! Counts the failure and tries again a little later, so a server that went away isn't spun against
+		void fail()
+		{
+			m_results.failed++;
+			m_connection->close();
+
+			auto self = shared_from_this();
+			m_retry.expires_from_now(boost::posix_time::millisec(100));
+			m_retry.async_wait([this, self](boost::system::error_code error) {
+				if (!error) start();
+			});
+		}
+
+		PacketPtr login(const std::array<uint32_t, 4> &keys)
+		{
+			PacketPtr packet = Packet::create();
+
+			// Protocol, operating system and version, then the data, sprite and picture signatures
+			packet->push<uint8_t>(0x01).push<uint16_t>(2).push<uint16_t>(m_options.version);
+			std::memset(packet->prepare(17), 0, 17);
+			packet->commit(m_options.version >= 971 ? 17 : 12);
+
+			PacketPtr block = Packet::create();
+			block->push<uint8_t>(0)
+				.push(keys[0]).push(keys[1]).push(keys[2]).push(keys[3])
+				.push(m_account)
+				.push(std::string("load"))
+				.push('$').push('L').push('O').push('D');
+			std::memset(block->prepare(17), 0, 17);
+			block->commit(17);
+			encryptBlock(*block, *packet);
+
+			packet->push<uint16_t>(0x0101)
+				.push(std::string("LoadGenerator"))
+				.push(std::string("1.0"));
+
+			block = Packet::create();
+			block->push<uint8_t>(0)
+				.push(std::string())
+				.push<bool>(false);
+			encryptBlock(*block, *packet);
+
+			return packet;
+		}
+
+		//! Pads block to 128 bytes and appends it to packet, RSA encrypted
+		void encryptBlock(Packet &block, Packet &packet)
+		{
+			uint8_t plain[128] = { 0 };
+			std::memcpy(plain, block.data() + block.start(), std::min<size_t>(block.size(), sizeof(plain)));
+
+			RSA_public_encrypt(sizeof(plain), plain, packet.prepare(sizeof(plain)), m_rsa, RSA_NO_PADDING);
+			packet.commit(sizeof(plain));
+		}
+	};
+
+	//! Relays Account requests through the interserver, one at a time, on a single connection
+	class RelayClient
+		: public std::enable_shared_from_this<RelayClient>
+	{
+	public:
+		RelayClient(boost::asio::io_service &ioService, const Options &options, size_t index)
+			: m_ioService(ioService), m_options(options), m_retry(ioService), m_requestId(0)
+		{
+			m_account = "load" + std::to_string(index);
+		}
+
+		void start()
+		{
+			if (g_stopping) return;
+
+			auto self = shared_from_this();
+			m_connection = std::make_shared<SimulatedConnection>(m_ioService);
+
+			m_connection->socket().async_connect(m_options.target, [this, self](boost::system::error_code error) {
+				if (error) {
+					fail();
+					return;
+				}
+
+				m_connection->send(handshake(m_options));
+				request();
+				receive();
+			});
+		}
+
+		const Results& results() const { return m_results; }
+
+	private:
+		boost::asio::io_service &m_ioService;
+		const Options &m_options;
+		boost::asio::deadline_timer m_retry;
+		std::string m_account;
+		std::shared_ptr<SimulatedConnection> m_connection;
+		uint32_t m_requestId;
+		Clock::time_point m_started;
+		Results m_results;
+
+		void fail()
+		{
+			m_results.failed++;
+			m_connection->close();
+
+			auto self = shared_from_this();
+			m_retry.expires_from_now(boost::posix_time::millisec(100));
+			m_retry.async_wait([this, self](boost::system::error_code error) {
+				if (!error) start();
+			});
+		}
+
+		void request()
+		{
+			if (g_stopping) {
+				m_connection->close();
+				return;
+			}
+
+			m_started = Clock::now();
+
+			PacketPtr packet = Packet::create();
+			packet->push<uint16_t>(0x0007)
+				.push<PacketSerializable>(Capability("account"))
+				.push<uint8_t>(1)
+				.push<uint32_t>(++m_requestId)
+				.push(std::string("Account"))
+				.push<uint8_t>(0)
+				.push(m_account)
+				.push(std::string("load"));
+
+			m_connection->send(packet);
+		}
+
+		void receive()
+		{
+			auto self = shared_from_this();
+			m_connection->beginReading([this, self](PacketPtr packet, boost::system::error_code error) {
+				if (error) {
+					if (!g_stopping) fail();
+					return;
+				}
+
+				packet->skip(4);
+				if (packet->validChecksum() && packet->pop<uint16_t>() == 0x0008) {
+					packet->skip(1);
+					if (packet->pop<uint32_t>() == m_requestId) {
+						if (packet->pop<uint8_t>() != 0) {
+							m_results.completed++;
+							m_results.latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_started).count());
+						}
+						else m_results.rejected++;
+
+						request();
+					}
+				}
+
+				receive();
+			});
+		}
+	};
+
+	//! Stand-in for the account service: registers the account capability and accepts every account
+	class AccountBackend
+		: public std::enable_shared_from_this<AccountBackend>
+	{
+	public:
+		AccountBackend(boost::asio::io_service &ioService, const Options &options)
+			: m_options(options)
+		{
+			m_connection = std::make_shared<SimulatedConnection>(ioService);
+		}
+
+		bool start()
+		{
+			boost::system::error_code error;
+			m_connection->socket().connect(m_options.interserver, error);
+			if (error) {
+				std::cerr << "Account backend could not reach the interserver: " << error.message() << std::endl;
+				return false;
+			}
+
+			m_connection->send(handshake(m_options));
+
+			PacketPtr packet = Packet::create();
+			packet->push<uint16_t>(0x0001).push<PacketSerializable>(Capability("account", m_connection->socket().local_endpoint(), std::weak_ptr<NetworkConnection>()));
+			m_connection->send(packet);
+
+			receive();
+			return true;
+		}
+
+		void stop() { m_connection->close(); }
+
+	private:
+		const Options &m_options;
+		std::shared_ptr<SimulatedConnection> m_connection;
+
+		void receive()
+		{
+			auto self = shared_from_this();
+			m_connection->beginReading([this, self](PacketPtr packet, boost::system::error_code error) {
+				if (error) return;
+
+				packet->skip(4);
+				if (packet->validChecksum() && packet->pop<uint16_t>() == 0x0007) {
+					uint32_t serverId = packet->pop<uint32_t>();
+					uint8_t operation = packet->pop<uint8_t>();
+					uint32_t clientId = packet->pop<uint32_t>();
+					packet->pop<boost::string_ref>(); // Class name, always Account
+
+					packet->skip(1);
+					auto account = packet->pop<boost::string_ref>();
+					auto password = packet->pop<boost::string_ref>();
+
+					PacketPtr reply = Packet::create();
+					reply->push<uint16_t>(0x0008)
+						.push<uint32_t>(serverId)
+						.push<uint8_t>(operation)
+						.push<uint32_t>(clientId)
+						.push<uint8_t>(1)
+						.push(account)
+						.push(password);
+					m_connection->send(reply);
+				}
+
+				receive();
+			});
+		}
+	};
+
+	tcp::endpoint endpoint(const std::string &host, const std::string &port)
+	{
+		return tcp::endpoint(boost::asio::ip::address::from_string(host), (unsigned short)std::stoul(port));
+	}
+
+	bool parse(int argc, char *argv[], Options &options)
+	{
+		if (argc < 2) return false;
+		options.mode = argv[1];
+		if (options.mode != "login" && options.mode != "interserver") return false;
+
+		std::map<std::string, std::string> values;
+		values["host"] = "127.0.0.1";
+		values["port"] = options.mode == "login" ? "7171" : "7878";
+		values["interserver-host"] = "::1";
+		values["interserver-port"] = "7878";
+		values["clients"] = "1000";
+		values["duration"] = "10";
+		values["threads"] = std::to_string(std::max(1U, std::thread::hardware_concurrency()));
+		values["rsa"] = "data/rsa.pem";
+		values["version"] = "1053";
+		values["backend"] = "1";
+
+		for (int i = 2; i + 1 < argc; i += 2) {
+			if (std::strncmp(argv[i], "--", 2) != 0) return false;
+			values[argv[i] + 2] = argv[i + 1];
+		}
+
+		try {
+			options.target = endpoint(values["host"], values["port"]);
+			options.interserver = endpoint(values["interserver-host"], values["interserver-port"]);
+			options.clients = (size_t)std::stoul(values["clients"]);
+			options.duration = (unsigned int)std::stoul(values["duration"]);
+			options.threads = std::max(1U, (unsigned int)std::stoul(values["threads"]));
+			options.version = (uint16_t)std::stoul(values["version"]);
+			options.backend = values["backend"] != "0";
+		}
+		catch (std::exception &e) {
+			std::cerr << "Invalid option: " << e.what() << std::endl;
+			return false;
+		}
+
+		options.interserverUsername = values["interserver-username"];
+		options.interserverPassword = values["interserver-password"];
+		options.rsa = values["rsa"];
+		options.pemKey = values["pem-key"];
+
+		return true;
+	}
+
+	RSA* loadKey(const Options &options)
+	{
+		BIO *bio = BIO_new(BIO_s_file());
+		if (bio == NULL || BIO_read_filename(bio, options.rsa.c_str()) <= 0) {
+			if (bio) BIO_free(bio);
+			return nullptr;
+		}
+
+		RSA *rsa = PEM_read_bio_RSAPrivateKey(bio, NULL, 0, (void*)options.pemKey.c_str());
+		BIO_free(bio);
+
+		return rsa;
+	}
+
+	uint32_t percentile(const std::vector<uint32_t> &sorted, double p)
+	{
+		if (sorted.empty()) return 0;
+		return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	if (!parse(argc, argv, options)) {
+		std::cerr << "Usage: LoadGenerator login|interserver [--option value]..." << std::endl;
+		return 1;
+	}
+
+	RSA *rsa = nullptr;
+	if (options.mode == "login") {
+		rsa = loadKey(options);
+		if (!rsa) {
+			std::cerr << "Could not load the RSA key from " << options.rsa << std::endl;
+			return 1;
+		}
+	}
+
+	boost::asio::io_service ioService;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ioService));
+
+	std::shared_ptr<AccountBackend> backend;
+	if (options.backend) {
+		backend = std::make_shared<AccountBackend>(ioService, options);
+		if (!backend->start()) return 1;
+	}
+
+	std::vector<std::shared_ptr<LoginClient>> loginClients;
+	std::vector<std::shared_ptr<RelayClient>> relayClients;
+	for (size_t i = 0; i < options.clients; ++i) {
+		if (rsa) loginClients.push_back(std::make_shared<LoginClient>(ioService, options, rsa, i));
+		else relayClients.push_back(std::make_shared<RelayClient>(ioService, options, i));
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < options.threads; ++i)
+		threads.emplace_back([&ioService]() { ioService.run(); });
+
+	auto started = Clock::now();
+	for (auto &client : loginClients) client->start();
+	for (auto &client : relayClients) client->start();
+
+	std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+
+	// Clients stop at their next exchange, whatever is still in flight is not counted
+	g_stopping = true;
+	double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - started).count();
+	ioService.stop();
+	for (auto &thread : threads) thread.join();
+
+	Results total;
+	auto add = [&total](const Results &results) {
+		total.completed += results.completed;
+		total.rejected += results.rejected;
+		total.failed += results.failed;
+		total.latencies.insert(total.latencies.end(), results.latencies.begin(), results.latencies.end());
+	};
+	for (auto &client : loginClients) add(client->results());
+	for (auto &client : relayClients) add(client->results());
+	std::sort(total.latencies.begin(), total.latencies.end());
+
+	std::cout << "{\"benchmark\":\"load_" << options.mode << "\""
+		<< ",\"clients\":" << options.clients
+		<< ",\"threads\":" << options.threads
+		<< ",\"seconds\":" << elapsed
+		<< ",\"completed\":" << total.completed
+		<< ",\"rejected\":" << total.rejected
+		<< ",\"failed\":" << total.failed
+		<< ",\"per_second\":" << (elapsed > 0 ? total.completed / elapsed : 0)
+		<< ",\"latency_us\":{\"p50\":" << percentile(total.latencies, 0.5)
+		<< ",\"p90\":" << percentile(total.latencies, 0.9)
+		<< ",\"p99\":" << percentile(total.latencies, 0.99)
+		<< ",\"p999\":" << percentile(total.latencies, 0.999)
+		<< ",\"max\":" << (total.latencies.empty() ? 0 : total.latencies.back())
+		<< "}}" << std::endl;
+
+	if (rsa) RSA_free(rsa);
+
+	return 0;
+}
@@ -0,0 +1,280 @@
+// Runs the interserver service in-process and drives it over loopback connections, so neither sockets nor the kernel
+// are involved. Each client keeps relaying Account requests to a stand-in account backend, like LoadGenerator's
+// interserver mode does over TCP; comparing both tells the service's own cost apart from the network stack's.
+//
+// Usage: LoopbackInterserver [--clients 1000] [--duration 10] [--threads <logical processors>]
+// Prints a single JSON object, so results can be compared across builds.
+
+#include "LoopbackConnection.h"
+#include "Metrics.h"
+#include "NetworkDefinitions.h"
+#include "NetworkListener.h"
+#include "Packet.h"
+#include "Settings.h"
+
+#include "ComponentManager.h"
+
+#include "../Plugin_Interserver/InterserverService.h"
+
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+class LoggerComponent;
+
+// What the interserver plugin gets from the server. Without settings it takes plain, empty credentials
+std::weak_ptr<Settings> g_settings;
+LoggerComponent *g_logger = nullptr;
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	std::atomic<bool> g_stopping(false);
+
+	struct Results
+	{
+		uint64_t completed;
+		uint64_t rejected;
+		//! Microseconds each request took, up to its reply
+		std::vector<uint32_t> latencies;
+
+		Results() : completed(0), rejected(0) {}
+	};
+
+	//! Opens a loopback connection to the listener, returning the client's end
+	std::shared_ptr<LoopbackConnection> open(boost::asio::io_service &ioService, std::shared_ptr<NetworkListener> listener, unsigned short port)
+	{
+		auto server = std::make_shared<LoopbackConnection>(ioService);
+		auto client = std::make_shared<LoopbackConnection>(ioService, true);
+		LoopbackConnection::connect(server, client);
+
+		// The service tells connections apart by their address
+		server->remoteEndpoint(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+		PacketPtr handshake = Packet::create();
+		handshake->push<uint8_t>(0xF1).push<uint16_t>(0x0001).push(std::string()).push(std::string());
+		client->send(handshake);
+
+		listener->serveConnection(server);
+		return client;
+	}
+
+	//! Stand-in for the account service: registers the account capability and accepts every account
+	class AccountBackend
+		: public std::enable_shared_from_this<AccountBackend>
+	{
+	public:
+		explicit AccountBackend(std::shared_ptr<LoopbackConnection> connection) : m_connection(connection) {}
+
+		void start()
+		{
+			PacketPtr packet = Packet::create();
+			packet->push<uint16_t>(0x0001).push<PacketSerializable>(Capability("account", tcp::endpoint(boost::asio::ip::address_v4::loopback(), 1), std::weak_ptr<NetworkConnection>()));
+			m_connection->send(packet);
+
+			receive();
+		}
+
+	private:
+		std::shared_ptr<LoopbackConnection> m_connection;
+
+		void receive()
+		{
+			auto self = shared_from_this();
+			m_connection->beginReading([this, self](PacketPtr packet, boost::system::error_code error) {
+				if (error) return;
+
+				packet->skip(4);
+				if (packet->validChecksum() && packet->pop<uint16_t>() == 0x0007) {
+					uint32_t serverId = packet->pop<uint32_t>();
+					uint8_t operation = packet->pop<uint8_t>();
+					uint32_t clientId = packet->pop<uint32_t>();
+					packet->pop<boost::string_ref>(); // Class name, always Account
+
+					packet->skip(1);
+					auto account = packet->pop<boost::string_ref>();
+					auto password = packet->pop<boost::string_ref>();
+
+					PacketPtr reply = Packet::create();
+					reply->push<uint16_t>(0x0008)
+						.push<uint32_t>(serverId)
+						.push<uint8_t>(operation)
+						.push<uint32_t>(clientId)
+						.push<uint8_t>(1)
+						.push(account)
+						.push(password);
+					m_connection->send(reply);
+				}
+
+				receive();
+			});
+		}
+	};
+
+	//! Relays one Account request after another, each once the previous one was answered
+	class RelayClient
+		: public std::enable_shared_from_this<RelayClient>
+	{
+	public:
+		RelayClient(std::shared_ptr<LoopbackConnection> connection, size_t index)
+			: m_connection(connection), m_requestId(0), m_account("loopback" + std::to_string(index))
+		{
+		}
+
+		void start()
+		{
+			request();
+			receive();
+		}
+
+		const Results& results() const { return m_results; }
+
+	private:
+		std::shared_ptr<LoopbackConnection> m_connection;
+		uint32_t m_requestId;
+		std::string m_account;
+		Clock::time_point m_started;
+		Results m_results;
+
+		void request()
+		{
+			if (g_stopping) return;
+
+			m_started = Clock::now();
+
+			PacketPtr packet = Packet::create();
+			packet->push<uint16_t>(0x0007)
+				.push<PacketSerializable>(Capability("account"))
+				.push<uint8_t>(1)
+				.push<uint32_t>(++m_requestId)
+				.push(std::string("Account"))
+				.push<uint8_t>(0)
+				.push(m_account)
+				.push(std::string("loopback"));
+
+			m_connection->send(packet);
+		}
+
+		void receive()
+		{
+			auto self = shared_from_this();
+			m_connection->beginReading([this, self](PacketPtr packet, boost::system::error_code error) {
+				if (error) return;
+
+				packet->skip(4);
+				if (packet->validChecksum() && packet->pop<uint16_t>() == 0x0008) {
+					packet->skip(1);
+					if (packet->pop<uint32_t>() == m_requestId) {
+						if (packet->pop<uint8_t>() != 0) {
+							m_results.completed++;
+							m_results.latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - m_started).count());
+						}
+						else m_results.rejected++;
+
+						request();
+					}
+				}
+
+				receive();
+			});
+		}
+	};
+
+	uint32_t percentile(const std::vector<uint32_t> &sorted, double p)
+	{
+		if (sorted.empty()) return 0;
+		return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t clientCount = 1000;
+	unsigned int duration = 10;
+	unsigned int threadCount = std::max(1U, std::thread::hardware_concurrency());
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (std::strcmp(argv[i], "--clients") == 0) clientCount = (size_t)std::strtoul(argv[i + 1], nullptr, 10);
+		else if (std::strcmp(argv[i], "--duration") == 0) duration = (unsigned int)std::strtoul(argv[i + 1], nullptr, 10);
+		else if (std::strcmp(argv[i], "--threads") == 0) threadCount = std::max(1U, (unsigned int)std::strtoul(argv[i + 1], nullptr, 10));
+		else {
+			std::cerr << "Usage: LoopbackInterserver [--clients 1000] [--duration 10] [--threads <logical processors>]" << std::endl;
+			return 1;
+		}
+	}
+
+	boost::asio::io_service ioService;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ioService));
+
+	// The listener only dispatches here, it never binds its endpoint
+	auto components = std::make_shared<ComponentManager>();
+	auto listener = std::make_shared<NetworkListener>(ioService, components, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	listener->registerService(std::make_shared<InterserverService>(components->getMetrics()));
+
+	auto backend = std::make_shared<AccountBackend>(open(ioService, listener, 1));
+	backend->start();
+
+	// Everything runs in-process, so once the queue is drained the capability is registered
+	while (ioService.poll() > 0) {}
+	ioService.reset();
+
+	std::vector<std::shared_ptr<RelayClient>> clients;
+	for (size_t i = 0; i < clientCount; ++i)
+		clients.push_back(std::make_shared<RelayClient>(open(ioService, listener, (unsigned short)(2 + i % 65534)), i));
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < threadCount; ++i)
+		threads.emplace_back([&ioService]() { ioService.run(); });
+
+	auto started = Clock::now();
+	for (auto &client : clients) client->start();
+
+	std::this_thread::sleep_for(std::chrono::seconds(duration));
+
+	// Clients stop at their next exchange, whatever is still in flight is not counted
+	g_stopping = true;
+	double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - started).count();
+	ioService.stop();
+	for (auto &thread : threads) thread.join();
+
+	Results total;
+	for (auto &client : clients) {
+		total.completed += client->results().completed;
+		total.rejected += client->results().rejected;
+		total.latencies.insert(total.latencies.end(), client->results().latencies.begin(), client->results().latencies.end());
+	}
+	std::sort(total.latencies.begin(), total.latencies.end());
+
+	// Time spent in the service itself, as the listener recorded it
+	auto handled = components->getMetrics()->histogram("service.interserver.handle_ns").summary();
+
+	std::cout << "{\"benchmark\":\"loopback_interserver\""
+		<< ",\"clients\":" << clientCount
+		<< ",\"threads\":" << threadCount
+		<< ",\"seconds\":" << elapsed
+		<< ",\"completed\":" << total.completed
+		<< ",\"rejected\":" << total.rejected
+		<< ",\"per_second\":" << (elapsed > 0 ? total.completed / elapsed : 0)
+		<< ",\"latency_us\":{\"p50\":" << percentile(total.latencies, 0.5)
+		<< ",\"p90\":" << percentile(total.latencies, 0.9)
+		<< ",\"p99\":" << percentile(total.latencies, 0.99)
+		<< ",\"p999\":" << percentile(total.latencies, 0.999)
+		<< ",\"max\":" << (total.latencies.empty() ? 0 : total.latencies.back())
+		<< "},\"handle_ns\":{\"p50\":" << handled.p50
+		<< ",\"p99\":" << handled.p99
+		<< ",\"max\":" << handled.max
+		<< "}}" << std::endl;
+
+	return 0;
+}
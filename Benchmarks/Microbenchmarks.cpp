@@ -0,0 +1,217 @@
+// Times the library's hot paths in isolation: packet building and parsing, checksums, XTEA, callbacks, schema
+// serialization and settings lookups
+//
+// Usage: Microbenchmarks [--filter substring] [--min-time milliseconds]
+// Prints one JSON object per benchmark and line, so runs of different builds can be compared line by line.
+
+#include "Callback.h"
+#include "NetworkDefinitions.h"
+#include "Packet.h"
+#include "Settings.h"
+#include "Tools.h"
+#include "Xtea.h"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	std::string g_filter;
+	double g_minTime = 200;
+
+	//! Keeps the compiler from optimizing away a result that is otherwise unused
+	template <typename T>
+	inline void keep(const T &value)
+	{
+#if defined __GNUC__ || defined __clang__
+		asm volatile("" : : "r,m"(value) : "memory");
+#else
+		static volatile const void *sink;
+		sink = &value;
+#endif
+	}
+
+	//! Runs body in growing batches until a batch lasts at least the minimum time, then reports the time per call
+	/**
+	 * bytes is how much data a single call processes, to also report throughput. Zero when it makes no sense
+	 */
+	template <typename Body>
+	void run(const std::string &name, size_t bytes, Body body)
+	{
+		if (!g_filter.empty() && name.find(g_filter) == std::string::npos)
+			return;
+
+		// Warm the caches and the packet pool up
+		for (int i = 0; i < 100; ++i) body();
+
+		size_t iterations = 1;
+		double elapsed = 0;
+		while (true) {
+			auto started = Clock::now();
+			for (size_t i = 0; i < iterations; ++i) body();
+			elapsed = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(Clock::now() - started).count();
+
+			if (elapsed >= g_minTime) break;
+			iterations *= elapsed > 0 ? std::min<size_t>(10, (size_t)(g_minTime * 1.2 / elapsed) + 1) : 10;
+		}
+
+		double nanoseconds = elapsed * 1e6 / iterations;
+
+		std::cout << "{\"benchmark\":\"" << name << "\""
+			<< ",\"iterations\":" << iterations
+			<< ",\"ns_per_op\":" << nanoseconds;
+		if (bytes > 0)
+			std::cout << ",\"mb_per_s\":" << bytes / nanoseconds * 1e3;
+		std::cout << "}" << std::endl;
+	}
+
+	void packetBenchmarks()
+	{
+		PacketPtr packet = Packet::create();
+		std::string name("Phoenix Tibia Server");
+
+		run("packet_push_pop", 0, [&]() {
+			packet->reset();
+			packet->push<uint8_t>(0x64).push<uint16_t>(0x1234).push<uint32_t>(0xdeadbeef).push(name);
+
+			packet->pos(packet->start());
+			keep(packet->pop<uint8_t>());
+			keep(packet->pop<uint16_t>());
+			keep(packet->pop<uint32_t>());
+			keep(packet->pop<boost::string_ref>());
+		});
+
+		run("packet_create", 0, []() {
+			PacketPtr created = Packet::create();
+			keep(created.get());
+		});
+
+		// Past the initial buffer, so it grows a few times
+		run("packet_grow_4k", 4096, []() {
+			PacketPtr grown = Packet::create();
+			for (uint32_t i = 0; i < 1024; ++i) grown->push<uint32_t>(i);
+			keep(grown->size());
+		});
+	}
+
+	void checksumBenchmarks()
+	{
+		for (size_t size : { 64, 1024, 16384 }) {
+			std::vector<uint8_t> data(size, 0x5a);
+
+			run("adler_checksum_" + std::to_string(size), size, [&]() {
+				keep(adlerChecksum(data.data(), data.size()));
+			});
+		}
+	}
+
+	void xteaBenchmarks()
+	{
+		std::array<uint32_t, 4> keys = { { 0x01234567, 0x89abcdef, 0xfedcba98, 0x76543210 } };
+
+		for (size_t size : { 64, 1024, 16384 }) {
+			std::vector<uint8_t> data(size, 0x5a);
+
+			run("xtea_encrypt_" + std::to_string(size), size, [&]() {
+				xteaEncrypt(data.data(), data.size(), keys);
+				keep(data[0]);
+			});
+
+			run("xtea_decrypt_" + std::to_string(size), size, [&]() {
+				xteaDecrypt(data.data(), data.size(), keys);
+				keep(data[0]);
+			});
+
+			// What encrypted frames go through on receive, see NetworkConnection::ReceiveMode::Fused
+			run("xtea_decrypt_checksum_" + std::to_string(size), size, [&]() {
+				keep(xteaDecryptWithChecksum(data.data(), data.size(), keys));
+			});
+		}
+	}
+
+	void callbackBenchmarks()
+	{
+		phoenix::callback<false, void(int)> callback;
+		int total = 0;
+		for (int i = 0; i < 4; ++i)
+			callback.push([&total](int value) { total += value; });
+
+		run("callback_dispatch_4", 0, [&]() {
+			callback(1);
+			keep(total);
+		});
+	}
+
+	void capabilityBenchmarks()
+	{
+		Capability capability("account", boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("::1"), 6666), std::weak_ptr<NetworkConnection>());
+		PacketPtr packet = Packet::create();
+
+		run("capability_write", 0, [&]() {
+			packet->reset();
+			packet->push<PacketSerializable>(capability);
+			keep(packet->size());
+		});
+
+		packet->reset();
+		packet->push<PacketSerializable>(capability);
+
+		run("capability_read", 0, [&]() {
+			Capability read;
+			packet->pos(packet->start());
+			packet->get(read);
+			keep(read.serviceEndpoint);
+		});
+	}
+
+	void settingsBenchmarks()
+	{
+		const char *path = "microbenchmarks_settings.lua";
+		{
+			std::ofstream file(path);
+			file << "dataDirectory = \"data\"\nworkerCount = 2\nclient_version = 1053\nlocale = \"ja-jp\"\n";
+		}
+
+		Settings settings(path);
+		bool loaded = settings.load();
+		std::remove(path);
+
+		if (!loaded) {
+			std::cerr << "Could not load the settings, skipping their benchmarks" << std::endl;
+			return;
+		}
+
+		run("settings_get_string", 0, [&]() {
+			keep(settings.getString("locale"));
+		});
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (std::strcmp(argv[i], "--filter") == 0) g_filter = argv[i + 1];
+		else if (std::strcmp(argv[i], "--min-time") == 0) g_minTime = std::atof(argv[i + 1]);
+		else {
+			std::cerr << "Usage: Microbenchmarks [--filter substring] [--min-time milliseconds]" << std::endl;
+			return 1;
+		}
+	}
+
+	packetBenchmarks();
+	checksumBenchmarks();
+	xteaBenchmarks();
+	callbackBenchmarks();
+	capabilityBenchmarks();
+	settingsBenchmarks();
+
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include "Tools.h"
+#include "Packet.h"
+#include "Simd.h"
+
+namespace {
+	const uint32_t adlerBase = 65521;
+	//! Largest number of bytes that can be summed before b overflows 32 bits
+	const size_t adlerMax = 5552;
+
+	typedef uint32_t(*kernel_t)(uint32_t a, uint32_t b, const uint8_t *data, size_t length);
+
+	uint32_t adlerScalar(uint32_t a, uint32_t b, const uint8_t *data, size_t length)
+	{
+		while (length > 0) {
+			size_t tmp = length > adlerMax ? adlerMax : length;
+			length -= tmp;
+			do {
+				a += *data++;
+				b += a;
+			} while (--tmp);
+			a %= adlerBase;
+			b %= adlerBase;
+		}
+
+		return (b << 16) | a;
+	}
+
+#ifdef PHOENIX_SIMD_X86
+	// Each step takes a block of bytes d[0..n-1] and does
+	//   a += d[0] + ... + d[n-1]
+	//   b += n * a(before the block) + n * d[0] + (n - 1) * d[1] + ... + 1 * d[n-1]
+	// The plain sums come from psadbw against zero, the weighted ones from pmaddubsw against the descending weights.
+	// The n * a term is accumulated once per block in a separate register and scaled at the end.
+
+	PHOENIX_TARGET("ssse3")
+	uint32_t adlerSsse3(uint32_t a, uint32_t b, const uint8_t *data, size_t length)
+	{
+		const size_t blockSize = 32;
+		size_t blocks = length / blockSize;
+		length -= blocks * blockSize;
+
+		const __m128i weightsHigh = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+		const __m128i weightsLow = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+
+		while (blocks > 0) {
+			size_t n = adlerMax / blockSize;
+			if (n > blocks) n = blocks;
+			blocks -= n;
+
+			__m128i previousA = _mm_set_epi32(0, 0, 0, (int)(a * n));
+			__m128i sumB = _mm_set_epi32(0, 0, 0, (int)b);
+			__m128i sumA = _mm_setzero_si128();
+
+			do {
+				const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+				const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+
+				previousA = _mm_add_epi32(previousA, sumA);
+
+				sumA = _mm_add_epi32(sumA, _mm_sad_epu8(bytes1, zero));
+				sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, weightsHigh), ones));
+				sumA = _mm_add_epi32(sumA, _mm_sad_epu8(bytes2, zero));
+				sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, weightsLow), ones));
+
+				data += blockSize;
+			} while (--n);
+
+			sumB = _mm_add_epi32(sumB, _mm_slli_epi32(previousA, 5));
+
+			sumA = _mm_add_epi32(sumA, _mm_shuffle_epi32(sumA, _MM_SHUFFLE(2, 3, 0, 1)));
+			sumA = _mm_add_epi32(sumA, _mm_shuffle_epi32(sumA, _MM_SHUFFLE(1, 0, 3, 2)));
+			a += (uint32_t)_mm_cvtsi128_si32(sumA);
+			sumB = _mm_add_epi32(sumB, _mm_shuffle_epi32(sumB, _MM_SHUFFLE(2, 3, 0, 1)));
+			sumB = _mm_add_epi32(sumB, _mm_shuffle_epi32(sumB, _MM_SHUFFLE(1, 0, 3, 2)));
+			b = (uint32_t)_mm_cvtsi128_si32(sumB);
+
+			a %= adlerBase;
+			b %= adlerBase;
+		}
+
+		return adlerScalar(a, b, data, length);
+	}
+
+	PHOENIX_TARGET("avx2")
+	uint32_t adlerAvx2(uint32_t a, uint32_t b, const uint8_t *data, size_t length)
+	{
+		const size_t blockSize = 64;
+		size_t blocks = length / blockSize;
+		length -= blocks * blockSize;
+
+		const __m256i weightsHigh = _mm256_setr_epi8(
+			64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+			48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+		const __m256i weightsLow = _mm256_setr_epi8(
+			32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+			16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+
+		while (blocks > 0) {
+			size_t n = adlerMax / blockSize;
+			if (n > blocks) n = blocks;
+			blocks -= n;
+
+			__m256i previousA = _mm256_setr_epi32((int)(a * n), 0, 0, 0, 0, 0, 0, 0);
+			__m256i sumB = _mm256_setr_epi32((int)b, 0, 0, 0, 0, 0, 0, 0);
+			__m256i sumA = _mm256_setzero_si256();
+
+			do {
+				const __m256i bytes1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+				const __m256i bytes2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+
+				previousA = _mm256_add_epi32(previousA, sumA);
+
+				sumA = _mm256_add_epi32(sumA, _mm256_sad_epu8(bytes1, zero));
+				sumB = _mm256_add_epi32(sumB, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes1, weightsHigh), ones));
+				sumA = _mm256_add_epi32(sumA, _mm256_sad_epu8(bytes2, zero));
+				sumB = _mm256_add_epi32(sumB, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes2, weightsLow), ones));
+
+				data += blockSize;
+			} while (--n);
+
+			sumB = _mm256_add_epi32(sumB, _mm256_slli_epi32(previousA, 6));
+
+			__m128i lanesA = _mm_add_epi32(_mm256_castsi256_si128(sumA), _mm256_extracti128_si256(sumA, 1));
+			lanesA = _mm_add_epi32(lanesA, _mm_shuffle_epi32(lanesA, _MM_SHUFFLE(2, 3, 0, 1)));
+			lanesA = _mm_add_epi32(lanesA, _mm_shuffle_epi32(lanesA, _MM_SHUFFLE(1, 0, 3, 2)));
+			a += (uint32_t)_mm_cvtsi128_si32(lanesA);
+
+			__m128i lanesB = _mm_add_epi32(_mm256_castsi256_si128(sumB), _mm256_extracti128_si256(sumB, 1));
+			lanesB = _mm_add_epi32(lanesB, _mm_shuffle_epi32(lanesB, _MM_SHUFFLE(2, 3, 0, 1)));
+			lanesB = _mm_add_epi32(lanesB, _mm_shuffle_epi32(lanesB, _MM_SHUFFLE(1, 0, 3, 2)));
+			b = (uint32_t)_mm_cvtsi128_si32(lanesB);
+
+			a %= adlerBase;
+			b %= adlerBase;
+		}
+
+		return adlerScalar(a, b, data, length);
+	}
+#endif
+
+	kernel_t selectKernel()
+	{
+#ifdef PHOENIX_SIMD_X86
+		if (cpuSupports(CpuFeature::AVX2)) return adlerAvx2;
+		if (cpuSupports(CpuFeature::SSSE3)) return adlerSsse3;
+#endif
+
+		return adlerScalar;
+	}
+
+	kernel_t kernel()
+	{
+		static const kernel_t selected = selectKernel();
+		return selected;
+	}
+}
+
+uint32_t adlerChecksum(uint8_t* data, size_t length)
+{
+	if (length > Packet::maxPacketSize || !length)
+		return 0;
+
+	return kernel()(1, 0, data, length);
+}
+
+uint32_t adlerUpdate(uint32_t adler, const uint8_t* data, size_t length)
+{
+	if (!length)
+		return adler;
+
+	return kernel()(adler & 0xffff, adler >> 16, data, length);
+}
@@ -0,0 +1,130 @@
+#include "AdmissionControl.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+	// A bucket holds the time of its last refill, in milliseconds since m_epoch, over its tokens in fixed point
+	const int tokenBits = 24;
+	const uint64_t tokenMask = (uint64_t(1) << tokenBits) - 1;
+	//! Fractions of a token kept, so slow rates still refill
+	const uint64_t tokenScale = 16;
+
+	std::int64_t milliseconds()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+AdmissionControl::AdmissionControl()
+	: m_buckets(new std::atomic<uint64_t>[AdmissionControl::tableSize])
+{
+	m_limits.addressRate = m_limits.addressBurst = 0;
+	m_limits.globalRate = m_limits.globalBurst = 0;
+
+	for (size_t i = 0; i < AdmissionControl::tableSize; ++i)
+		m_buckets[i].store(0, std::memory_order_relaxed);
+	m_global.store(0, std::memory_order_relaxed);
+
+	// Keep timestamps above zero, which marks a bucket that was never used
+	m_epoch = milliseconds() - 1;
+
+	m_accepted.store(0, std::memory_order_relaxed);
+	m_rejectedAddress.store(0, std::memory_order_relaxed);
+	m_rejectedGlobal.store(0, std::memory_order_relaxed);
+}
+
+AdmissionControl::~AdmissionControl()
+{
+}
+
+void AdmissionControl::setLimits(const Limits &limits)
+{
+	m_limits = limits;
+
+	// A burst of less than one connection would reject everything
+	m_limits.addressBurst = std::max(m_limits.addressBurst, 1.0);
+	m_limits.globalBurst = std::max(m_limits.globalBurst, 1.0);
+
+	// Buckets start over full with the new limits
+	for (size_t i = 0; i < AdmissionControl::tableSize; ++i)
+		m_buckets[i].store(0, std::memory_order_relaxed);
+	m_global.store(0, std::memory_order_relaxed);
+}
+
+bool AdmissionControl::admit(const boost::asio::ip::address &address)
+{
+	std::int64_t now = milliseconds() - m_epoch;
+
+	if (m_limits.addressRate > 0 && !take(m_buckets[slotOf(address)], m_limits.addressRate, m_limits.addressBurst, now)) {
+		m_rejectedAddress.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (m_limits.globalRate > 0 && !take(m_global, m_limits.globalRate, m_limits.globalBurst, now)) {
+		m_rejectedGlobal.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	m_accepted.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+AdmissionControl::Statistics AdmissionControl::getStatistics() const
+{
+	Statistics statistics;
+	statistics.accepted = m_accepted.load(std::memory_order_relaxed);
+	statistics.rejectedAddress = m_rejectedAddress.load(std::memory_order_relaxed);
+	statistics.rejectedGlobal = m_rejectedGlobal.load(std::memory_order_relaxed);
+
+	return statistics;
+}
+
+bool AdmissionControl::take(std::atomic<uint64_t> &bucket, double rate, double burst, std::int64_t now)
+{
+	uint64_t capacity = std::min<uint64_t>((uint64_t)(burst * tokenScale), tokenMask);
+	uint64_t current = bucket.load(std::memory_order_relaxed);
+
+	while (true) {
+		std::int64_t last = (std::int64_t)(current >> tokenBits);
+		uint64_t tokens = current & tokenMask;
+
+		if (current == 0) {
+			// Never used: starts full
+			last = now;
+			tokens = capacity;
+		}
+		else if (now > last) {
+			uint64_t refill = (uint64_t)((now - last) * rate * tokenScale / 1000);
+
+			// Time is only consumed once it amounts to some tokens, so frequent attempts don't starve the refill
+			if (refill > 0) {
+				tokens = std::min(capacity, tokens + refill);
+				last = now;
+			}
+		}
+
+		if (tokens < tokenScale) return false;
+
+		uint64_t next = (uint64_t)last << tokenBits | (tokens - tokenScale);
+		if (bucket.compare_exchange_weak(current, next, std::memory_order_relaxed))
+			return true;
+	}
+}
+
+size_t AdmissionControl::slotOf(const boost::asio::ip::address &address)
+{
+	uint64_t hash = 0;
+
+	if (address.is_v4()) {
+		hash = address.to_v4().to_ulong();
+	}
+	else {
+		auto bytes = address.to_v6().to_bytes();
+		for (auto byte : bytes)
+			hash = hash * 131 + byte;
+	}
+
+	// Fibonacci hashing spreads neighbouring addresses over the whole table
+	return (size_t)((hash * 0x9E3779B97F4A7C15ull) >> 32) & (AdmissionControl::tableSize - 1);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+//! Rate limits new connections, per source address and overall, before anything is allocated for them
+/**
+ * Each limit is a token bucket packed in a single 64 bit word and updated with compare-and-swap, so admitting a
+ * connection never locks nor allocates. Source addresses are hashed into a fixed table of buckets; addresses that
+ * collide share a bucket, which may only make the limit stricter for them.
+ */
+class AdmissionControl
+{
+public:
+	enum {
+		//! Number of per-address buckets. Must be a power of two
+		tableSize = 16384
+	};
+
+	struct Limits
+	{
+		//! Connections per second allowed from a single address. Zero disables the per-address limit
+		double addressRate;
+		//! Connections a single address may open at once, after being idle
+		double addressBurst;
+		//! Connections per second allowed overall. Zero disables the global limit
+		double globalRate;
+		//! Connections that may be opened at once overall, after being idle
+		double globalBurst;
+	};
+
+	struct Statistics
+	{
+		uint64_t accepted;
+		//! Connections rejected because their source address went over its limit
+		uint64_t rejectedAddress;
+		//! Connections rejected because of the global limit
+		uint64_t rejectedGlobal;
+	};
+
+	AdmissionControl();
+	~AdmissionControl();
+
+	//! Changes the limits. Must be called before the listeners start accepting
+	void setLimits(const Limits &limits);
+	const Limits& getLimits() const { return m_limits; }
+
+	//! Takes a token for a connection from address, returning whether it may be accepted
+	bool admit(const boost::asio::ip::address &address);
+
+	Statistics getStatistics() const;
+
+private:
+	Limits m_limits;
+	std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+	std::atomic<uint64_t> m_global;
+	//! Time every bucket's timestamp is relative to
+	std::int64_t m_epoch;
+
+	std::atomic<uint64_t> m_accepted;
+	std::atomic<uint64_t> m_rejectedAddress;
+	std::atomic<uint64_t> m_rejectedGlobal;
+
+	bool take(std::atomic<uint64_t> &bucket, double rate, double burst, std::int64_t now);
+	static size_t slotOf(const boost::asio::ip::address &address);
+};
@@ -1,5 +1,6 @@
 #include "ComponentManager.h"
 #include "Component.h"
+#include "Metrics.h"
 #include <iostream>
 
 // Default components here
@@ -9,6 +10,7 @@
 
 
 ComponentManager::ComponentManager()
+	: m_metrics(std::make_shared<Metrics>())
 {
 }
 
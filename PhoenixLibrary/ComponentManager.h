@@ -7,6 +7,7 @@
 #include "Callback.h"
 
 class Component;
+class Metrics;
 class Settings;
 class NetworkManager;
 class NetworkService;
@@ -71,7 +72,11 @@ public:
 		return nullptr;
 	}
 
+	//! Returns the metrics registry shared by the server, its components and its plugins
+	std::shared_ptr<Metrics> getMetrics() { return m_metrics; }
+
 private:
 	std::deque<std::pair<std::string, std::shared_ptr<Component>>> m_components;
+	std::shared_ptr<Metrics> m_metrics;
 };
 
@@ -0,0 +1,139 @@
+#pragma once
+
+#ifdef PHOENIX_COROUTINES
+
+#include "NetworkDefinitions.h"
+#include "NetworkConnection.h"
+#include "PacketPool.h"
+
+#include <coroutine>
+#include <exception>
+#include <iostream>
+
+//! Awaitable versions of the connection handlers, for services written as C++20 coroutines
+/**
+ * Only available when built with PHOENIX_COROUTINES. Each awaitable hands the connection a handler that captures no
+ * more than the coroutine handle and a pointer to its result, which std::function keeps without allocating, so the
+ * coroutine frame itself is the only allocation of a whole exchange. Awaitables resume the coroutine from wherever
+ * the underlying handler runs: reads and writes on the connection's strand, interserver replies on the client's.
+ */
+namespace phoenix {
+	//! Coroutine that starts right away and frees itself once done, for handlers that outlive their caller
+	/**
+	 * Frames are drawn from the PacketPool of the thread that starts the coroutine. Anything the coroutine uses after
+	 * its first suspension must be held by value, in its parameters or locals.
+	 */
+	class Task
+	{
+	public:
+		struct promise_type
+		{
+			Task get_return_object() { return Task(); }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+
+			void unhandled_exception()
+			{
+				try {
+					throw;
+				}
+				catch (std::exception &e) {
+					std::cout << "phoenix::Task: unhandled exception: " << e.what() << std::endl;
+				}
+				catch (...) {
+					std::cout << "phoenix::Task: unhandled exception" << std::endl;
+				}
+			}
+
+			static void* operator new(size_t size) { return PacketPool::allocate(size); }
+			static void operator delete(void *p) { PacketPool::deallocate(p); }
+		};
+	};
+
+	struct ReadResult
+	{
+		//! Null on error
+		PacketPtr packet;
+		boost::system::error_code error;
+	};
+
+	//! Awaits the next frame of a connection. See NetworkConnection::beginReading
+	/**
+	 * The connection's read timeout still applies: a connection idle for too long is closed, and the read resumes with
+	 * an error. So does a connection handed over to another process, with operation_aborted
+	 */
+	class ReadAwaitable
+	{
+	public:
+		explicit ReadAwaitable(NetworkConnection &connection) : m_connection(connection) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			ReadResult *result = &m_result;
+			m_connection.beginReading([result, handle](PacketPtr packet, boost::system::error_code error) {
+				result->packet = packet;
+				result->error = error;
+				handle.resume();
+			});
+		}
+
+		ReadResult await_resume() { return std::move(m_result); }
+
+	private:
+		NetworkConnection &m_connection;
+		ReadResult m_result;
+	};
+
+	//! Awaits a packet being written. See NetworkConnection::send
+	class SendAwaitable
+	{
+	public:
+		SendAwaitable(NetworkConnection &connection, PacketPtr packet) : m_connection(connection), m_packet(packet) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			boost::system::error_code *result = &m_error;
+			m_connection.send(std::move(m_packet), [result, handle](boost::system::error_code error, size_t) {
+				*result = error;
+				handle.resume();
+			});
+		}
+
+		boost::system::error_code await_resume() { return m_error; }
+
+	private:
+		NetworkConnection &m_connection;
+		PacketPtr m_packet;
+		boost::system::error_code m_error;
+	};
+
+	//! Moves the coroutine onto a strand, e.g. a connection's after awaiting something that resumes elsewhere
+	class StrandAwaitable
+	{
+	public:
+		explicit StrandAwaitable(boost::asio::io_service::strand &strand) : m_strand(strand) {}
+
+		bool await_ready() const noexcept { return m_strand.running_in_this_thread(); }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			m_strand.post([handle]() { handle.resume(); });
+		}
+
+		void await_resume() {}
+
+	private:
+		boost::asio::io_service::strand &m_strand;
+	};
+
+	inline ReadAwaitable read(NetworkConnection &connection) { return ReadAwaitable(connection); }
+	inline SendAwaitable send(NetworkConnection &connection, PacketPtr packet) { return SendAwaitable(connection, packet); }
+	inline StrandAwaitable resumeOn(boost::asio::io_service::strand &strand) { return StrandAwaitable(strand); }
+}
+
+#endif
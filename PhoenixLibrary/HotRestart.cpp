@@ -0,0 +1,410 @@
+#include "HotRestart.h"
+#include "NetworkConnection.h"
+#include "NetworkListener.h"
+#include "NetworkManager.h"
+#include "NetworkService.h"
+
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+
+#if !defined _WIN32 && !defined _WIN64
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define PHOENIX_HOT_RESTART
+#endif
+
+using boost::asio::ip::tcp;
+
+#ifdef PHOENIX_HOT_RESTART
+namespace {
+	enum class Message : uint8_t {
+		Listener = 1,
+		Connection = 2,
+		Done = 3
+	};
+
+	enum {
+		//! Largest message payload, descriptors apart
+		maxMessageSize = 1024,
+		//! Most descriptors sent along with a single message
+		maxDescriptors = 64
+	};
+
+	//! Builds the payload of a message
+	class MessageWriter
+	{
+	public:
+		explicit MessageWriter(Message type) { put<uint8_t>((uint8_t)type); }
+
+		template <typename T>
+		MessageWriter& put(T value) {
+			const uint8_t *bytes = (const uint8_t*)&value;
+			m_data.insert(m_data.end(), bytes, bytes + sizeof(T));
+			return *this;
+		}
+
+		MessageWriter& put(const std::string &value) {
+			put<uint16_t>((uint16_t)value.size());
+			m_data.insert(m_data.end(), value.begin(), value.end());
+			return *this;
+		}
+
+		const std::vector<uint8_t>& data() const { return m_data; }
+
+	private:
+		std::vector<uint8_t> m_data;
+	};
+
+	//! Reads the payload of a message, failing instead of reading past its end
+	class MessageReader
+	{
+	public:
+		MessageReader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_pos(0), m_ok(true) { }
+
+		template <typename T>
+		T get() {
+			T value = T();
+			if (m_pos + sizeof(T) > m_size) m_ok = false;
+			else {
+				std::memcpy(&value, m_data + m_pos, sizeof(T));
+				m_pos += sizeof(T);
+			}
+			return value;
+		}
+
+		std::string getString() {
+			size_t length = get<uint16_t>();
+			if (!m_ok || m_pos + length > m_size) {
+				m_ok = false;
+				return std::string();
+			}
+
+			std::string value((const char*)m_data + m_pos, length);
+			m_pos += length;
+			return value;
+		}
+
+		bool ok() const { return m_ok; }
+
+	private:
+		const uint8_t *m_data;
+		size_t m_size;
+		size_t m_pos;
+		bool m_ok;
+	};
+
+	bool sendMessage(int socket, const MessageWriter &message, const std::vector<int> &descriptors)
+	{
+		if (descriptors.size() > maxDescriptors) return false;
+
+		iovec iov;
+		iov.iov_base = (void*)message.data().data();
+		iov.iov_len = message.data().size();
+
+		msghdr header;
+		std::memset(&header, 0, sizeof(header));
+		header.msg_iov = &iov;
+		header.msg_iovlen = 1;
+
+		std::vector<char> control;
+		if (!descriptors.empty()) {
+			control.resize(CMSG_SPACE(sizeof(int) * descriptors.size()));
+			header.msg_control = control.data();
+			header.msg_controllen = control.size();
+
+			cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * descriptors.size());
+			std::memcpy(CMSG_DATA(cmsg), descriptors.data(), sizeof(int) * descriptors.size());
+		}
+
+		return ::sendmsg(socket, &header, 0) == (ssize_t)iov.iov_len;
+	}
+
+	bool receiveMessage(int socket, std::vector<uint8_t> &payload, std::vector<int> &descriptors)
+	{
+		payload.resize(maxMessageSize);
+		descriptors.clear();
+
+		iovec iov;
+		iov.iov_base = payload.data();
+		iov.iov_len = payload.size();
+
+		std::vector<char> control(CMSG_SPACE(sizeof(int) * maxDescriptors));
+
+		msghdr header;
+		std::memset(&header, 0, sizeof(header));
+		header.msg_iov = &iov;
+		header.msg_iovlen = 1;
+		header.msg_control = control.data();
+		header.msg_controllen = control.size();
+
+		ssize_t received = ::recvmsg(socket, &header, 0);
+		if (received <= 0) return false;
+		payload.resize(received);
+
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const int *received = (const int*)CMSG_DATA(cmsg);
+			descriptors.insert(descriptors.end(), received, received + count);
+		}
+
+		// A truncated message may have lost descriptors as well, close whatever came
+		if (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+			for (int descriptor : descriptors) ::close(descriptor);
+			descriptors.clear();
+			return false;
+		}
+
+		return true;
+	}
+
+	bool makeAddress(const std::string &path, sockaddr_un &address)
+	{
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path)) return false;
+
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+		return true;
+	}
+}
+#endif
+
+HotRestart::HotRestart(NetworkManager &network, const std::string &path, bool handOverConnections)
+	: m_network(network), m_path(path), m_handOverConnections(handOverConnections), m_server(-1)
+{
+}
+
+HotRestart::~HotRestart()
+{
+	stop();
+}
+
+bool HotRestart::takeOver(std::vector<ListenerHandoff> &listeners, std::vector<ConnectionHandoff> &connections)
+{
+#ifdef PHOENIX_HOT_RESTART
+	sockaddr_un address;
+	if (!makeAddress(m_path, address)) return false;
+
+	int peer = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (peer < 0) return false;
+
+	if (::connect(peer, (sockaddr*)&address, sizeof(address)) != 0) {
+		// Nobody serving, this is a cold start
+		::close(peer);
+		return false;
+	}
+
+	std::cout << ">> Taking over from the server running at " << m_path << std::endl;
+
+	std::vector<uint8_t> payload;
+	std::vector<int> descriptors;
+	bool done = false;
+
+	while (!done && receiveMessage(peer, payload, descriptors)) {
+		MessageReader reader(payload.data(), payload.size());
+
+		switch ((Message)reader.get<uint8_t>()) {
+		case Message::Listener: {
+			std::string addressString = reader.getString();
+			uint16_t port = reader.get<uint16_t>();
+			boost::system::error_code ec;
+			auto listenerAddress = boost::asio::ip::address::from_string(addressString, ec);
+
+			if (reader.ok() && !ec) {
+				listeners.push_back({ tcp::endpoint(listenerAddress, port), descriptors });
+				descriptors.clear();
+			}
+			break;
+		}
+		case Message::Connection: {
+			ConnectionHandoff connection;
+			connection.service = reader.getString();
+			connection.hasKeys = reader.get<uint8_t>() != 0;
+			for (auto &key : connection.keys) key = reader.get<uint32_t>();
+
+			if (reader.ok() && descriptors.size() == 1) {
+				connection.descriptor = descriptors.front();
+				connections.push_back(connection);
+				descriptors.clear();
+			}
+			break;
+		}
+		case Message::Done:
+			done = true;
+			break;
+		}
+
+		// Descriptors of anything malformed
+		for (int descriptor : descriptors) ::close(descriptor);
+	}
+
+	::close(peer);
+
+	if (!done) std::cout << ">>> Hot restart: the previous server stopped before handing everything over" << std::endl;
+	std::cout << ">>> Received " << listeners.size() << " listener(s) and " << connections.size() << " connection(s)" << std::endl;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void HotRestart::closeDescriptor(int descriptor)
+{
+#ifdef PHOENIX_HOT_RESTART
+	::close(descriptor);
+#endif
+}
+
+void HotRestart::serve()
+{
+#ifdef PHOENIX_HOT_RESTART
+	if (m_thread.joinable()) return;
+
+	sockaddr_un address;
+	if (!makeAddress(m_path, address)) {
+		std::cout << ">>> Hot restart: socket path too long: " << m_path << std::endl;
+		return;
+	}
+
+	int server = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (server < 0) return;
+
+	// The predecessor is done with the path by now
+	::unlink(m_path.c_str());
+	if (::bind(server, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(server, 1) != 0) {
+		std::cout << ">>> Hot restart: could not listen at " << m_path << ": " << std::strerror(errno) << std::endl;
+		::close(server);
+		return;
+	}
+
+	m_server = server;
+	m_thread = std::thread([this]() { run(); });
+#else
+	std::cout << ">>> Hot restart is not supported on this platform" << std::endl;
+#endif
+}
+
+void HotRestart::stop()
+{
+#ifdef PHOENIX_HOT_RESTART
+	int server = m_server.exchange(-1);
+	if (server >= 0) {
+		// Wakes the thread up from accept
+		::shutdown(server, SHUT_RDWR);
+		::close(server);
+	}
+
+	if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+		m_thread.join();
+#endif
+}
+
+void HotRestart::run()
+{
+#ifdef PHOENIX_HOT_RESTART
+	int server = m_server.load();
+	if (server < 0) return;
+
+	int peer = ::accept(server, nullptr, nullptr);
+	if (peer < 0) return;
+
+	// Only the first successor gets anything, and the path is now its own
+	if (m_server.exchange(-1) >= 0) ::close(server);
+
+	std::cout << ">> A new server is taking over, handing the network over" << std::endl;
+	handOver(peer);
+	::close(peer);
+
+	drain();
+#endif
+}
+
+void HotRestart::handOver(int peer)
+{
+#ifdef PHOENIX_HOT_RESTART
+	// Listeners are only touched from the main io service
+	std::promise<std::vector<std::shared_ptr<NetworkListener>>> released;
+	m_network.getIoService().post([this, &released]() {
+		std::vector<std::shared_ptr<NetworkListener>> listeners(m_network.getListeners().begin(), m_network.getListeners().end());
+		released.set_value(listeners);
+	});
+	auto listeners = released.get_future().get();
+
+	for (auto &listener : listeners) {
+		std::promise<std::vector<int>> descriptors;
+		m_network.getIoService().post([&listener, &descriptors]() { descriptors.set_value(listener->releaseAcceptors()); });
+
+		auto sent = descriptors.get_future().get();
+		if (sent.empty()) continue;
+
+		MessageWriter message(Message::Listener);
+		message.put(listener->getAddress()).put<uint16_t>(listener->getPort());
+		if (!sendMessage(peer, message, sent))
+			std::cout << ">>> Hot restart: failed to hand over " << listener->getAddress() << ":" << listener->getPort() << std::endl;
+
+		// The successor has its own copies now
+		for (int descriptor : sent) ::close(descriptor);
+	}
+
+	size_t handedOver = 0;
+	if (m_handOverConnections) {
+		for (auto &listener : listeners) {
+			for (auto &connection : listener->getConnections()) {
+				auto service = connection->service();
+				if (!service) continue;
+
+				// Only the connection's strand may touch its socket
+				std::promise<int> released;
+				connection->strand().dispatch([&connection, &released]() { released.set_value(connection->releaseSocket()); });
+
+				int descriptor = released.get_future().get();
+				if (descriptor < 0) continue;
+
+				MessageWriter message(Message::Connection);
+				message.put(service->getName()).put<uint8_t>(connection->hasKeys() ? 1 : 0);
+				for (auto key : connection->getKeys()) message.put<uint32_t>(key);
+
+				if (sendMessage(peer, message, std::vector<int>(1, descriptor))) {
+					listener->releaseConnection(connection);
+					++handedOver;
+				}
+				::close(descriptor);
+			}
+		}
+	}
+
+	sendMessage(peer, MessageWriter(Message::Done), std::vector<int>());
+
+	std::cout << ">>> Handed over " << listeners.size() << " listener(s) and " << handedOver << " connection(s)" << std::endl;
+#endif
+}
+
+void HotRestart::drain()
+{
+	std::cout << ">> Draining, the server will stop once its connections are gone" << std::endl;
+
+	while (true) {
+		std::promise<size_t> count;
+		m_network.getIoService().post([this, &count]() {
+			size_t connections = 0;
+			for (auto &listener : m_network.getListeners())
+				connections += listener->getConnectionCount();
+			count.set_value(connections);
+		});
+
+		if (count.get_future().get() == 0) break;
+
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+	}
+
+	m_network.getIoService().post([this]() { m_network.stop(); });
+}
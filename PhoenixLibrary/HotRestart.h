@@ -0,0 +1,67 @@
+#pragma once
+
+#include "NetworkDefinitions.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+//! Hands the listening sockets, and optionally the live connections, over to a new server process
+/**
+ * A running server waits for its successor on a Unix domain socket. When the successor connects, the server sends it
+ * every listening socket and, if enabled, every idle connection along with its XTEA keys and service, then stops
+ * accepting and drains: it exits once its remaining connections are gone. The successor takes the sockets over
+ * instead of binding, so no connection attempt is refused meanwhile, and then waits for its own successor.
+ *
+ * Descriptors travel as SCM_RIGHTS messages, so this is only available on POSIX systems.
+ */
+class HotRestart
+{
+public:
+	//! Listening sockets of one listener
+	struct ListenerHandoff
+	{
+		boost::asio::ip::tcp::endpoint endpoint;
+		std::vector<int> descriptors;
+	};
+
+	//! A live connection and what is needed to carry on with it
+	struct ConnectionHandoff
+	{
+		int descriptor;
+		std::string service;
+		bool hasKeys;
+		std::array<uint32_t, 4> keys;
+	};
+
+	HotRestart(NetworkManager &network, const std::string &path, bool handOverConnections);
+	~HotRestart();
+
+	//! Receives the sockets of the process serving at the path, if there is one
+	/**
+	 * @returns false if no process was serving, in which case listeners must bind as usual
+	 */
+	bool takeOver(std::vector<ListenerHandoff> &listeners, std::vector<ConnectionHandoff> &connections);
+
+	//! Closes a descriptor that was handed over but found no use
+	static void closeDescriptor(int descriptor);
+
+	//! Starts waiting for a successor, in a thread of its own
+	void serve();
+	//! Stops waiting for a successor
+	void stop();
+
+private:
+	NetworkManager &m_network;
+	std::string m_path;
+	bool m_handOverConnections;
+	std::thread m_thread;
+	std::atomic<int> m_server;
+
+	void run();
+	void handOver(int peer);
+	void drain();
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+//! Bounded queue that any number of threads may push to and pop from without locking
+/**
+ * Cells are preallocated in a ring, and each carries a sequence number telling whether it is free to push to or ready
+ * to pop from, so a push or pop is a single compare-and-swap on the uncontended path. Pushes fail instead of waiting
+ * when the queue is full.
+ */
+template <typename T>
+class LockFreeQueue
+{
+public:
+	//! The capacity is rounded up to a power of two
+	explicit LockFreeQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity) size <<= 1;
+
+		m_cells.reset(new Cell[size]);
+		m_mask = size - 1;
+		for (size_t i = 0; i < size; ++i)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+
+		m_pushPosition.store(0, std::memory_order_relaxed);
+		m_popPosition.store(0, std::memory_order_relaxed);
+	}
+
+	//! Returns false, leaving value untouched, when the queue is full
+	bool push(T &&value)
+	{
+		size_t position = m_pushPosition.load(std::memory_order_relaxed);
+		Cell *cell;
+
+		while (true) {
+			cell = &m_cells[position & m_mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t difference = (std::ptrdiff_t)sequence - (std::ptrdiff_t)position;
+
+			if (difference == 0) {
+				if (m_pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			}
+			else if (difference < 0) return false;
+			else position = m_pushPosition.load(std::memory_order_relaxed);
+		}
+
+		cell->value = std::move(value);
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool push(const T &value)
+	{
+		T copy(value);
+		return push(std::move(copy));
+	}
+
+	//! Returns false when the queue is empty
+	bool pop(T &value)
+	{
+		size_t position = m_popPosition.load(std::memory_order_relaxed);
+		Cell *cell;
+
+		while (true) {
+			cell = &m_cells[position & m_mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t difference = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(position + 1);
+
+			if (difference == 0) {
+				if (m_popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			}
+			else if (difference < 0) return false;
+			else position = m_popPosition.load(std::memory_order_relaxed);
+		}
+
+		value = std::move(cell->value);
+		// Don't keep what was popped alive until the cell is reused
+		cell->value = T();
+		cell->sequence.store(position + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! Whether nothing was pushed that wasn't popped. A push still being completed already counts
+	bool empty() const
+	{
+		return m_pushPosition.load() == m_popPosition.load();
+	}
+
+	size_t capacity() const { return m_mask + 1; }
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> m_cells;
+	size_t m_mask;
+	// Keeps the producers' and consumers' positions on cache lines of their own
+	char m_padding0[64];
+	std::atomic<size_t> m_pushPosition;
+	char m_padding1[64];
+	std::atomic<size_t> m_popPosition;
+	char m_padding2[64];
+
+	LockFreeQueue(const LockFreeQueue&);
+	LockFreeQueue& operator=(const LockFreeQueue&);
+};
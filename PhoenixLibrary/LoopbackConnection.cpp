@@ -0,0 +1,134 @@
+#include "LoopbackConnection.h"
+
+LoopbackConnection::LoopbackConnection(boost::asio::io_service &ioService, bool checksummed)
+	: NetworkConnection(ioService), m_inbound(LoopbackConnection::queueSize), m_outbound(LoopbackConnection::queueSize), m_checksummed(checksummed)
+{
+	m_closed = false;
+	m_peerClosed = false;
+	m_parked = false;
+	m_reading = false;
+}
+
+LoopbackConnection::~LoopbackConnection()
+{
+	// Like a process exiting with the socket open, the peer sees the connection go away
+	if (auto peer = m_peer.lock()) peer->peerClosed();
+}
+
+void LoopbackConnection::connect(std::shared_ptr<LoopbackConnection> first, std::shared_ptr<LoopbackConnection> second)
+{
+	first->m_peer = second;
+	second->m_peer = first;
+}
+
+bool LoopbackConnection::deliver(PacketPtr data)
+{
+	if (m_closed || !m_inbound.push(std::move(data)))
+		return false;
+
+	// Pairs with the fence in pull, so either the read sees this push or this sees the read parked
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_parked.load(std::memory_order_relaxed)) wake();
+
+	return true;
+}
+
+bool LoopbackConnection::receive(PacketPtr &packet)
+{
+	return m_outbound.pop(packet);
+}
+
+void LoopbackConnection::close()
+{
+	bool wasClosed = m_closed.exchange(true);
+	NetworkConnection::close();
+	if (wasClosed) return;
+
+	if (auto peer = m_peer.lock()) peer->peerClosed();
+
+	// A parked read must learn that the connection is gone
+	wake();
+}
+
+void LoopbackConnection::peerClosed()
+{
+	m_peerClosed = true;
+	wake();
+}
+
+void LoopbackConnection::wake()
+{
+	if (!m_parked.exchange(false)) return;
+
+	NetworkConnectionPtr self = shared_from_this();
+	strand().post([this, self]() { pull(); });
+}
+
+void LoopbackConnection::startRead()
+{
+	// Reads are always posted, so a long run of queued frames doesn't nest handlers on the stack
+	if (m_reading) return;
+	m_reading = true;
+
+	NetworkConnectionPtr self = shared_from_this();
+	strand().post([this, self]() { pull(); });
+}
+
+void LoopbackConnection::pull()
+{
+	if (m_closed) {
+		m_reading = false;
+		handleRead(boost::asio::error::operation_aborted, 0);
+		return;
+	}
+
+	// Like a socket read, take whatever is there up to a buffer's worth
+	size_t bytes = 0;
+	PacketPtr data;
+	while (bytes < NetworkConnection::readBufferSize && m_inbound.pop(data)) {
+		appendReadBuffer(data->data() + data->start(), data->size());
+		bytes += data->size();
+	}
+
+	if (bytes > 0) {
+		m_reading = false;
+		handleRead(boost::system::error_code(), 0);
+		return;
+	}
+
+	if (m_peerClosed) {
+		m_reading = false;
+		handleRead(boost::asio::error::eof, 0);
+		return;
+	}
+
+	m_parked = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	// Something delivered, or closed, before parking found nothing to wake
+	if (!m_inbound.empty() || m_closed || m_peerClosed) wake();
+}
+
+void LoopbackConnection::enqueue(PacketPtr packet, WriteHandler handler)
+{
+	boost::system::error_code error;
+	size_t bytes = packet->size();
+
+	if (m_closed) error = boost::asio::error::not_connected;
+	else if (m_peerClosed) error = boost::asio::error::broken_pipe;
+	else if (auto peer = m_peer.lock()) {
+		if (!peer->deliver(packet)) error = boost::asio::error::no_buffer_space;
+	}
+	else if (!m_outbound.push(packet)) error = boost::asio::error::no_buffer_space;
+
+	if (!handler) return;
+
+	// Like a socket write completing, the handler runs later on the strand: the sender may hold locks it takes
+	NetworkConnectionPtr self = shared_from_this();
+	strand().post([self, handler, error, bytes]() { handler(error, bytes); });
+}
+
+bool LoopbackConnection::needChecksum()
+{
+	return m_checksummed || NetworkConnection::needChecksum();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "NetworkConnection.h"
+#include "LockFreeQueue.h"
+
+#include <atomic>
+#include <memory>
+
+//! Connection that exchanges frames through in-memory queues instead of a socket
+/**
+ * Sent packets are encoded exactly like on a socket and received frames go through the same reader, decryption and
+ * checksum, so services can't tell the difference; only the kernel is left out. That lets a harness drive a service at
+ * memory speed, e.g. by handing the connection to NetworkListener::serveConnection, and profiles of it show the service
+ * alone.
+ *
+ * Two connections joined with connect() receive what the other sends, so the peer can be a regular client written
+ * against NetworkConnection. Unjoined connections keep what they send for the harness to take with receive(), and get
+ * whatever it delivers. Both ends may be used from any thread. Loopback connections have no read timeout.
+ */
+class LoopbackConnection
+	: public NetworkConnection
+{
+public:
+	enum {
+		//! Frames each direction holds before deliveries and sends fail
+		queueSize = 1024
+	};
+
+	//! checksummed makes the connection checksum its frames even without a service, as the clients of services do
+	LoopbackConnection(boost::asio::io_service &ioService, bool checksummed = false);
+	~LoopbackConnection();
+
+	//! Joins two connections, each receiving what the other sends
+	static void connect(std::shared_ptr<LoopbackConnection> first, std::shared_ptr<LoopbackConnection> second);
+
+	//! Hands bytes to the connection as if its peer had written them, whole frames or not. False when the queue is full
+	bool deliver(PacketPtr data);
+	//! Takes the next packet the connection sent, encoded as it would have been written. False when there is none
+	/**
+	 * Broadcasts share one encoded packet between connections, so packets taken must not be modified
+	 */
+	bool receive(PacketPtr &packet);
+	//! Acts as if the peer closed the connection: reads fail with eof once everything delivered was read
+	void peerClosed();
+
+	virtual void close();
+	virtual bool isOpen() { return !m_closed; }
+	virtual boost::asio::ip::tcp::endpoint remoteEndpoint() { return m_remoteEndpoint; }
+	//! Sets the address services see for the peer, unspecified by default
+	void remoteEndpoint(boost::asio::ip::tcp::endpoint endpoint) { m_remoteEndpoint = endpoint; }
+
+protected:
+	virtual void startRead();
+	virtual void enqueue(PacketPtr packet, WriteHandler handler);
+	virtual bool needChecksum();
+
+private:
+	LockFreeQueue<PacketPtr> m_inbound;
+	LockFreeQueue<PacketPtr> m_outbound;
+	std::weak_ptr<LoopbackConnection> m_peer;
+	boost::asio::ip::tcp::endpoint m_remoteEndpoint;
+	bool m_checksummed;
+
+	std::atomic<bool> m_closed;
+	//! The peer closed: reads fail once everything it sent was read
+	std::atomic<bool> m_peerClosed;
+	//! A read found nothing, and waits for the next delivery to resume it
+	std::atomic<bool> m_parked;
+	//! A read is posted or parked. Only touched on the strand
+	bool m_reading;
+
+	void pull();
+	void wake();
+};
@@ -6,10 +6,23 @@ void LuaNetworkService::initialize(lua_State *L, const std::string &name) {
 	this->L = lua_newthread(L);
 	lua_pop(L, 1);
 	this->name = name;
+	this->outputInterval = 0;
+	m_stateLock = &lua_statelock(L);
+}
+
+NetworkService::OutputPolicy LuaNetworkService::getOutputPolicy()
+{
+	OutputPolicy policy;
+	policy.mode = outputInterval > 0 ? OutputPolicy::PerTick : OutputPolicy::Immediate;
+	policy.interval = outputInterval;
+
+	return policy;
 }
 
 bool LuaNetworkService::canHandle(NetworkConnectionPtr connection, PacketPtr packet)
 {
+	std::lock_guard<std::recursive_mutex> lock(*m_stateLock);
+
 	if (lua_getglobal(L, "canHandle") != LUA_TFUNCTION) {
 		lua_pop(L, 1);
 		return false;
@@ -27,6 +40,8 @@ bool LuaNetworkService::canHandle(NetworkConnectionPtr connection, PacketPtr pac
 
 bool LuaNetworkService::handleFirst(NetworkConnectionPtr connection, PacketPtr packet)
 {
+	std::lock_guard<std::recursive_mutex> lock(*m_stateLock);
+
 	if (lua_getglobal(L, "handleFirst") != LUA_TFUNCTION) {
 		lua_pop(L, 1);
 		return false;
@@ -44,6 +59,8 @@ bool LuaNetworkService::handleFirst(NetworkConnectionPtr connection, PacketPtr p
 
 bool LuaNetworkService::handle(NetworkConnectionPtr connection, PacketPtr packet)
 {
+	std::lock_guard<std::recursive_mutex> lock(*m_stateLock);
+
 	if (lua_getglobal(L, "handle") != LUA_TFUNCTION) {
 		lua_pop(L, 1);
 		return false;
@@ -61,6 +78,8 @@ bool LuaNetworkService::handle(NetworkConnectionPtr connection, PacketPtr packet
 
 void LuaNetworkService::removeConnection(NetworkConnectionPtr connection)
 {
+	std::lock_guard<std::recursive_mutex> lock(*m_stateLock);
+
 	if (lua_getglobal(L, "removeConnection") != LUA_TFUNCTION) {
 		lua_pop(L, 1);
 		return;
@@ -73,6 +92,8 @@ void LuaNetworkService::removeConnection(NetworkConnectionPtr connection)
 
 void LuaPacketSerializable::read(Packet &packet)
 {
+	std::lock_guard<std::recursive_mutex> lock(*m_stateLock);
+
 	if (lua_getglobal(L, "read") != LUA_TFUNCTION)
 	{
 		lua_pop(L, 1);
@@ -86,6 +107,8 @@ void LuaPacketSerializable::read(Packet &packet)
 
 void LuaPacketSerializable::write(Packet &packet) const
 {
+	std::lock_guard<std::recursive_mutex> lock(*m_stateLock);
+
 	if (lua_getglobal(L, "write") != LUA_TFUNCTION)
 	{
 		lua_pop(L, 1);
@@ -100,4 +123,5 @@ void LuaPacketSerializable::write(Packet &packet) const
 void LuaPacketSerializable::initialize(lua_State *L)
 {
 	this->L = L;
+	m_stateLock = &lua_statelock(L);
 }
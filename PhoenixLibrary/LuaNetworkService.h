@@ -4,6 +4,7 @@
 
 #include <lua.hpp>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 class LuaRunnable
@@ -34,6 +35,7 @@ public:
 	virtual unsigned short getBindPort() { return bindPort; }
 
 	virtual bool needChecksum() { return checksum; }
+	virtual OutputPolicy getOutputPolicy();
 
 	virtual bool canHandle(NetworkConnectionPtr connection, PacketPtr packet);
 	virtual bool handleFirst(NetworkConnectionPtr connection, PacketPtr packet);
@@ -43,9 +45,13 @@ public:
 	std::string bindAddress;
 	unsigned short bindPort;
 	bool checksum;
+	//! Milliseconds between flushes of the connections' outgoing frames, zero to write packets as they are sent
+	unsigned int outputInterval;
 
 private:
 	std::string name;
+	//! The script's lock, see lua_statelock
+	std::recursive_mutex *m_stateLock;
 };
 
 class LuaPacketSerializable :
@@ -57,4 +63,8 @@ public:
 	virtual void write(Packet &packet) const;
 
 	void initialize(lua_State *L);
+
+private:
+	//! The script's lock, see lua_statelock
+	std::recursive_mutex *m_stateLock;
 };
@@ -0,0 +1,158 @@
+#include "Metrics.h"
+
+namespace {
+	std::atomic<size_t> g_nextShard(0);
+
+	//! Position of the highest bit set. value must not be 0
+	unsigned int highestBit(uint64_t value)
+	{
+		unsigned int bit = 0;
+		while (value >>= 1) ++bit;
+		return bit;
+	}
+}
+
+size_t Metrics::shard()
+{
+	static thread_local size_t shard = g_nextShard.fetch_add(1, std::memory_order_relaxed) % shardCount;
+	return shard;
+}
+
+Metrics::Counter::Counter()
+{
+	for (auto &shard : m_shards)
+		shard.value.store(0, std::memory_order_relaxed);
+}
+
+void Metrics::Counter::add(uint64_t count)
+{
+	m_shards[shard()].value.fetch_add(count, std::memory_order_relaxed);
+}
+
+uint64_t Metrics::Counter::value() const
+{
+	uint64_t total = 0;
+	for (auto &shard : m_shards)
+		total += shard.value.load(std::memory_order_relaxed);
+
+	return total;
+}
+
+Metrics::Histogram::Histogram()
+	: m_shards(new Shard[shardCount])
+{
+	for (size_t i = 0; i < shardCount; ++i) {
+		for (auto &bucket : m_shards[i].buckets)
+			bucket.store(0, std::memory_order_relaxed);
+		m_shards[i].sum.store(0, std::memory_order_relaxed);
+	}
+}
+
+size_t Metrics::Histogram::bucketFor(uint64_t value)
+{
+	if (value < subBuckets) return (size_t)value;
+
+	unsigned int exponent = highestBit(value);
+	if (exponent >= maxExponent) return bucketCount - 1;
+
+	// The 3 bits under the highest one pick the sub-bucket
+	size_t sub = (size_t)(value >> (exponent - 3)) & (subBuckets - 1);
+	return subBuckets + (exponent - 3) * subBuckets + sub;
+}
+
+uint64_t Metrics::Histogram::bucketLimit(size_t bucket)
+{
+	if (bucket < subBuckets) return bucket;
+
+	unsigned int shift = (unsigned int)((bucket - subBuckets) / subBuckets);
+	uint64_t sub = (bucket - subBuckets) % subBuckets;
+
+	return ((subBuckets + sub + 1) << shift) - 1;
+}
+
+void Metrics::Histogram::record(uint64_t value)
+{
+	Shard &shard = m_shards[Metrics::shard()];
+	shard.buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+	shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+Metrics::Histogram::Summary Metrics::Histogram::summary() const
+{
+	uint64_t merged[bucketCount] = {};
+	Summary summary = {};
+
+	for (size_t i = 0; i < shardCount; ++i) {
+		for (size_t bucket = 0; bucket < bucketCount; ++bucket) {
+			uint64_t count = m_shards[i].buckets[bucket].load(std::memory_order_relaxed);
+			merged[bucket] += count;
+			summary.count += count;
+		}
+		summary.sum += m_shards[i].sum.load(std::memory_order_relaxed);
+	}
+
+	if (summary.count == 0) return summary;
+
+	struct Percentile { double fraction; uint64_t *value; };
+	Percentile percentiles[] = {
+		{ 0.5, &summary.p50 }, { 0.9, &summary.p90 }, { 0.99, &summary.p99 }, { 0.999, &summary.p999 }
+	};
+
+	uint64_t seen = 0;
+	size_t next = 0;
+	for (size_t bucket = 0; bucket < bucketCount; ++bucket) {
+		if (merged[bucket] == 0) continue;
+		seen += merged[bucket];
+		summary.max = bucketLimit(bucket);
+
+		while (next < sizeof(percentiles) / sizeof(percentiles[0]) && seen >= percentiles[next].fraction * summary.count)
+			*percentiles[next++].value = summary.max;
+	}
+
+	return summary;
+}
+
+Metrics::Counter& Metrics::counter(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	auto &counter = m_counters[name];
+	if (!counter) counter.reset(new Counter);
+
+	return *counter;
+}
+
+Metrics::Gauge& Metrics::gauge(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	auto &gauge = m_gauges[name];
+	if (!gauge) gauge.reset(new Gauge);
+
+	return *gauge;
+}
+
+Metrics::Histogram& Metrics::histogram(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	auto &histogram = m_histograms[name];
+	if (!histogram) histogram.reset(new Histogram);
+
+	return *histogram;
+}
+
+Metrics::Snapshot Metrics::snapshot()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Snapshot snapshot;
+
+	for (auto &counter : m_counters)
+		snapshot.counters[counter.first] = counter.second->value();
+	for (auto &gauge : m_gauges)
+		snapshot.gauges[gauge.first] = gauge.second->value();
+	for (auto &histogram : m_histograms)
+		snapshot.histograms[histogram.first] = histogram.second->summary();
+
+	return snapshot;
+}
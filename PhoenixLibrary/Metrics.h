@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+//! Registry of named counters, gauges and latency histograms, shared by the server, its plugins and its scripts
+/**
+ * Recording only touches the calling thread's shard of a metric, so threads recording the same metric don't contend
+ * for its cache lines; shards are only summed when a metric is read. Metrics are created on first use and live as long
+ * as the registry. Looking one up by name takes a lock, so hot paths look their metrics up once and keep the reference.
+ *
+ * One registry is shared by everything, through ComponentManager::getMetrics.
+ */
+class Metrics
+{
+public:
+	enum {
+		//! Shards of each metric. Threads are spread over them in turn
+		shardCount = 16
+	};
+
+	//! Monotonic count of events
+	class Counter
+	{
+	public:
+		Counter();
+
+		void add(uint64_t count = 1);
+		uint64_t value() const;
+
+	private:
+		struct Shard
+		{
+			std::atomic<uint64_t> value;
+			char padding[64 - sizeof(std::atomic<uint64_t>)];
+		};
+
+		Shard m_shards[shardCount];
+	};
+
+	//! Current level of something, e.g. a queue's size. Set by a single owner, so it isn't sharded
+	class Gauge
+	{
+	public:
+		Gauge() : m_value(0) {}
+
+		void set(int64_t value) { m_value.store(value, std::memory_order_relaxed); }
+		void add(int64_t delta) { m_value.fetch_add(delta, std::memory_order_relaxed); }
+		int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<int64_t> m_value;
+	};
+
+	//! Distribution of values, usually durations in nanoseconds, in buckets of bounded relative error
+	/**
+	 * Like HdrHistogram, each power of two is split in subBuckets linear buckets, so any value is reported within
+	 * 1 / subBuckets of what was recorded, from 0 up to 2^maxExponent. Larger values land in the last bucket.
+	 */
+	class Histogram
+	{
+	public:
+		enum {
+			subBuckets = 8,
+			maxExponent = 40,
+			//! Values below subBuckets get a bucket each, then every power of two gets subBuckets
+			bucketCount = subBuckets + (maxExponent - 3) * subBuckets
+		};
+
+		struct Summary
+		{
+			uint64_t count;
+			uint64_t sum;
+			uint64_t p50;
+			uint64_t p90;
+			uint64_t p99;
+			uint64_t p999;
+			//! Upper bound of the highest bucket recorded to
+			uint64_t max;
+		};
+
+		Histogram();
+
+		void record(uint64_t value);
+		//! Merges the shards and reads the percentiles off the merged buckets
+		Summary summary() const;
+
+		static size_t bucketFor(uint64_t value);
+		//! Highest value that lands in bucket
+		static uint64_t bucketLimit(size_t bucket);
+
+	private:
+		struct Shard
+		{
+			std::atomic<uint64_t> buckets[bucketCount];
+			std::atomic<uint64_t> sum;
+			char padding[64 - sizeof(std::atomic<uint64_t>)];
+		};
+
+		std::unique_ptr<Shard[]> m_shards;
+	};
+
+	struct Snapshot
+	{
+		std::map<std::string, uint64_t> counters;
+		std::map<std::string, int64_t> gauges;
+		std::map<std::string, Histogram::Summary> histograms;
+	};
+
+	//! Returns the metric called name, creating it on first use
+	Counter& counter(const std::string &name);
+	Gauge& gauge(const std::string &name);
+	Histogram& histogram(const std::string &name);
+
+	//! Reads every metric. Recording goes on meanwhile, so metrics are not read at one same instant
+	Snapshot snapshot();
+
+	//! Shard of the calling thread
+	static size_t shard();
+
+private:
+	std::mutex m_lock;
+	std::map<std::string, std::unique_ptr<Counter>> m_counters;
+	std::map<std::string, std::unique_ptr<Gauge>> m_gauges;
+	std::map<std::string, std::unique_ptr<Histogram>> m_histograms;
+};
@@ -1,14 +1,36 @@
 #include "NetworkConnection.h"
 #include "NetworkService.h"
+#include "PacketCapture.h"
+#include "Xtea.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
+#if !defined _WIN32 && !defined _WIN64
+#include <unistd.h>
+#endif
+
 using boost::asio::ip::tcp;
 
 NetworkConnection::NetworkConnection(boost::asio::io_service &ioService, bool isLua)
-	: m_socket(ioService), m_timeout(ioService), m_isLua(isLua)
+	: m_timeout(ioService), m_ioService(ioService), m_socket(ioService), m_strand(ioService), m_isLua(isLua)
 {
+	// The read buffer is only allocated once there is something to read
+	m_readCapacity = 0;
+	m_readStart = m_readEnd = 0;
+	m_readArmed = m_readPending = m_dispatching = false;
+
+	m_shard = 0;
+	m_timeoutBound = false;
 	m_hasKeys = false;
+	m_writeInProgress = false;
+	m_flushInterval = 0;
+	m_receiveMode = ReceiveMode::Fused;
+
+	m_captureId = 0;
+	m_capturePort = 0;
+	m_captureDecided = false;
 }
 
 
@@ -27,6 +49,70 @@ void NetworkConnection::close()
 	m_socket.close(ec);
 	m_timeout.cancel();
 	if (ec) std::cout << "NetworkConnection::close: error: " << ec.message() << std::endl;
+
+	if (m_captureId != 0) {
+		PacketCapture::record(m_captureId, m_capturePort, PacketCapture::RecordType::Closed);
+		m_captureId = 0;
+	}
+
+	// Messages waiting for the next tick will never make it
+	std::vector<WriteHandler> dropped;
+	{
+		std::lock_guard<std::mutex> lock(m_batchLock);
+		if (m_flushTimer) m_flushTimer->cancel(ec);
+		m_batch.reset();
+		dropped.swap(m_batchHandlers);
+	}
+
+	for (auto &handler : dropped)
+		handler(boost::asio::error::operation_aborted, 0);
+}
+
+void NetworkConnection::service(std::shared_ptr<NetworkService> service)
+{
+	m_service = service;
+	if (!service) return;
+
+	auto policy = service->getOutputPolicy();
+	m_flushInterval = policy.mode == NetworkService::OutputPolicy::PerTick ? std::max(policy.interval, 1U) : 0;
+
+	// Batching is done here, so Nagle's algorithm would only add latency either way
+	boost::system::error_code ec;
+	m_socket.set_option(tcp::no_delay(true), ec);
+}
+
+tcp::endpoint NetworkConnection::remoteEndpoint()
+{
+	boost::system::error_code ec;
+	return m_socket.remote_endpoint(ec);
+}
+
+int NetworkConnection::releaseSocket()
+{
+#if !defined _WIN32 && !defined _WIN64
+	{
+		std::lock_guard<std::mutex> lock(m_sendLock);
+		if (m_writeInProgress) return -1;
+	}
+
+	// Only a connection waiting for its next frame, with nothing read yet, can go: that is, waiting in waitReadable
+	// with a handler set. A read buffer means bytes were read, or a read into it is under way
+	if (!m_socket.is_open() || m_dispatching || m_readBuffer || !m_readPending || !m_readArmed) return -1;
+
+	int descriptor = ::dup(m_socket.native_handle());
+	if (descriptor < 0) return -1;
+
+	m_timeout.cancel();
+
+	// Closing this descriptor alone leaves the connection up for the duplicate. The waiting handler gets the aborted
+	// read, so whoever waits on it, a coroutine included, learns the connection is gone here, as on a close
+	boost::system::error_code ec;
+	m_socket.close(ec);
+
+	return descriptor;
+#else
+	return -1;
+#endif
 }
 
 void NetworkConnection::setKeys(std::array<uint32_t, 4> &keys)
@@ -38,13 +124,27 @@ void NetworkConnection::setKeys(std::array<uint32_t, 4> &keys)
 
 void NetworkConnection::setTimeout(std::int64_t msec)
 {
-	m_timeout.expires_from_now(boost::posix_time::millisec(msec));
+	if (!m_timeoutBound) {
+		m_timeoutBound = true;
+
+		// The wheel must not keep the connection alive, and Lua connections are not owned by a shared_ptr at all
+		std::weak_ptr<NetworkConnection> weak;
+		if (!m_isLua) weak = shared_from_this();
+
+		bool isLua = m_isLua;
+		m_timeout.onExpired([this, weak, isLua]() {
+			NetworkConnectionPtr self = weak.lock();
+			if (!self && !isLua) return;
+
+			m_strand.post([this, self]() {
+				// A read may have pushed the deadline back right as the wheel expired the timer
+				if (m_timeout.expired()) close();
+				else m_timeout.restart();
+			});
+		});
+	}
 
-	m_timeout.async_wait([this](boost::system::error_code error) {
-		if (!error) {
-			close();
-		}
-	});
+	m_timeout.expiresFromNow(msec);
 }
 
 void NetworkConnection::unsetTimeout()
@@ -59,118 +159,480 @@ uint32_t NetworkConnection::getLastChecksum()
 
 void NetworkConnection::beginReading(NetworkConnection::ReadHandler handler)
 {
+	if (!m_strand.running_in_this_thread()) {
+		// Called from outside the connection's handlers, e.g. right after connecting
+		NetworkConnectionPtr self;
+		if (!m_isLua) self = shared_from_this();
+
+		m_strand.dispatch([this, self, handler]() { beginReading(handler); });
+		return;
+	}
+
 	m_handler = handler;
-	setTimeout(NetworkConnection::readTimeout);
-	boost::asio::async_read(m_socket, boost::asio::buffer(m_recvPacket.data(), Packet::headerSize), std::bind(&NetworkConnection::handleHeader, shared_from_this(), std::placeholders::_1));
+	m_readArmed = true;
+
+	// A handler rearming from inside dispatchFrames gets the next frame from the loop already running
+	if (!m_dispatching) dispatchFrames();
 }
 
-void NetworkConnection::send(PacketPtr packet, std::function<void(boost::system::error_code, size_t)> handler)
+void NetworkConnection::send(PacketPtr packet, WriteHandler handler)
 {
-	if (!handler) handler = [](boost::system::error_code, size_t) {};
+	if (m_flushInterval > 0) {
+		batch(packet, handler);
+		return;
+	}
 
-	if (m_hasKeys) {
-		packet->writeMessageLength();
-		encrypt(packet);
+	encode(packet);
+	enqueue(packet, handler);
+}
+
+void NetworkConnection::broadcast(PacketPtr packet, const std::vector<NetworkConnectionPtr> &connections)
+{
+	bool needPlain = false, needChecksummed = false;
+
+	// Encrypting connections need the message before it is encoded
+	for (auto &connection : connections) {
+		if (connection->m_flushInterval > 0) connection->send(packet); // Copied into the connection's next frame
+		else if (connection->m_hasKeys) connection->send(Packet::create(packet.get()));
+		else if (connection->needChecksum()) needChecksummed = true;
+		else needPlain = true;
+	}
+
+	PacketPtr plain, checksummed;
+	if (needPlain) {
+		plain = needChecksummed ? Packet::create(packet.get()) : packet;
+		plain->addCryptoHeader(false);
+	}
+	if (needChecksummed) {
+		checksummed = packet;
+		checksummed->addCryptoHeader(true);
 	}
-	packet->addCryptoHeader(needChecksum());
 
-	boost::asio::async_write(m_socket, boost::asio::buffer(packet->data() + packet->start(), packet->size()), handler);
+	for (auto &connection : connections) {
+		if (!connection->m_hasKeys && connection->m_flushInterval == 0) connection->enqueue(connection->needChecksum() ? checksummed : plain, nullptr);
+	}
 }
 
-void NetworkConnection::handleHeader(boost::system::error_code error)
+void NetworkConnection::enqueue(PacketPtr packet, WriteHandler handler)
 {
-	if (!error) {
-		setTimeout(NetworkConnection::readTimeout);
-		auto len = m_recvPacket.parseLength();
-		m_recvPacket.pos(Packet::headerSize); // Rewind the packet
+	{
+		std::lock_guard<std::mutex> lock(m_sendLock);
+		m_sendQueue.push_back({ packet, handler });
 
-		boost::asio::async_read(m_socket, boost::asio::buffer(m_recvPacket.data() + Packet::headerSize, len), std::bind(&NetworkConnection::handleBody, shared_from_this(), std::placeholders::_1));
+		if (m_writeInProgress) return;
+		m_writeInProgress = true;
 	}
-	else beginReading(m_handler);
+
+	// Writes are started from the strand, so they never race with the reads on the same socket
+	NetworkConnectionPtr self;
+	if (!m_isLua) self = shared_from_this();
+
+	m_strand.dispatch([this, self]() {
+		std::lock_guard<std::mutex> lock(m_sendLock);
+		startWrite();
+	});
 }
 
-void NetworkConnection::handleBody(boost::system::error_code error)
+void NetworkConnection::batch(PacketPtr packet, WriteHandler handler)
 {
-	if (!error) {
-		if (m_hasKeys && !decrypt()) {
-			return;
+	std::lock_guard<std::mutex> lock(m_batchLock);
+
+	// Leave room for the lengths, checksum and padding the frame gets once encoded
+	const size_t batchLimit = Packet::maxPacketSize - 16;
+	if (m_batch && m_batch->size() + packet->size() > batchLimit)
+		flushBatch();
+
+	if (packet->size() > batchLimit) {
+		// Too big to share a frame, so it goes out alone, after the frame gathered before it. Copied, as batched packets
+		// are, since a broadcast hands the same packet to every connection
+		PacketPtr frame = Packet::create(packet.get());
+		encode(frame);
+		enqueue(frame, handler);
+		return;
+	}
+
+	if (!m_batch) {
+		m_batch = Packet::create();
+
+		if (!m_flushTimer) m_flushTimer.reset(new boost::asio::deadline_timer(m_ioService));
+		m_flushTimer->expires_from_now(boost::posix_time::millisec(m_flushInterval));
+
+		NetworkConnectionPtr self;
+		if (!m_isLua) self = shared_from_this();
+
+		m_flushTimer->async_wait(m_strand.wrap([this, self](boost::system::error_code error) {
+			if (error) return;
+
+			std::lock_guard<std::mutex> lock(m_batchLock);
+			flushBatch();
+		}));
+	}
+
+	m_batch->copy(packet->data() + packet->start(), packet->size());
+	if (handler) m_batchHandlers.push_back(handler);
+}
+
+void NetworkConnection::flushBatch()
+{
+	PacketPtr frame;
+	frame.swap(m_batch);
+	if (!frame) return;
+
+	encode(frame);
+
+	WriteHandler written;
+	if (!m_batchHandlers.empty()) {
+		std::vector<WriteHandler> handlers;
+		handlers.swap(m_batchHandlers);
+
+		written = [handlers](boost::system::error_code error, size_t bytes) {
+			for (auto &handler : handlers) handler(error, bytes);
+		};
+	}
+
+	enqueue(frame, written);
+}
+
+void NetworkConnection::startWrite()
+{
+	// Must be called with m_sendLock held, and m_writing empty
+	if (m_sendQueue.size() <= NetworkConnection::maxWriteBatch) {
+		// Takes the whole queue, leaving it without storage until more is sent
+		m_writing.swap(m_sendQueue);
+	}
+	else {
+		auto last = m_sendQueue.begin() + NetworkConnection::maxWriteBatch;
+		m_writing.assign(std::make_move_iterator(m_sendQueue.begin()), std::make_move_iterator(last));
+		m_sendQueue.erase(m_sendQueue.begin(), last);
+	}
+
+	std::vector<boost::asio::const_buffer> buffers;
+	buffers.reserve(m_writing.size());
+
+	for (auto &pending : m_writing)
+		buffers.push_back(boost::asio::buffer(pending.packet->data() + pending.packet->start(), pending.packet->size()));
+
+	// Lua connections are not owned by a shared_ptr, so they can't be kept alive by the handler
+	NetworkConnectionPtr self;
+	if (!m_isLua) self = shared_from_this();
+
+	boost::asio::async_write(m_socket, buffers, m_strand.wrap([this, self](boost::system::error_code error, size_t) {
+		handleWrite(error);
+	}));
+}
+
+void NetworkConnection::handleWrite(boost::system::error_code error)
+{
+	std::vector<PendingWrite> written;
+
+	{
+		std::lock_guard<std::mutex> lock(m_sendLock);
+		written.swap(m_writing);
+
+		if (error) {
+			// The connection is gone, nothing else in the queue will make it
+			for (auto &pending : m_sendQueue)
+				written.push_back(std::move(pending));
+			m_sendQueue.clear();
 		}
 
-		uint32_t checksumReceived = m_recvPacket.peek<uint32_t>(), length = m_recvPacket.size() - m_recvPacket.pos() - 4;
-		if (length > 0) m_checksum = adlerChecksum(m_recvPacket.data() + m_recvPacket.pos() + 4, length);
-		else m_checksum = 0;
+		if (!m_sendQueue.empty()) startWrite();
+		else m_writeInProgress = false;
+	}
 
-		setTimeout(NetworkConnection::readTimeout);
-		m_handler(std::make_shared<Packet>(m_recvPacket), error);
+	for (auto &pending : written) {
+		if (pending.handler) pending.handler(error, pending.packet->size());
 	}
-	else beginReading(m_handler);
 }
 
-void NetworkConnection::encrypt(std::shared_ptr<Packet> packet)
+void NetworkConnection::startRead()
 {
-	const uint32_t delta = 0x61C88647;
+	if (!m_readBuffer) {
+		waitReadable();
+		return;
+	}
 
-	// The message must be a multiple of 8 
-	size_t paddingBytes = packet->size() % 8;
-	if (paddingBytes != 0) {
-		packet->pad(8 - paddingBytes);
+	// Make room after the unread data, moving it to the front of the buffer or growing the buffer if a frame won't fit
+	size_t needed = Packet::headerSize;
+	if (m_readEnd - m_readStart >= Packet::headerSize) {
+		const uint8_t *header = m_readBuffer->data() + m_readStart;
+		needed += header[0] | (size_t)header[1] << 8;
+	}
+
+	if (m_readStart > 0 && m_readStart + needed > m_readCapacity) {
+		std::memmove(m_readBuffer->data(), m_readBuffer->data() + m_readStart, m_readEnd - m_readStart);
+		m_readEnd -= m_readStart;
+		m_readStart = 0;
 	}
 
-	uint32_t* buffer = reinterpret_cast<uint32_t*>(packet->data() + packet->start());
-	const size_t messageLength = packet->size() / 4;
-	size_t readPos = 0;
-	const uint32_t k[] = { m_keys[0], m_keys[1], m_keys[2], m_keys[3] };
-	while (readPos < messageLength) {
-		uint32_t v0 = buffer[readPos], v1 = buffer[readPos + 1];
-		uint32_t sum = 0;
+	if (needed > m_readCapacity) {
+		m_readBuffer->reserve(needed);
+		m_readCapacity = needed;
+	}
+
+	m_readPending = true;
+	setTimeout(NetworkConnection::readTimeout);
+
+	// Lua connections are not owned by a shared_ptr, so they can't be kept alive by the handler
+	NetworkConnectionPtr self;
+	if (!m_isLua) self = shared_from_this();
+
+	m_socket.async_read_some(boost::asio::buffer(m_readBuffer->data() + m_readEnd, m_readCapacity - m_readEnd), m_strand.wrap([this, self](boost::system::error_code error, size_t bytes) {
+		handleRead(error, bytes);
+	}));
+}
+
+void NetworkConnection::waitReadable()
+{
+	m_readPending = true;
+	setTimeout(NetworkConnection::readTimeout);
+
+	// Lua connections are not owned by a shared_ptr, so they can't be kept alive by the handler
+	NetworkConnectionPtr self;
+	if (!m_isLua) self = shared_from_this();
 
-		for (int32_t i = 32; --i >= 0;) {
-			v0 += ((v1 << 4 ^ v1 >> 5) + v1) ^ (sum + k[sum & 3]);
-			sum -= delta;
-			v1 += ((v0 << 4 ^ v0 >> 5) + v0) ^ (sum + k[(sum >> 11) & 3]);
+	m_socket.async_read_some(boost::asio::null_buffers(), m_strand.wrap([this, self](boost::system::error_code error, size_t) {
+		if (error) {
+			handleRead(error, 0);
+			return;
 		}
 
-		buffer[readPos++] = v0;
-		buffer[readPos++] = v1;
+		m_readPending = false;
+		if (!m_readArmed) return;
+
+		allocateReadBuffer();
+		startRead();
+	}));
+}
+
+void NetworkConnection::allocateReadBuffer()
+{
+	m_readBuffer = Packet::create();
+	m_readBuffer->reserve(NetworkConnection::readBufferSize);
+	m_readCapacity = NetworkConnection::readBufferSize;
+	m_readStart = m_readEnd = 0;
+}
+
+void NetworkConnection::appendReadBuffer(const uint8_t *data, size_t length)
+{
+	if (!m_readBuffer) allocateReadBuffer();
+
+	if (m_readStart > 0 && m_readEnd + length > m_readCapacity) {
+		std::memmove(m_readBuffer->data(), m_readBuffer->data() + m_readStart, m_readEnd - m_readStart);
+		m_readEnd -= m_readStart;
+		m_readStart = 0;
+	}
+
+	if (m_readEnd + length > m_readCapacity) {
+		m_readCapacity = m_readEnd + length;
+		m_readBuffer->reserve(m_readCapacity);
 	}
+
+	std::memcpy(m_readBuffer->data() + m_readEnd, data, length);
+	m_readEnd += length;
 }
 
-bool NetworkConnection::decrypt()
+void NetworkConnection::handleRead(boost::system::error_code error, size_t bytes)
 {
-	if (((m_recvPacket.size() - 6) & 7) != 0) {
-		return false;
+	m_readPending = false;
+
+	if (error) {
+		if (m_readArmed) {
+			m_readArmed = false;
+			ReadHandler handler = std::move(m_handler);
+			handler(PacketPtr(), error);
+		}
+		return;
 	}
 
-	const uint32_t delta = 0x61C88647;
+	m_readEnd += bytes;
+	dispatchFrames();
+}
+
+void NetworkConnection::dispatchFrames()
+{
+	m_dispatching = true;
+
+	while (m_readArmed) {
+		PacketPtr packet = nextFrame();
+		if (!packet) break;
 
-	uint32_t* buffer = reinterpret_cast<uint32_t*>(m_recvPacket.data() + m_recvPacket.pos());
-	const size_t messageLength = (m_recvPacket.size() - 6) / 4;
-	size_t readPos = 0;
-	const uint32_t k[] = { m_keys[0], m_keys[1], m_keys[2], m_keys[3] };
-	while (readPos < messageLength) {
-		uint32_t v0 = buffer[readPos], v1 = buffer[readPos + 1];
-		uint32_t sum = 0xC6EF3720;
+		// Recorded as received, before it is decrypted in place
+		if (m_captureId != 0 || !m_captureDecided) capture(packet);
 
-		for (int32_t i = 32; --i >= 0;) {
-			v1 -= ((v0 << 4 ^ v0 >> 5) + v0) ^ (sum + k[(sum >> 11) & 3]);
-			sum += delta;
-			v0 -= ((v1 << 4 ^ v1 >> 5) + v1) ^ (sum + k[sum & 3]);
+		if (!receiveFrame(packet)) {
+			// Malformed frame, reported like a read error so the connection is removed
+			m_readArmed = false;
+			ReadHandler handler = std::move(m_handler);
+			handler(PacketPtr(), boost::asio::error::invalid_argument);
+			break;
 		}
 
-		buffer[readPos++] = v0;
-		buffer[readPos++] = v1;
+		// The handler calls beginReading to get the next frame, which installs a new m_handler
+		m_readArmed = false;
+		ReadHandler handler = std::move(m_handler);
+		handler(packet, boost::system::error_code());
 	}
 
-	size_t innerLength = m_recvPacket.pop<uint16_t>();
-	if (innerLength > m_recvPacket.size() - 8) {
-		return false;
+	m_dispatching = false;
+
+	if (m_readArmed && !m_readPending) startRead();
+}
+
+bool NetworkConnection::completeFrameAt(size_t offset)
+{
+	if (m_readEnd - offset < Packet::headerSize) return false;
+
+	const uint8_t *header = m_readBuffer->data() + offset;
+	return m_readEnd - offset >= Packet::headerSize + (header[0] | (size_t)header[1] << 8);
+}
+
+PacketPtr NetworkConnection::nextFrame()
+{
+	size_t available = m_readEnd - m_readStart;
+	if (available < Packet::headerSize) return PacketPtr();
+
+	const uint8_t *header = m_readBuffer->data() + m_readStart;
+	size_t frameSize = Packet::headerSize + (header[0] | (size_t)header[1] << 8);
+	if (available < frameSize) return PacketPtr();
+
+	size_t end = m_readStart + frameSize;
+	size_t offset = 0;
+
+	PacketPtr packet;
+	if (!completeFrameAt(end)) {
+		// The last complete frame is handed the buffer, at its offset, and the partial frame after it moves to a fresh one.
+		// Frames before it are copied out: several small frames per read cost less to copy than a buffer each
+		packet = m_readBuffer;
+		offset = m_readStart;
+		size_t rest = m_readEnd - end;
+
+		m_readBuffer.reset();
+		m_readCapacity = 0;
+		m_readStart = m_readEnd = 0;
+
+		if (rest > 0) appendReadBuffer(packet->data() + end, rest);
+	}
+	else {
+		packet = Packet::create();
+		packet->reserve(frameSize);
+		std::memcpy(packet->data(), header, frameSize);
+
+		m_readStart += frameSize;
+	}
+
+	packet->start(offset);
+	packet->size(offset + frameSize);
+	packet->pos(offset + Packet::headerSize);
+
+	return packet;
+}
+
+void NetworkConnection::capture(PacketPtr frame)
+{
+	if (!m_captureDecided) {
+		// Connections are recorded from their first frame on, or not at all
+		m_captureDecided = true;
+		if (!PacketCapture::isCapturing()) return;
+
+		boost::system::error_code ec;
+		m_capturePort = m_socket.local_endpoint(ec).port();
+		m_captureId = PacketCapture::nextConnectionId();
+	}
+
+	PacketCapture::record(m_captureId, m_capturePort, PacketCapture::RecordType::Frame, frame->data() + frame->start(), frame->size() - frame->start());
+}
+
+bool NetworkConnection::receiveFrame(PacketPtr packet)
+{
+	if (m_hasKeys) {
+		// The checksum is verified along with the decryption
+		return decrypt(packet);
+	}
+
+	// Verify the checksum here, once, and let the packet carry the result
+	size_t length = packet->size() - packet->pos();
+	if (length >= 4) {
+		m_checksum = length > 4 ? adlerChecksum(packet->data() + packet->pos() + 4, length - 4) : 0;
+		packet->validChecksum(m_checksum == packet->peek<uint32_t>());
+	}
+	else {
+		m_checksum = 0;
+		packet->validChecksum(false);
 	}
 
-	m_recvPacket.size(innerLength);
 	return true;
 }
 
+void NetworkConnection::encode(PacketPtr packet)
+{
+	if (m_hasKeys) {
+		packet->writeMessageLength();
+		encrypt(packet);
+	}
+	packet->addCryptoHeader(needChecksum());
+}
+
+void NetworkConnection::encrypt(std::shared_ptr<Packet> packet)
+{
+	// The message must be a multiple of 8 
+	size_t paddingBytes = packet->size() % 8;
+	if (paddingBytes != 0) {
+		packet->pad(8 - paddingBytes);
+	}
+
+	xteaEncrypt(packet->data() + packet->start(), packet->size(), m_keys);
+}
+
 bool NetworkConnection::needChecksum()
 {
 	return m_service && m_service->needChecksum();
 }
+
+bool NetworkConnection::decrypt(PacketPtr packet)
+{
+	bool checksummed = needChecksum();
+	size_t checksumSize = checksummed ? 4 : 0;
+	size_t body = packet->pos();
+
+	if (packet->size() < body + checksumSize + 8) {
+		return false;
+	}
+
+	uint8_t *cipher = packet->data() + body + checksumSize;
+	size_t cipherLength = packet->size() - body - checksumSize;
+	if ((cipherLength & 7) != 0) {
+		return false;
+	}
+
+	if (checksummed) {
+		// Both modes checksum the ciphertext, they only differ in how many passes it takes
+		if (m_receiveMode == ReceiveMode::Fused) {
+			m_checksum = xteaDecryptWithChecksum(cipher, cipherLength, m_keys);
+		}
+		else {
+			m_checksum = adlerUpdate(1, cipher, cipherLength);
+			xteaDecrypt(cipher, cipherLength, m_keys);
+		}
+		packet->validChecksum(m_checksum == packet->peek<uint32_t>());
+	}
+	else {
+		xteaDecrypt(cipher, cipherLength, m_keys);
+		m_checksum = 0;
+		packet->validChecksum(false);
+	}
+
+	size_t innerLength = cipher[0] | (size_t)cipher[1] << 8;
+	if (innerLength > cipherLength - 2) {
+		return false;
+	}
+
+	// Drop the inner length, so the body is laid out as [checksum][message] like an unencrypted one
+	if (checksummed) {
+		std::memmove(packet->data() + body + 2, packet->data() + body, checksumSize);
+	}
+	packet->pos(body + 2);
+	packet->size(body + 2 + checksumSize + innerLength);
+
+	return true;
+}
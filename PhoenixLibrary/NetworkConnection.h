@@ -6,15 +6,33 @@
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "Packet.h"
+#include "TimerWheel.h"
 
 class NetworkConnection
 	: public std::enable_shared_from_this<NetworkConnection>
 {
 public:
-	enum { readTimeout = 10000 };
+	enum {
+		readTimeout = 10000,
+		//! Maximum number of queued packets flushed by a single write
+		maxWriteBatch = 64,
+		//! Initial size of the read buffer, allocated once the socket is readable. Grows when a single frame does not fit
+		readBufferSize = 16384
+	};
 	typedef std::function<void(std::shared_ptr<Packet>, boost::system::error_code)> ReadHandler;
+	typedef std::function<void(boost::system::error_code, size_t)> WriteHandler;
+
+	//! How encrypted frames are verified and decrypted
+	enum class ReceiveMode {
+		//! Checksum the whole ciphertext, then decrypt it in a second pass
+		Separate,
+		//! Checksum the ciphertext and decrypt it in a single pass, chunk by chunk
+		Fused
+	};
 
 	NetworkConnection(boost::asio::io_service &ioService, bool isLua = false);
 	~NetworkConnection();
@@ -22,39 +40,151 @@ public:
 	virtual void close();
 
 	boost::asio::ip::tcp::socket& socket() { return m_socket; }
-
-	void service(std::shared_ptr<NetworkService> service) { m_service = service; }
+	//! Whether the connection can still send and receive
+	virtual bool isOpen() { return m_socket.is_open(); }
+	//! Address of the peer. Unspecified once the connection is closed, instead of throwing like the socket's
+	virtual boost::asio::ip::tcp::endpoint remoteEndpoint();
+	//! Serializes every handler of this connection, so they never run concurrently even with several workers
+	boost::asio::io_service::strand& strand() { return m_strand; }
+
+	//! Binds the connection to a service, and applies the service's output policy
+	void service(std::shared_ptr<NetworkService> service);
 	std::shared_ptr<NetworkService> service() { return m_service; }
 
+	//! Index of the network shard whose io_service runs this connection
+	void shard(size_t shard) { m_shard = shard; }
+	size_t shard() const { return m_shard; }
+
+	//! Delivers the next frame to handler. Frames already buffered are delivered without touching the socket
 	void beginReading(ReadHandler handler);
-	void send(std::shared_ptr<Packet> packet, std::function<void(boost::system::error_code, size_t)> handler = nullptr);
+	//! Queues a packet to be sent. Packets queued while a write is in flight are flushed together by the next write
+	/**
+	 * For services that write per tick, the packet is instead appended to the frame flushed on the next tick
+	 */
+	void send(std::shared_ptr<Packet> packet, WriteHandler handler = nullptr);
+	//! Sends the same message to every connection
+	/**
+	 * Connections that don't encrypt share a single encoded (and, if their service needs it, checksummed) packet,
+	 * which must not be modified afterwards. Encrypting connections each get their own copy.
+	 */
+	static void broadcast(std::shared_ptr<Packet> packet, const std::vector<NetworkConnectionPtr> &connections);
 
 	uint32_t getLastChecksum();
 
 	void setKeys(std::array<uint32_t, 4> &keys);
 
+	void receiveMode(ReceiveMode mode) { m_receiveMode = mode; }
+	ReceiveMode receiveMode() const { return m_receiveMode; }
+
 	bool isLua() const { return m_isLua; }
 
+	bool hasKeys() const { return m_hasKeys; }
+	const std::array<uint32_t, 4>& getKeys() const { return m_keys; }
+
+	//! Gives the socket up to be handed over to another process, returning a duplicate of its descriptor
+	/**
+	 * Must run on the connection's strand. Fails, returning -1, unless the connection is idle: waiting for the next frame
+	 * with nothing read nor being written, as anything else would be lost. Otherwise the connection is left closed,
+	 * without shutting the socket down, and its read handler gets operation_aborted as if it had been closed
+	 */
+	int releaseSocket();
+
 private:
-	boost::asio::deadline_timer m_timeout;
+	//! Read timeout, kept on the shard's timer wheel so restarting it on every read is only a store
+	TimerWheel::Timer m_timeout;
+	bool m_timeoutBound;
+	boost::asio::io_service &m_ioService;
 	boost::asio::ip::tcp::socket m_socket;
+	boost::asio::io_service::strand m_strand;
 	std::shared_ptr<NetworkService> m_service;
+	size_t m_shard;
 	ReadHandler m_handler;
-	Packet m_recvPacket;
+	//! Bytes read from the socket, possibly several frames and a partial one
+	/**
+	 * Unread data lives in [m_readStart, m_readEnd). The last complete frame in the buffer is handed over to the read
+	 * handler along with the buffer, its start() at its offset in it; frames before it are copied out. Idle connections
+	 * thus hold no buffer: the next read waits for the socket to be readable before allocating another
+	 */
+	PacketPtr m_readBuffer;
+	size_t m_readCapacity;
+	size_t m_readStart;
+	size_t m_readEnd;
+	//! A handler is waiting for the next frame
+	bool m_readArmed;
+	//! An async_read_some is in flight
+	bool m_readPending;
+	//! dispatchFrames is on the stack, handlers that rearm the reader must not recurse into it
+	bool m_dispatching;
 	uint32_t m_checksum;
 	std::array<uint32_t, 4> m_keys;
 	bool m_hasKeys;
 	bool m_isLua;
+	ReceiveMode m_receiveMode;
+	//! Id of the connection in the packet capture, zero when it isn't recorded. See PacketCapture
+	uint64_t m_captureId;
+	uint16_t m_capturePort;
+	//! Whether the first frame was received, which decides if the connection is recorded
+	bool m_captureDecided;
+
+	struct PendingWrite
+	{
+		PacketPtr packet;
+		WriteHandler handler;
+	};
+
+	std::mutex m_sendLock;
+	//! Packets waiting for the write in flight to finish. Idle connections keep no storage for either
+	std::vector<PendingWrite> m_sendQueue;
+	//! Packets being written by the write in flight
+	std::vector<PendingWrite> m_writing;
+	bool m_writeInProgress;
+
+	//! Milliseconds between flushes of the outgoing frame, zero when packets are written as they are sent
+	unsigned int m_flushInterval;
+	std::mutex m_batchLock;
+	//! Messages waiting for the next tick, gathered in the body of a single frame
+	PacketPtr m_batch;
+	std::vector<WriteHandler> m_batchHandlers;
+	//! Created on the first tick, so connections that never batch don't pay for it
+	std::unique_ptr<boost::asio::deadline_timer> m_flushTimer;
 	
-	void handleHeader(boost::system::error_code error);
-	void handleBody(boost::system::error_code error);
-
+	//! Waits, without any buffer, for the socket to have data
+	void waitReadable();
+	void allocateReadBuffer();
+	void dispatchFrames();
+	PacketPtr nextFrame();
+	bool completeFrameAt(size_t offset);
+	bool receiveFrame(PacketPtr packet);
+	void capture(PacketPtr frame);
+
+	void startWrite();
+	void handleWrite(boost::system::error_code error);
+
+	void batch(PacketPtr packet, WriteHandler handler);
+	//! Encodes and queues the gathered frame. Must be called with m_batchLock held
+	void flushBatch();
+
+	//! Adds the inner length, encryption and checksum the connection's frames go out with
+	void encode(PacketPtr packet);
 	void encrypt(std::shared_ptr<Packet> packet);
-	bool decrypt();
+	//! Verifies and decrypts a frame laid out as [checksum][ciphertext], the ciphertext starting with the inner length
+	bool decrypt(PacketPtr packet);
 
 	void unsetTimeout();
 
 protected:
+	//! Reads more data, with a handler armed and nothing buffered that completes a frame
+	/**
+	 * Transports other than the socket override this and the next two, and report what they read through handleRead
+	 */
+	virtual void startRead();
+	//! Appends bytes that did not come from the socket after the unread data, for the next handleRead to dispatch
+	void appendReadBuffer(const uint8_t *data, size_t length);
+	//! Dispatches the frames completed by bytes more read into the buffer, or fails the armed handler
+	void handleRead(boost::system::error_code error, size_t bytes);
+	//! Queues an already encoded packet
+	virtual void enqueue(PacketPtr packet, WriteHandler handler);
+
 	void setTimeout(std::int64_t msec);
 	virtual bool needChecksum();
 };
@@ -15,12 +15,42 @@
 #endif
 
 #include "Packet.h"
+#include "PacketSchema.h"
 
 class NetworkService;
 class NetworkManager;
 class NetworkListener;
 class NetworkConnection;
 
+//! Endpoints go on the wire as the address string followed by the 16 bit port
+template <>
+struct FieldCodec<boost::asio::ip::tcp::endpoint>
+{
+	enum { minSize = StringCodec::minSize + sizeof(uint16_t) };
+
+	static size_t maxSize(const boost::asio::ip::tcp::endpoint &) {
+		// Room for the longest IPv6 address
+		return StringCodec::minSize + 64 + sizeof(uint16_t);
+	}
+
+	static uint8_t* write(uint8_t *out, const boost::asio::ip::tcp::endpoint &value) {
+		out = StringCodec::write(out, value.address().to_string());
+		return FieldCodec<uint16_t>::write(out, value.port());
+	}
+
+	static const uint8_t* read(const uint8_t *in, const uint8_t *end, boost::asio::ip::tcp::endpoint &value) {
+		boost::string_ref address;
+		in = StringCodec::read(in, end - sizeof(uint16_t), address);
+		if (!in) return nullptr;
+
+		uint16_t port;
+		in = FieldCodec<uint16_t>::read(in, end, port);
+
+		value = boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(SmallString(address).c_str()), port);
+		return in;
+	}
+};
+
 //! Class that defines a capability of a service
 class Capability
 	: public PacketSerializable
@@ -49,13 +79,15 @@ public:
 		return name == other.name;
 	}
 
+	typedef PacketSchema<Capability,
+		Field<Capability, std::string, &Capability::name>,
+		Field<Capability, boost::asio::ip::tcp::endpoint, &Capability::serviceEndpoint>> Schema;
+
 	virtual void read(Packet &packet) {
-		name = packet.pop<std::string>();
-		serviceEndpoint.address(boost::asio::ip::address::from_string(packet.pop<std::string>()));
-		serviceEndpoint.port(packet.pop<uint16_t>());
+		Schema::read(packet, *this);
 	}
-	virtual void write(Packet &packet) const { 
-		packet.push(name).push(serviceEndpoint.address().to_string()).push<uint16_t>(serviceEndpoint.port());
+	virtual void write(Packet &packet) const {
+		Schema::write(packet, *this);
 	}
 };
 
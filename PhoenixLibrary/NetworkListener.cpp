@@ -1,4 +1,6 @@
 #include "NetworkListener.h"
+#include "AdmissionControl.h"
+#include "HotRestart.h"
 #include "NetworkConnection.h"
 #include "NetworkService.h"
 
@@ -6,13 +8,23 @@
 
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+
+#if !defined _WIN32 && !defined _WIN64
+#include <unistd.h>
+#endif
 
 using boost::asio::ip::tcp;
 
 NetworkListener::NetworkListener(boost::asio::io_service& ioservice, std::shared_ptr<ComponentManager> components, tcp::endpoint endpoint)
-: m_endpoint(endpoint), m_acceptor(ioservice)
+: m_endpoint(endpoint), m_shards(1, &ioservice), m_connections(1), m_nextShard(0)
 {
 	m_components = components;
+
+	auto &metrics = *m_components->getMetrics();
+	std::string prefix = "listener." + std::to_string(endpoint.port()) + ".";
+	m_accepted = &metrics.counter(prefix + "accepted");
+	m_rejected = &metrics.counter(prefix + "rejected");
 }
 
 NetworkListener::~NetworkListener()
@@ -21,37 +33,171 @@ NetworkListener::~NetworkListener()
 
 void NetworkListener::start()
 {
-	if (!m_acceptor.is_open()) {
-		try {
-			m_acceptor.open(m_endpoint.protocol());
-			m_acceptor.set_option(boost::asio::socket_base::reuse_address(true));
-			m_acceptor.bind(m_endpoint);
-			m_acceptor.listen();
+	std::lock_guard<std::mutex> lock(m_acceptorsLock);
+
+	if (m_acceptors.empty()) {
+		size_t acceptorCount = 1;
+#ifdef SO_REUSEPORT
+		acceptorCount = m_shards.size();
+#endif
 
-			startAccept();
+		// No shard sees an acceptor before its first accept is started, so they can be set up from here
+		std::vector<std::shared_ptr<Acceptor>> acceptors;
+		try {
+			// Sockets handed over by the previous server are already bound and listening
+			std::vector<int> adopted;
+			adopted.swap(m_adoptedAcceptors);
+			for (size_t i = 0; i < adopted.size(); ++i) {
+				size_t shard = i % m_shards.size();
+				auto acceptor = std::make_shared<Acceptor>(*m_shards[shard], shard);
+				acceptor->acceptor.assign(m_endpoint.protocol(), adopted[i]);
+
+				acceptors.push_back(acceptor);
+			}
+			if (!adopted.empty()) acceptorCount = 0;
+
+			for (size_t i = 0; i < acceptorCount; ++i) {
+				auto acceptor = std::make_shared<Acceptor>(*m_shards[i], i);
+				acceptor->acceptor.open(m_endpoint.protocol());
+				acceptor->acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+#ifdef SO_REUSEPORT
+				if (acceptorCount > 1)
+					acceptor->acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+				acceptor->acceptor.bind(m_endpoint);
+				acceptor->acceptor.listen();
+
+				acceptors.push_back(acceptor);
+			}
 		}
 		catch (const boost::system::system_error &e) {
+			acceptors.clear();
 			std::cout << ">>> Failed to start listener at " << m_endpoint.address().to_string() << "@" << m_endpoint.port() << ": " << e.what() << std::endl;
 		}
-		catch (...) { }
+		catch (...) {
+			acceptors.clear();
+		}
+
+		m_acceptors = acceptors;
+		for (auto &acceptor : m_acceptors) {
+			acceptor->spreads = m_acceptors.size() == 1;
+			startAccept(acceptor);
+		}
 	}
 }
 
 void NetworkListener::stop()
 {
-	if (m_acceptor.is_open()) {
-		m_acceptor.cancel();
-		m_acceptor.close();
+	std::vector<std::shared_ptr<Acceptor>> acceptors;
+
+	{
+		std::lock_guard<std::mutex> lock(m_acceptorsLock);
+		acceptors.swap(m_acceptors);
 	}
+
+	for (auto &acceptor : acceptors)
+		closeAcceptor(acceptor);
 }
 
 void NetworkListener::restart()
 {
 	stop();
-	m_acceptor.get_io_service().reset();
+	m_shards.front()->reset();
 	start();
 }
 
+std::vector<int> NetworkListener::releaseAcceptors()
+{
+	std::vector<int> descriptors;
+
+#if !defined _WIN32 && !defined _WIN64
+	{
+		std::lock_guard<std::mutex> lock(m_acceptorsLock);
+		for (auto &acceptor : m_acceptors) {
+			int descriptor = ::dup(acceptor->acceptor.native_handle());
+			if (descriptor >= 0) descriptors.push_back(descriptor);
+		}
+	}
+#endif
+
+	stop();
+
+	return descriptors;
+}
+
+bool NetworkListener::adoptConnection(int descriptor, std::shared_ptr<NetworkService> service, bool hasKeys, std::array<uint32_t, 4> keys)
+{
+	size_t shard = m_nextShard.fetch_add(1, std::memory_order_relaxed) % m_shards.size();
+
+	NetworkConnectionPtr connection(new NetworkConnection(*m_shards[shard]));
+	connection->shard(shard);
+
+	boost::system::error_code ec;
+	connection->socket().assign(m_endpoint.protocol(), descriptor, ec);
+	if (ec) {
+		std::cout << ">>> NetworkListener: could not adopt a connection: " << ec.message() << std::endl;
+		HotRestart::closeDescriptor(descriptor);
+		return false;
+	}
+
+	if (hasKeys) connection->setKeys(keys);
+	connection->service(service);
+
+	{
+		std::lock_guard<std::mutex> lock(m_connectionsLock);
+		m_connections[shard].insert(connection);
+	}
+
+	// The first packet went to the previous server, so this picks up from the regular packets
+	connection->beginReading(std::bind(&NetworkListener::handleReceive, shared_from_this(), connection, std::placeholders::_1, std::placeholders::_2));
+	return true;
+}
+
+void NetworkListener::serveConnection(NetworkConnectionPtr connection)
+{
+	if (connection->shard() >= m_shards.size()) connection->shard(0);
+
+	auto self = shared_from_this();
+	connection->strand().dispatch([self, connection]() { self->handleConnected(connection); });
+}
+
+void NetworkListener::releaseConnection(NetworkConnectionPtr connection)
+{
+	std::lock_guard<std::mutex> lock(m_connectionsLock);
+	m_connections[connection->shard()].erase(connection);
+}
+
+std::vector<NetworkConnectionPtr> NetworkListener::getConnections()
+{
+	std::vector<NetworkConnectionPtr> connections;
+
+	std::lock_guard<std::mutex> lock(m_connectionsLock);
+	for (auto &shard : m_connections)
+		connections.insert(connections.end(), shard.begin(), shard.end());
+
+	return connections;
+}
+
+size_t NetworkListener::getConnectionCount()
+{
+	size_t count = 0;
+
+	std::lock_guard<std::mutex> lock(m_connectionsLock);
+	for (auto &shard : m_connections)
+		count += shard.size();
+
+	return count;
+}
+
+void NetworkListener::setShards(const std::vector<boost::asio::io_service*> &shards)
+{
+	if (shards.empty()) return;
+
+	m_shards = shards;
+	if (m_connections.size() < m_shards.size())
+		m_connections.resize(m_shards.size());
+}
+
 unsigned short NetworkListener::getPort()
 {
 	return m_endpoint.port();
@@ -75,7 +221,9 @@ NetworkListener::servicemap_t& NetworkListener::getServices()
 bool NetworkListener::registerService(std::shared_ptr<NetworkService> service)
 {
 	if (!service) return false;
-	
+
+	service->bindMetrics(*m_components->getMetrics());
+
 	auto i = m_services.find(service->getName());
 
 	if (i == m_services.end()) {
@@ -85,6 +233,8 @@ bool NetworkListener::registerService(std::shared_ptr<NetworkService> service)
 		i->second = service;
 	}
 
+	rebuildDispatch();
+
 	return true;
 }
 
@@ -103,6 +253,8 @@ bool NetworkListener::unregisterService(const std::string &name)
 
 	m_services.erase(i);
 
+	rebuildDispatch();
+
 	return true;
 }
 
@@ -112,80 +264,211 @@ void NetworkListener::clearServices()
 		auto i = m_services.begin();
 		m_services.erase(i);
 	}
+
+	rebuildDispatch();
+}
+
+void NetworkListener::rebuildDispatch()
+{
+	auto dispatch = std::make_shared<Dispatch>();
+
+	for (auto &service : m_services) {
+		auto ids = service.second->getProtocolIds();
+		if (ids.empty()) {
+			dispatch->dynamicServices.push_back(service.second);
+			continue;
+		}
+
+		auto &table = service.second->needChecksum() ? dispatch->checksummedProtocols : dispatch->plainProtocols;
+		for (auto id : ids) {
+			if (table[id])
+				std::cout << ">>> NetworkListener: protocol 0x" << std::hex << (int)id << std::dec << " is claimed by both " << table[id]->getName() << " and " << service.first << std::endl;
+			table[id] = service.second;
+		}
+	}
+
+	std::atomic_store(&m_dispatch, std::shared_ptr<const Dispatch>(dispatch));
+}
+
+std::shared_ptr<NetworkService> NetworkListener::findService(NetworkConnectionPtr connection, PacketPtr packet)
+{
+	auto dispatch = std::atomic_load(&m_dispatch);
+	if (!dispatch) return nullptr;
+
+	auto pos = packet->pos();
+	size_t available = packet->size() - pos;
+
+	// The protocol byte follows the checksum, for the services that have one
+	if (available > 4) {
+		if (auto &service = dispatch->checksummedProtocols[packet->data()[pos + 4]])
+			return service;
+	}
+	if (available > 0) {
+		if (auto &service = dispatch->plainProtocols[packet->data()[pos]])
+			return service;
+	}
+
+	for (auto &service : dispatch->dynamicServices) {
+		if (service->needChecksum()) packet->skip(4); // go forward 4 bytes for the packet checksum
+
+		bool handles = service->canHandle(connection, packet);
+		packet->pos(pos);
+
+		if (handles) return service;
+	}
+
+	return nullptr;
 }
 
 void NetworkListener::closeConnections()
 {
-	while (!m_connections.empty()) {
-		(*m_connections.begin())->close();
-		m_connections.erase(m_connections.begin());
+	std::vector<NetworkConnectionPtr> closing;
+
+	{
+		std::lock_guard<std::mutex> lock(m_connectionsLock);
+		for (auto &connections : m_connections) {
+			closing.insert(closing.end(), connections.begin(), connections.end());
+			connections.clear();
+		}
 	}
+
+	for (auto &connection : closing)
+		connection->close();
 }
 
 void NetworkListener::removeConnection(NetworkConnectionPtr connection)
 {
-	m_connections.erase(connection);
+	{
+		std::lock_guard<std::mutex> lock(m_connectionsLock);
+		m_connections[connection->shard()].erase(connection);
+	}
+
 	if (connection->service()) connection->service()->removeConnection(connection);
 	connection->close();
 }
 
-void NetworkListener::startAccept()
+bool NetworkListener::dispatch(std::shared_ptr<NetworkService> &service, NetworkConnectionPtr &connection, PacketPtr &packet, bool first)
+{
+	auto &metrics = service->getMetrics();
+	auto started = std::chrono::steady_clock::now();
+
+	bool keep = first ? service->handleFirst(connection, packet) : service->handle(connection, packet);
+
+	if (metrics.handleTime) {
+		metrics.handleTime->record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+		metrics.packets->add();
+		metrics.bytes->add(packet->size());
+	}
+
+	return keep;
+}
+
+void NetworkListener::startAccept(std::shared_ptr<Acceptor> acceptor)
+{
+	if (!acceptor->socket) {
+		// With an acceptor per shard, connections stay on the shard that accepted them
+		acceptor->socketShard = acceptor->shard;
+		if (acceptor->spreads) acceptor->socketShard = m_nextShard.fetch_add(1, std::memory_order_relaxed) % m_shards.size();
+
+		acceptor->socket = std::make_shared<tcp::socket>(*m_shards[acceptor->socketShard]);
+	}
+
+	acceptor->acceptor.async_accept(*acceptor->socket, std::bind(&NetworkListener::handleAccept, shared_from_this(), acceptor, std::placeholders::_1));
+}
+
+void NetworkListener::closeAcceptor(std::shared_ptr<Acceptor> acceptor)
 {
-	NetworkConnectionPtr connection(new NetworkConnection(m_acceptor.get_io_service()));
-	m_connections.insert(connection);
-	m_acceptor.async_accept(connection->socket(), std::bind(&NetworkListener::handleAccept, shared_from_this(), connection, std::placeholders::_1));
+	auto close = [acceptor]() {
+		boost::system::error_code ec;
+		acceptor->acceptor.close(ec);
+	};
+
+	// A stopped io_service runs no handlers, so nothing can race the close there. Otherwise it runs on the shard, right
+	// away when called from it, so a restart from the shard can bind again at once
+	auto &ioService = *m_shards[acceptor->shard];
+	if (ioService.stopped()) close();
+	else ioService.dispatch(close);
 }
 
-void NetworkListener::handleAccept(NetworkConnectionPtr connection, boost::system::error_code error)
+void NetworkListener::handleAccept(std::shared_ptr<Acceptor> acceptor, boost::system::error_code error)
 {
-	if (error != boost::asio::error::operation_aborted)
-		startAccept();
+	// The listener was stopped
+	if (error == boost::asio::error::operation_aborted || !acceptor->acceptor.is_open())
+		return;
 
 	if (!error) {
-		auto result = m_components->OnClientConnected(shared_from_this(), connection);
-
-		// Check if any of the components "OnClientConnected" returned false and cancel the connection if that happened
-		if (std::any_of(result.begin(), result.end(), [](const std::pair<int, bool> &value) { return !value.second; })) {
-			connection->close();
-			return;
+		auto &socket = acceptor->socket;
+		boost::system::error_code ec;
+		auto remote = socket->remote_endpoint(ec);
+
+		if (ec || (m_admission && !m_admission->admit(remote.address()))) {
+			// Turned away before any connection state exists, the socket is reused for the next accept
+			socket->close(ec);
+			m_rejected->add();
+		}
+		else {
+			m_accepted->add();
+
+			size_t shard = acceptor->socketShard;
+			NetworkConnectionPtr connection(new NetworkConnection(*m_shards[shard]));
+			connection->shard(shard);
+			connection->socket() = std::move(*socket);
+			socket.reset();
+
+			// Everything else about this connection happens on its own shard, serialized by its strand
+			auto self = shared_from_this();
+			connection->strand().dispatch([self, connection]() { self->handleConnected(connection); });
 		}
+	}
 
-		connection->beginReading(std::bind(&NetworkListener::handleReceiveFirst, shared_from_this(), connection, std::placeholders::_1, std::placeholders::_2));
+	startAccept(acceptor);
+}
+
+void NetworkListener::handleConnected(NetworkConnectionPtr connection)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_connectionsLock);
+		m_connections[connection->shard()].insert(connection);
+	}
+
+	auto result = m_components->OnClientConnected(shared_from_this(), connection);
+
+	// Check if any of the components "OnClientConnected" returned false and cancel the connection if that happened
+	if (std::any_of(result.begin(), result.end(), [](const std::pair<int, bool> &value) { return !value.second; })) {
+		m_rejected->add();
+		removeConnection(connection);
+		return;
 	}
+
+	connection->beginReading(std::bind(&NetworkListener::handleReceiveFirst, shared_from_this(), connection, std::placeholders::_1, std::placeholders::_2));
 }
 
 void NetworkListener::handleReceiveFirst(NetworkConnectionPtr connection, PacketPtr packet, boost::system::error_code error)
 {
 	if (!error) {
-		auto pos = packet->pos();
-
-		for (auto &service : m_services) {
-			if (service.second->needChecksum()) packet->skip(4); // go forward 4 bytes for the packet checksum
+		auto service = findService(connection, packet);
 
-			if (service.second->canHandle(connection, packet)) {
-				// The service can handle this, verify if it needs a checksum and validate it if needed
-				if (service.second->needChecksum()) {
-					uint32_t checksum = adlerChecksum(packet->data() + pos + 4, packet->size() - pos - 4);
-
-					if (checksum != connection->getLastChecksum()) {
-						// Invalid checksum, drop the connection
-						removeConnection(connection);
-						return;
-					}
-				}
-				// skip the protocol type
-				packet->skip(1);
-				connection->service(service.second);
+		if (service) {
+			// The service can handle this, verify if it needs a checksum and validate it if needed
+			if (service->needChecksum()) {
+				packet->skip(4);
 
-				// If the service handled successfully, then the connection must be kept alive, so exit this function
-				if (service.second->handleFirst(connection, packet)) {
-					connection->beginReading(std::bind(&NetworkListener::handleReceive, shared_from_this(), connection, std::placeholders::_1, std::placeholders::_2));
+				if (!packet->validChecksum()) {
+					// Invalid checksum, drop the connection
+					m_rejected->add();
+					removeConnection(connection);
 					return;
 				}
-
-				break;
 			}
-			else if (service.second->needChecksum()) packet->pos(pos); // Rewind the 4 bytes from the checksum
+			// skip the protocol type
+			packet->skip(1);
+			connection->service(service);
+
+			// If the service handled successfully, then the connection must be kept alive, so exit this function
+			if (dispatch(service, connection, packet, true)) {
+				connection->beginReading(std::bind(&NetworkListener::handleReceive, shared_from_this(), connection, std::placeholders::_1, std::placeholders::_2));
+				return;
+			}
 		}
 	}
 
@@ -193,6 +476,7 @@ void NetworkListener::handleReceiveFirst(NetworkConnectionPtr connection, Packet
 	// . There is no service that can handle this packet
 	// . There is a service that can handle this packet, but the first failed to process the latter
 	// So, we can do nothing with this connection and, therefore, must close it.
+	if (!error) m_rejected->add();
 	removeConnection(connection);
 }
 
@@ -205,14 +489,13 @@ void NetworkListener::handleReceive(NetworkConnectionPtr connection, PacketPtr p
 			if (service) {
 				bool skipPacket = false;
 				if (service->needChecksum()) {
-					auto pos = packet->skip(4).pos();
-					uint32_t checksum = adlerChecksum(packet->data() + pos, packet->size() - pos);
+					packet->skip(4);
 
-					if (checksum != connection->getLastChecksum()) // Invalid checksum, drop the packet but keep the connection alive
+					if (!packet->validChecksum()) // Invalid checksum, drop the packet but keep the connection alive
 						skipPacket = true;
 				}
 
-				if (skipPacket || service->handle(connection, packet)) {
+				if (skipPacket || dispatch(service, connection, packet, false)) {
 					// Schedule a new reading, since we were allowed to continue
 					connection->beginReading(std::bind(&NetworkListener::handleReceive, shared_from_this(), connection, std::placeholders::_1, std::placeholders::_2));
 					return;
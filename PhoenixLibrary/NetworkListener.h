@@ -1,11 +1,17 @@
 #pragma once
 
+#include "Metrics.h"
 #include "NetworkDefinitions.h"
 
+#include <array>
+#include <atomic>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <vector>
 
+class AdmissionControl;
 class ComponentManager;
 
 class NetworkListener
@@ -21,6 +27,38 @@ public:
 	void stop();
 	void restart();
 
+	//! Spreads the accepted connections over these io services, the first being the one the listener was created with
+	/**
+	 * Where SO_REUSEPORT is available each shard gets its own acceptor, and the kernel balances connections between
+	 * them. Otherwise a single acceptor hands connections to the shards in turn. Takes effect on the next start
+	 */
+	void setShards(const std::vector<boost::asio::io_service*> &shards);
+	//! Listens on sockets received from another process instead of binding, on the next start
+	void adoptAcceptors(const std::vector<int> &descriptors) { m_adoptedAcceptors = descriptors; }
+	//! Stops accepting, and returns duplicates of the listening sockets' descriptors
+	std::vector<int> releaseAcceptors();
+
+	//! Carries on with a connection received from another process
+	bool adoptConnection(int descriptor, std::shared_ptr<NetworkService> service, bool hasKeys, std::array<uint32_t, 4> keys);
+	//! Serves a connection that did not come from the acceptors, e.g. a loopback one, from its first packet on
+	/**
+	 * The connection must run on the io_service of the shard it is set to
+	 */
+	void serveConnection(NetworkConnectionPtr connection);
+	//! Forgets a connection that was handed over to another process
+	/**
+	 * Its service hears of it as of any close, through the read NetworkConnection::releaseSocket aborts. Whatever the
+	 * service kept about the connection stays with this process, e.g. the capabilities registered with the interserver;
+	 * the other process starts over with it
+	 */
+	void releaseConnection(NetworkConnectionPtr connection);
+	//! Returns the open connections of every shard
+	std::vector<NetworkConnectionPtr> getConnections();
+	size_t getConnectionCount();
+
+	//! Sets the limits every accepted connection goes through, before anything is set up for it
+	void setAdmissionControl(std::shared_ptr<AdmissionControl> admission) { m_admission = admission; }
+
 	//! Returns the port which this listener is bound to
 	unsigned short getPort();
 	//! Returns the address which this listener is bound to
@@ -29,6 +67,10 @@ public:
 	boost::asio::ip::tcp::endpoint getEndpoint();
 
 	//! Returns the services running in this listener
+	/**
+	 * Services are registered and unregistered from one thread, usually the main one, which alone may use this map.
+	 * Connections already served keep their service
+	 */
 	servicemap_t& getServices();
 
 	//! Adds a service to the managed list
@@ -44,16 +86,66 @@ public:
 
 private:
 	boost::asio::ip::tcp::endpoint m_endpoint;
-	boost::asio::ip::tcp::acceptor m_acceptor;
+	//! Only used by the thread that registers services, which the shards never touch
 	servicemap_t m_services;
+	//! Who handles a connection, looked up from its first packet
+	struct Dispatch
+	{
+		//! Services by the protocol byte of their first packet, for services with and without a checksum before it
+		std::array<std::shared_ptr<NetworkService>, 256> checksummedProtocols, plainProtocols;
+		//! Services that did not declare protocol ids, asked one by one through canHandle
+		std::vector<std::shared_ptr<NetworkService>> dynamicServices;
+	};
+	//! Rebuilt whole whenever the services change, and swapped in atomically, as the shards may be reading it
+	std::shared_ptr<const Dispatch> m_dispatch;
 	std::shared_ptr<ComponentManager> m_components;
-	std::set<NetworkConnectionPtr> m_connections;
+	std::vector<boost::asio::io_service*> m_shards;
+	//! A listening socket, and the socket it accepts into
+	/**
+	 * Only ever used on its own shard once accepting, so its handlers hold on to it rather than look it up
+	 */
+	struct Acceptor
+	{
+		Acceptor(boost::asio::io_service &ioService, size_t _shard)
+			: acceptor(ioService), shard(_shard), spreads(false), socketShard(0) {}
+
+		boost::asio::ip::tcp::acceptor acceptor;
+		//! Shard the acceptor runs on
+		size_t shard;
+		//! Whether it hands connections to every shard in turn, as the only acceptor
+		bool spreads;
+		//! Socket being accepted into, created on the shard its connection will belong to. Reused after a rejection
+		std::shared_ptr<boost::asio::ip::tcp::socket> socket;
+		size_t socketShard;
+	};
+	std::vector<std::shared_ptr<Acceptor>> m_acceptors;
+	//! Guards m_acceptors, as stop and releaseAcceptors may run on another thread than the shards
+	std::mutex m_acceptorsLock;
+	std::shared_ptr<AdmissionControl> m_admission;
+	//! Listening sockets received from another process, used by the next start
+	std::vector<int> m_adoptedAcceptors;
+	//! Connections of each shard
+	std::vector<std::set<NetworkConnectionPtr>> m_connections;
+	//! Guards m_connections, as several workers may share a shard
+	std::mutex m_connectionsLock;
+	//! Shard for the next connection, when a single acceptor serves every shard, or a connection is adopted
+	std::atomic<size_t> m_nextShard;
+	//! Connections accepted, and those turned away before a service took them, as listener.<port>.accepted and .rejected
+	Metrics::Counter *m_accepted, *m_rejected;
+
+	void rebuildDispatch();
+	std::shared_ptr<NetworkService> findService(NetworkConnectionPtr connection, PacketPtr packet);
 
 	void removeConnection(NetworkConnectionPtr connection);
+	//! Hands a packet to the service, recording it in the service's metrics
+	bool dispatch(std::shared_ptr<NetworkService> &service, NetworkConnectionPtr &connection, PacketPtr &packet, bool first);
 
-	void startAccept();
+	void startAccept(std::shared_ptr<Acceptor> acceptor);
+	//! Closes the acceptor on its own shard, so the close can't race an accept being started there
+	void closeAcceptor(std::shared_ptr<Acceptor> acceptor);
 
-	void handleAccept(NetworkConnectionPtr connection, boost::system::error_code error);
+	void handleAccept(std::shared_ptr<Acceptor> acceptor, boost::system::error_code error);
+	void handleConnected(NetworkConnectionPtr connection);
 	void handleReceiveFirst(NetworkConnectionPtr connection, PacketPtr packet, boost::system::error_code error);
 	void handleReceive(NetworkConnectionPtr connection, PacketPtr packet, boost::system::error_code error);
 };
@@ -1,4 +1,6 @@
 #include "NetworkManager.h"
+#include "AdmissionControl.h"
+#include "HotRestart.h"
 #include "NetworkService.h"
 #include "NetworkConnection.h"
 #include "NetworkListener.h"
@@ -13,8 +15,10 @@ using boost::asio::ip::tcp;
 NetworkManager::NetworkManager(std::shared_ptr<ComponentManager> components)
 {
 	m_components = components;
+	m_admission = std::make_shared<AdmissionControl>();
 	m_running = false;
-	m_work.reset(new boost::asio::io_service::work(m_ioService));
+	m_shards.push_back(&m_ioService);
+	m_work.emplace_back(new boost::asio::io_service::work(m_ioService));
 }
 
 
@@ -42,6 +46,8 @@ bool NetworkManager::registerService(std::shared_ptr<NetworkService> service)
 		if (listener == m_listeners.end()) {
 			m_listeners.emplace_front(new NetworkListener(m_ioService, m_components, tcp::endpoint(boost::asio::ip::address::from_string(service->getBindAddress()), service->getBindPort())));
 			listener = m_listeners.begin();
+			(*listener)->setShards(m_shards);
+			(*listener)->setAdmissionControl(m_admission);
 
 			if (m_running) (*listener)->start();
 		}
@@ -124,12 +130,68 @@ void NetworkManager::clearServices()
 }
 
 
+void NetworkManager::setShardCount(unsigned int count)
+{
+	if (m_running || count == 0) return;
+
+	m_shards.resize(1);
+	m_extraShards.clear();
+	m_work.resize(1);
+
+	for (unsigned int i = 1; i < count; ++i) {
+		m_extraShards.emplace_back(new boost::asio::io_service);
+		m_shards.push_back(m_extraShards.back().get());
+		m_work.emplace_back(new boost::asio::io_service::work(*m_extraShards.back()));
+	}
+
+	for (auto &listener : m_listeners)
+		listener->setShards(m_shards);
+}
+
+
+const char* NetworkManager::getBackendName()
+{
+#if defined BOOST_ASIO_HAS_IO_URING && defined BOOST_ASIO_DISABLE_EPOLL
+	return "io_uring";
+#elif defined BOOST_ASIO_HAS_EPOLL
+	return "epoll";
+#elif defined BOOST_ASIO_HAS_KQUEUE
+	return "kqueue";
+#elif defined BOOST_ASIO_HAS_IOCP
+	return "iocp";
+#else
+	return "select";
+#endif
+}
+
+
+void NetworkManager::enableHotRestart(const std::string &path, bool handOverConnections)
+{
+	if (m_running) return;
+
+	m_hotRestart.reset(path.empty() ? nullptr : new HotRestart(*this, path, handOverConnections));
+}
+
+
 void NetworkManager::start()
 {
 	m_running = true;
 	
-	m_ioService.reset();
+	for (auto shard : m_shards)
+		shard->reset();
+
+	std::vector<HotRestart::ListenerHandoff> handedListeners;
+	std::vector<HotRestart::ConnectionHandoff> handedConnections;
+	if (m_hotRestart && m_hotRestart->takeOver(handedListeners, handedConnections)) {
+		for (auto &handoff : handedListeners) {
+			auto listener = std::find_if(m_listeners.begin(), m_listeners.end(), [&handoff](const std::shared_ptr<NetworkListener> &l) { return l->getEndpoint() == handoff.endpoint; });
+
+			if (listener != m_listeners.end()) (*listener)->adoptAcceptors(handoff.descriptors);
+			else for (int descriptor : handoff.descriptors) HotRestart::closeDescriptor(descriptor);
+		}
+	}
 
+	std::cout << ">> Network backend: " << getBackendName() << std::endl;
 	std::cout << ">> Bound addresses: " << std::endl;
 
 	for (auto &i : m_listeners) {
@@ -144,6 +206,19 @@ void NetworkManager::start()
 		std::cout << std::endl;
 		i->start();
 	}
+
+	if (m_hotRestart) {
+		for (auto &handoff : handedConnections) {
+			auto service = find(handoff.service);
+			auto listener = service ? service->getListener() : nullptr;
+
+			// adoptConnection closes the descriptor itself when it fails
+			if (listener) listener->adoptConnection(handoff.descriptor, service, handoff.hasKeys, handoff.keys);
+			else HotRestart::closeDescriptor(handoff.descriptor);
+		}
+
+		m_hotRestart->serve();
+	}
 }
 
 
@@ -151,12 +226,14 @@ void NetworkManager::stop()
 {
 	m_running = false;
 
+	if (m_hotRestart) m_hotRestart->stop();
+
 	for (auto &i : m_listeners) {
 		i->closeConnections();
 		i->stop();
 	}
 	
-	m_work.reset();
+	m_work.clear();
 }
 
 
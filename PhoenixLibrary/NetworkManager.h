@@ -6,7 +6,10 @@
 #include <string>
 #include <unordered_map>
 #include <list>
+#include <vector>
 
+class AdmissionControl;
+class HotRestart;
 class ComponentManager;
 
 class NetworkManager
@@ -37,15 +40,45 @@ public:
 	//! Returns a service, located by its name. nullptr if not found
 	std::shared_ptr<NetworkService> find(const std::string &name);
 
+	//! Returns the name of the mechanism that waits for socket readiness, as chosen at build time
+	static const char* getBackendName();
+
 	//! Returns the boost io service
 	boost::asio::io_service& getIoService() { return m_ioService; }
 
+	//! Splits the networking into count shards, each with its own io service, acceptors and connections
+	/**
+	 * Shard 0 is the main io service. Each shard is meant to be run by its own worker, so connections are only ever
+	 * touched by the thread that accepted them. Must be called before start
+	 */
+	void setShardCount(unsigned int count);
+	unsigned int getShardCount() const { return (unsigned int)m_shards.size(); }
+	//! Returns the io service of a shard
+	boost::asio::io_service& getIoService(unsigned int shard) { return *m_shards[shard]; }
+
+	//! Takes the network over from a server waiting at path on start, then waits there for a successor
+	/**
+	 * With handOverConnections, idle connections are handed over to the successor along with the listening sockets.
+	 * Must be called before start
+	 */
+	void enableHotRestart(const std::string &path, bool handOverConnections);
+
+	const std::list<std::shared_ptr<NetworkListener>>& getListeners() const { return m_listeners; }
+
+	//! Returns the connection limits shared by every listener, along with their counters
+	std::shared_ptr<AdmissionControl> getAdmissionControl() { return m_admission; }
+
 private:
 	bool m_running;
 	boost::asio::io_service m_ioService;
+	//! Every shard's io service, starting with m_ioService
+	std::vector<boost::asio::io_service*> m_shards;
+	std::vector<std::unique_ptr<boost::asio::io_service>> m_extraShards;
 	std::unordered_map<std::string, std::shared_ptr<NetworkService>> m_services;
 	std::list<std::shared_ptr<NetworkListener>> m_listeners;
 	std::shared_ptr<ComponentManager> m_components;
-	std::shared_ptr<boost::asio::io_service::work> m_work;
+	std::shared_ptr<AdmissionControl> m_admission;
+	std::unique_ptr<HotRestart> m_hotRestart;
+	std::vector<std::shared_ptr<boost::asio::io_service::work>> m_work;
 };
 
@@ -5,6 +5,9 @@ using boost::asio::ip::tcp;
 
 NetworkService::NetworkService()
 {
+	m_metrics.packets = nullptr;
+	m_metrics.bytes = nullptr;
+	m_metrics.handleTime = nullptr;
 }
 
 
@@ -43,6 +46,20 @@ bool NetworkService::needChecksum()
 	return true;
 }
 
+NetworkService::OutputPolicy NetworkService::getOutputPolicy()
+{
+	OutputPolicy policy;
+	policy.mode = OutputPolicy::Immediate;
+	policy.interval = 0;
+
+	return policy;
+}
+
+std::vector<uint8_t> NetworkService::getProtocolIds()
+{
+	return std::vector<uint8_t>();
+}
+
 bool NetworkService::canHandle(NetworkConnectionPtr connection, PacketPtr packet)
 {
 	return false;
@@ -62,3 +79,12 @@ void NetworkService::removeConnection(NetworkConnectionPtr connection)
 {
 
 }
+
+void NetworkService::bindMetrics(Metrics &metrics)
+{
+	std::string prefix = "service." + getName() + ".";
+
+	m_metrics.packets = &metrics.counter(prefix + "packets");
+	m_metrics.bytes = &metrics.counter(prefix + "bytes");
+	m_metrics.handleTime = &metrics.histogram(prefix + "handle_ns");
+}
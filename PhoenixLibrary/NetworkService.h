@@ -1,9 +1,12 @@
 #pragma once
 
+#include "Metrics.h"
 #include "NetworkDefinitions.h"
 
+#include <cstdint>
 #include <string>
 #include <memory>
+#include <vector>
 
 
 //! Interface that defines a service that will be run
@@ -23,10 +26,41 @@ public:
 	void setListener(std::shared_ptr<NetworkListener> listener);
 	std::shared_ptr<NetworkListener> getListener();
 
+	//! How packets sent to this service's connections reach the socket
+	struct OutputPolicy
+	{
+		enum Mode {
+			//! Every packet is written as soon as it is sent, with Nagle's algorithm disabled
+			Immediate,
+			//! Packets are gathered into a single frame per connection, which is written once every interval
+			PerTick
+		};
+
+		Mode mode;
+		//! Milliseconds between two flushes, for PerTick
+		unsigned int interval;
+	};
+
+	//! Returns how packets are written to this service's connections. Read when a connection is bound to the service
+	/**
+	 * PerTick sends several messages in one frame, so it only suits protocols whose frames are a stream of messages
+	 */
+	virtual OutputPolicy getOutputPolicy();
+
 	//! Function that will return whether this service packets needs checksum. All services that does NOT need checksums, should override this function.
 	virtual bool needChecksum();
 
+	//! Returns the protocol bytes that identify this service's first packet
+	/**
+	 * Read once, when the service is registered in a listener, which then dispatches first packets straight to it.
+	 * Services that return none are asked through canHandle instead
+	 */
+	virtual std::vector<uint8_t> getProtocolIds();
+
 	//! Function that will return whether this service can handle a specific packet.
+	/**
+	 * Only used for services that do not declare protocol ids
+	 */
 	virtual bool canHandle(NetworkConnectionPtr connection, PacketPtr packet);
 
 	//! Handles the first packet received on connection
@@ -44,7 +78,22 @@ public:
 	//! Handles when a connection is closed
 	virtual void removeConnection(NetworkConnectionPtr connection);
 
+	//! What the listeners record about the packets this service handles
+	struct ServiceMetrics
+	{
+		Metrics::Counter *packets;
+		Metrics::Counter *bytes;
+		//! Time spent in handleFirst and handle, in nanoseconds
+		Metrics::Histogram *handleTime;
+	};
+
+	//! Looks up this service's metrics in a registry, as service.<name>.packets, .bytes and .handle_ns
+	void bindMetrics(Metrics &metrics);
+	//! Null members until bound
+	const ServiceMetrics& getMetrics() const { return m_metrics; }
+
 private:
 	std::shared_ptr<NetworkListener> m_listener;
+	ServiceMetrics m_metrics;
 };
 
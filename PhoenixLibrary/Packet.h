@@ -1,7 +1,13 @@
 #pragma once
 
+#include "PacketPool.h"
+#include "SmallString.h"
 #include "Tools.h"
 
+#include <boost/utility/string_ref.hpp>
+
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cstdint>
@@ -27,7 +33,7 @@ class Packet
 {
 public:
 	enum { maxPacketSize = 0x7fff, headerSize = 2 };
-	typedef std::vector<uint8_t> buffer_t;
+	typedef std::vector<uint8_t, PacketAllocator<uint8_t>> buffer_t;
 
 	Packet() {
 		reset();
@@ -38,13 +44,24 @@ public:
 		m_start = copy->m_start;
 		m_position = copy->m_position;
 		m_length = copy->m_length;
+		m_validChecksum = copy->m_validChecksum;
 	}
 	~Packet() { }
 
+	//! Creates a packet whose buffer and control block are drawn from the calling thread's PacketPool
+	static std::shared_ptr<Packet> create() {
+		return std::allocate_shared<Packet>(PacketAllocator<Packet>());
+	}
+	//! Creates a pooled copy of a packet
+	static std::shared_ptr<Packet> create(Packet *copy) {
+		return std::allocate_shared<Packet>(PacketAllocator<Packet>(), copy);
+	}
+
 	Packet& reset() {
 		m_start = 8;
 		m_position = 8;
 		m_length = 0;
+		m_validChecksum = false;
 
 		m_buffer.resize(512, 0);
 
@@ -53,9 +70,7 @@ public:
 
 	template <typename T>
 	Packet& push(const T &value) {
-		while (m_position + sizeof(T) > m_buffer.size()) {
-			m_buffer.resize(m_buffer.size() + 512, 0);
-		}
+		grow(sizeof(T));
 		*(T*)&m_buffer[m_position] = value;
 		m_position += sizeof (T);
 		m_length += sizeof (T);
@@ -64,13 +79,18 @@ public:
 	}
 
 	Packet& push(const std::string &str) {
-		push<uint16_t>((uint16_t)str.length());
+		return push(boost::string_ref(str));
+	}
 
-		while (m_position + str.length() > m_buffer.size()) {
-			m_buffer.resize(m_buffer.size() + 512, 0);
-		}
+	Packet& push(const SmallString &str) {
+		return push(boost::string_ref(str));
+	}
 
-		std::memcpy(&m_buffer[m_position], str.c_str(), str.length());
+	Packet& push(boost::string_ref str) {
+		grow(sizeof(uint16_t) + str.length());
+		push<uint16_t>((uint16_t)str.length());
+
+		std::memcpy(&m_buffer[m_position], str.data(), str.length());
 		m_position += str.length();
 		m_length += str.length();
 
@@ -84,10 +104,7 @@ public:
 	}
 
 	Packet& copy(const uint8_t* buffer, size_t len) {
-		while (m_position + len > m_buffer.size()) {
-			m_buffer.resize(m_buffer.size() + 512);
-		}
-
+		grow(len);
 		std::memcpy(&m_buffer[m_position], buffer, len);
 		m_position += len;
 		m_length += len;
@@ -95,6 +112,24 @@ public:
 		return *this;
 	}
 
+	//! Makes room for len bytes at the current position, and returns where they go
+	/**
+	 * Nothing is written until commit is called with the number of bytes actually used
+	 */
+	uint8_t* prepare(size_t len) {
+		grow(len);
+
+		return &m_buffer[m_position];
+	}
+
+	//! Accepts len bytes written after prepare
+	Packet& commit(size_t len) {
+		m_position += len;
+		m_length += len;
+
+		return *this;
+	}
+
 	template <typename T>
 	T peek() {
 		return *(T*)&m_buffer[m_position];
@@ -131,6 +166,17 @@ public:
 		return m_buffer.data();
 	}
 
+	//! Grows the buffer, if needed, so it can hold at least len bytes
+	/**
+	 * The bytes added are not initialized, as whoever reserves them is about to write them, e.g. a socket read
+	 */
+	Packet& reserve(buffer_t::size_type len) {
+		if (m_buffer.size() < len)
+			m_buffer.resize(len);
+
+		return *this;
+	}
+
 	Packet& skip(size_t len) {
 		m_position += len;
 
@@ -161,10 +207,17 @@ public:
 		return maxPacketSize;
 	}
 
+	//! Where the packet begins in the buffer. Frames received share their read buffer, so they may begin anywhere in it
 	buffer_t::size_type start() {
 		return m_start;
 	}
 
+	Packet& start(buffer_t::size_type p) {
+		m_start = p;
+
+		return *this;
+	}
+
 	buffer_t::size_type pos() {
 		return m_position;
 	}
@@ -175,6 +228,20 @@ public:
 		return *this;
 	}
 
+	//! Whether the 4 bytes at the start of the body are the Adler-32 checksum of the rest of it
+	/**
+	 * Set once by the connection that received this packet, so the checksum is never computed twice
+	 */
+	bool validChecksum() const {
+		return m_validChecksum;
+	}
+
+	Packet& validChecksum(bool valid) {
+		m_validChecksum = valid;
+
+		return *this;
+	}
+
 	buffer_t::size_type parseLength() {
 		m_length = ((buffer_t::size_type)m_buffer[0] | (buffer_t::size_type)m_buffer[1] << 8) + headerSize;
 		return m_length - headerSize;
@@ -194,6 +261,13 @@ private:
 	buffer_t::size_type m_position;
 	buffer_t::size_type m_length;
 	buffer_t m_buffer;
+	bool m_validChecksum;
+
+	//! Grows the buffer, in a single step, so len more bytes fit after the current position
+	void grow(size_t len) {
+		if (m_position + len > m_buffer.size())
+			m_buffer.resize(std::max(m_position + len, m_buffer.size() + 512), 0);
+	}
 
 	template <typename T>
 	inline void addHeader(T value)
@@ -205,39 +279,59 @@ private:
 };
 
 template<>
-Packet& Packet::push<std::string>(const std::string &str) {
-	push<uint16_t>((uint16_t)str.length());
+inline Packet& Packet::push<std::string>(const std::string &str) {
+	return push(boost::string_ref(str));
+}
 
-	while (m_position + str.length() > m_buffer.size()) {
-		m_buffer.resize(m_buffer.size() + 512, 0);
+template <>
+inline Packet& Packet::push<PacketSerializable>(const PacketSerializable &s) {
+	s.write(*this);
+
+	return *this;
+}
+
+//! Reads a string without copying it. The view points into the packet buffer, and is only valid while the packet is
+/**
+ * A length running past the end of the frame yields an empty view, and leaves the packet at the end of its frame.
+ * The frame ends at size(), not at the end of the buffer: a received frame's buffer may hold bytes of the next one
+ */
+template <>
+inline boost::string_ref Packet::pop<boost::string_ref>() {
+	if (m_position + sizeof(uint16_t) > m_length) {
+		m_position = m_length;
+		return boost::string_ref();
 	}
 
-	std::memcpy(&m_buffer[m_position], str.c_str(), str.length());
-	m_position += str.length();
-	m_length += str.length();
+	size_t len = pop<uint16_t>();
+	if (m_position + len > m_length) {
+		m_position = m_length;
+		return boost::string_ref();
+	}
 
-	return *this;
+	boost::string_ref value((const char*)&m_buffer[m_position], len);
+	m_position += len;
+	return value;
 }
 
 template <>
-Packet& Packet::push<PacketSerializable>(const PacketSerializable &s) {
-	s.write(*this);
+inline boost::string_ref Packet::peek<boost::string_ref>() {
+	auto position = m_position;
+	auto value = pop<boost::string_ref>();
+	m_position = position;
+	return value;
+}
 
-	return *this;
+template <>
+inline SmallString Packet::pop<SmallString>() {
+	return SmallString(pop<boost::string_ref>());
 }
 
 template <>
-std::string Packet::peek<std::string>() {
-	uint16_t len = pop<uint16_t>();
-	std::string out((char*)&m_buffer[m_position], len);
-	m_position -= sizeof(uint16_t);
-	return out;
+inline std::string Packet::peek<std::string>() {
+	return peek<boost::string_ref>().to_string();
 }
 
 template <>
-std::string Packet::pop<std::string>() {
-	std::string::size_type s = pop<uint16_t>();
-	std::string value((char*)&m_buffer[m_position], s);
-	m_position += s;
-	return value;
+inline std::string Packet::pop<std::string>() {
+	return pop<boost::string_ref>().to_string();
 }
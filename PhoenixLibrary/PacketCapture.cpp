@@ -0,0 +1,180 @@
+#include "PacketCapture.h"
+#include "LockFreeQueue.h"
+#include "Packet.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+std::atomic<bool> PacketCapture::s_capturing(false);
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	const char magic[8] = { 'P', 'H', 'X', 'C', 'A', 'P', '1', '\n' };
+	//! Size of a record before its data
+	const size_t recordHeaderSize = 8 + 8 + 2 + 1 + 4;
+
+	//! Guards starting and stopping
+	std::mutex g_controlLock;
+	//! Created on the first start and kept, as receiving threads may still push into it right after a stop
+	std::unique_ptr<LockFreeQueue<PacketCapture::Record>> g_queue;
+	std::thread g_writer;
+	std::atomic<bool> g_stopping(false);
+	Clock::time_point g_started;
+
+	std::atomic<uint64_t> g_nextConnection(0);
+	std::atomic<uint64_t> g_recorded(0);
+	std::atomic<uint64_t> g_dropped(0);
+
+	template <typename T>
+	void putLittleEndian(uint8_t *out, T value)
+	{
+		for (size_t i = 0; i < sizeof(T); ++i)
+			out[i] = (uint8_t)(value >> (8 * i));
+	}
+
+	template <typename T>
+	T getLittleEndian(const uint8_t *in)
+	{
+		T value = 0;
+		for (size_t i = 0; i < sizeof(T); ++i)
+			value |= (T)in[i] << (8 * i);
+		return value;
+	}
+
+	void write(std::ofstream &file)
+	{
+		uint8_t header[recordHeaderSize];
+		PacketCapture::Record record;
+
+		while (true) {
+			if (!g_queue->pop(record)) {
+				if (g_stopping) break;
+
+				// Nothing waiting, let the receiving threads fill the queue up a bit
+				file.flush();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+
+			uint32_t length = record.data ? (uint32_t)record.data->size() : 0;
+
+			putLittleEndian<uint64_t>(header, record.time);
+			putLittleEndian<uint64_t>(header + 8, record.connection);
+			putLittleEndian<uint16_t>(header + 16, record.port);
+			header[18] = (uint8_t)record.type;
+			putLittleEndian<uint32_t>(header + 19, length);
+
+			file.write((const char*)header, sizeof(header));
+			if (length > 0) file.write((const char*)record.data->data() + record.data->start(), length);
+		}
+
+		file.close();
+	}
+}
+
+bool PacketCapture::start(const std::string &path)
+{
+	stop();
+
+	std::lock_guard<std::mutex> lock(g_controlLock);
+
+	auto file = std::make_shared<std::ofstream>(path, std::ios::binary | std::ios::trunc);
+	if (!*file) {
+		std::cout << ">>> PacketCapture: could not create " << path << std::endl;
+		return false;
+	}
+	file->write(magic, sizeof(magic));
+
+	if (!g_queue) g_queue.reset(new LockFreeQueue<Record>(PacketCapture::queueSize));
+
+	// Left over from right after the previous capture stopped
+	Record stale;
+	while (g_queue->pop(stale)) {}
+
+	g_started = Clock::now();
+	g_stopping = false;
+	g_writer = std::thread([file]() { write(*file); });
+	s_capturing = true;
+
+	return true;
+}
+
+void PacketCapture::stop()
+{
+	std::lock_guard<std::mutex> lock(g_controlLock);
+	if (!g_writer.joinable()) return;
+
+	s_capturing = false;
+	g_stopping = true;
+	g_writer.join();
+}
+
+uint64_t PacketCapture::nextConnectionId()
+{
+	return ++g_nextConnection;
+}
+
+void PacketCapture::record(uint64_t connection, uint16_t port, RecordType type, const uint8_t *data, size_t length)
+{
+	if (!s_capturing.load(std::memory_order_acquire)) return;
+
+	Record record;
+	record.time = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - g_started).count();
+	record.connection = connection;
+	record.port = port;
+	record.type = type;
+
+	if (length > 0) {
+		record.data = Packet::create();
+		record.data->copy(data, length);
+	}
+
+	if (g_queue->push(std::move(record))) g_recorded.fetch_add(1, std::memory_order_relaxed);
+	else g_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+PacketCapture::Statistics PacketCapture::getStatistics()
+{
+	Statistics statistics;
+	statistics.recorded = g_recorded.load(std::memory_order_relaxed);
+	statistics.dropped = g_dropped.load(std::memory_order_relaxed);
+
+	return statistics;
+}
+
+bool PacketCapture::readHeader(std::istream &in)
+{
+	char header[sizeof(magic)];
+	return in.read(header, sizeof(header)) && std::memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+bool PacketCapture::read(std::istream &in, Record &record)
+{
+	uint8_t header[recordHeaderSize];
+	if (!in.read((char*)header, sizeof(header))) return false;
+
+	record.time = getLittleEndian<uint64_t>(header);
+	record.connection = getLittleEndian<uint64_t>(header + 8);
+	record.port = getLittleEndian<uint16_t>(header + 16);
+	record.type = (RecordType)header[18];
+
+	uint32_t length = getLittleEndian<uint32_t>(header + 19);
+	record.data.reset();
+
+	if (length > 0) {
+		if (length > Packet::maxPacketSize + Packet::headerSize) return false;
+
+		record.data = Packet::create();
+		record.data->reserve(record.data->start() + length);
+		if (!in.read((char*)record.data->data() + record.data->start(), length)) return false;
+		record.data->size(length);
+	}
+
+	return true;
+}
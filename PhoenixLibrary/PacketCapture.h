@@ -0,0 +1,81 @@
+#pragma once
+
+#include "NetworkDefinitions.h"
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <string>
+
+//! Records the frames connections receive into a file, for PacketReplay to feed back to the services later
+/**
+ * Frames are recorded as they came off the wire, before decryption, so a replay goes through the same key exchange and
+ * decryption as the original connections did. Receiving threads only copy the frame and push it into a lock-free
+ * queue; a background thread writes the file. When the writer falls behind, frames are dropped rather than slowing the
+ * network down, and counted in the statistics.
+ *
+ * Only connections whose first frame arrives while capturing are recorded, so every recorded connection starts from its
+ * first packet.
+ *
+ * The file starts with the 8 bytes "PHXCAP1\n", followed by records of, in little endian:
+ *   uint64 microseconds since the capture started
+ *   uint64 connection id, unique within the capture
+ *   uint16 local port the connection was accepted on
+ *   uint8  record type, see RecordType
+ *   uint32 length, then as many bytes of frame
+ */
+class PacketCapture
+{
+public:
+	enum {
+		//! Records that may wait for the writer before frames are dropped
+		queueSize = 65536
+	};
+
+	enum class RecordType : uint8_t {
+		//! A frame, length and header included
+		Frame = 0,
+		//! The connection was closed. No data
+		Closed = 1
+	};
+
+	struct Record
+	{
+		uint64_t time;
+		uint64_t connection;
+		uint16_t port;
+		RecordType type;
+		//! The frame, from the packet's start. Null for other types
+		PacketPtr data;
+	};
+
+	struct Statistics
+	{
+		uint64_t recorded;
+		//! Records lost because the writer fell behind
+		uint64_t dropped;
+	};
+
+	//! Starts capturing into path, ending any capture in progress. False when the file can't be created
+	static bool start(const std::string &path);
+	//! Stops capturing, once what was already recorded is written
+	static void stop();
+
+	//! A single load, cheap enough to check on every frame
+	static bool isCapturing() { return s_capturing.load(std::memory_order_relaxed); }
+
+	//! Id for a connection whose first frame is being recorded
+	static uint64_t nextConnectionId();
+	//! Queues a record for the writer. Never blocks
+	static void record(uint64_t connection, uint16_t port, RecordType type, const uint8_t *data = nullptr, size_t length = 0);
+
+	static Statistics getStatistics();
+
+	//! Checks that a stream holds a capture, and skips past its header
+	static bool readHeader(std::istream &in);
+	//! Reads the next record of a capture. False at the end of the stream, or when the record is truncated
+	static bool read(std::istream &in, Record &record);
+
+private:
+	static std::atomic<bool> s_capturing;
+};
@@ -0,0 +1,231 @@
+#include "PacketPool.h"
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+struct PacketPool::Header
+{
+	//! Pool which the block belongs to. nullptr for blocks that bypass the pool
+	PacketPool *owner;
+	size_t sizeClass;
+};
+
+struct PacketPool::Block
+{
+	Header header;
+	//! Next free block. Overlaps the user data, which is not alive while the block is free
+	Block *next;
+};
+
+namespace {
+	//! Keeps the user data aligned for any fundamental type
+	const size_t headerSize = 16;
+	static_assert(headerSize >= sizeof(void*) + sizeof(size_t), "PacketPool header does not fit");
+
+	std::mutex g_poolsLock;
+	//! Every pool ever created. Pools are never destroyed, as blocks may still be in flight when their thread exits
+	std::vector<PacketPool*> g_pools;
+	//! Pools whose thread has exited, waiting to be adopted by a new thread
+	std::vector<PacketPool*> g_orphanPools;
+
+	size_t classFor(size_t size)
+	{
+		size_t sizeClass = 0, blockSize = PacketPool::minBlockSize;
+		while (blockSize < size && sizeClass < PacketPool::sizeClasses) {
+			blockSize <<= 1;
+			++sizeClass;
+		}
+
+		return sizeClass;
+	}
+
+	size_t classSize(size_t sizeClass)
+	{
+		return (size_t)PacketPool::minBlockSize << sizeClass;
+	}
+
+	//! Increments a counter which is only written by the pool's owner thread
+	inline void bump(std::atomic<uint64_t> &counter)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+struct ThreadPoolHolder
+{
+	~ThreadPoolHolder();
+
+	void acquire();
+};
+
+static thread_local PacketPool *t_pool = nullptr;
+static thread_local bool t_poolReleased = false;
+static thread_local ThreadPoolHolder t_poolHolder;
+
+void ThreadPoolHolder::acquire()
+{
+	std::lock_guard<std::mutex> lock(g_poolsLock);
+
+	if (!g_orphanPools.empty()) {
+		t_pool = g_orphanPools.back();
+		g_orphanPools.pop_back();
+	}
+	else {
+		t_pool = new PacketPool;
+		g_pools.push_back(t_pool);
+	}
+}
+
+ThreadPoolHolder::~ThreadPoolHolder()
+{
+	if (t_pool) {
+		t_pool->clear();
+
+		std::lock_guard<std::mutex> lock(g_poolsLock);
+		g_orphanPools.push_back(t_pool);
+	}
+
+	t_pool = nullptr;
+	t_poolReleased = true;
+}
+
+PacketPool::PacketPool()
+	: m_remote(nullptr), m_hits(0), m_misses(0), m_remoteReleases(0), m_oversized(0)
+{
+	for (size_t i = 0; i < sizeClasses; ++i) {
+		m_free[i] = nullptr;
+		m_count[i] = 0;
+	}
+}
+
+PacketPool::~PacketPool()
+{
+	clear();
+}
+
+PacketPool* PacketPool::local()
+{
+	// Once the thread is exiting, allocations bypass the pool
+	if (!t_pool && !t_poolReleased)
+		t_poolHolder.acquire();
+
+	return t_pool;
+}
+
+void* PacketPool::allocate(size_t size)
+{
+	PacketPool *pool = local();
+	size_t sizeClass = classFor(size);
+	void *memory = nullptr;
+
+	if (pool && sizeClass < sizeClasses) {
+		memory = pool->pop(sizeClass);
+		if (!memory) memory = ::operator new(classSize(sizeClass) + headerSize);
+	}
+	else {
+		if (pool) bump(pool->m_oversized);
+
+		memory = ::operator new(size + headerSize);
+		pool = nullptr;
+	}
+
+	Header *header = static_cast<Header*>(memory);
+	header->owner = pool;
+	header->sizeClass = sizeClass;
+
+	return static_cast<uint8_t*>(memory) + headerSize;
+}
+
+void PacketPool::deallocate(void *p)
+{
+	if (!p) return;
+
+	Block *block = reinterpret_cast<Block*>(static_cast<uint8_t*>(p) - headerSize);
+	PacketPool *owner = block->header.owner;
+
+	if (!owner)
+		::operator delete(block);
+	else if (owner == t_pool)
+		owner->push(block, block->header.sizeClass);
+	else
+		owner->pushRemote(block);
+}
+
+PacketPool::Statistics PacketPool::getStatistics()
+{
+	Statistics statistics = { 0, 0, 0, 0 };
+
+	std::lock_guard<std::mutex> lock(g_poolsLock);
+	for (auto pool : g_pools) {
+		statistics.hits += pool->m_hits.load(std::memory_order_relaxed);
+		statistics.misses += pool->m_misses.load(std::memory_order_relaxed);
+		statistics.remoteReleases += pool->m_remoteReleases.load(std::memory_order_relaxed);
+		statistics.oversized += pool->m_oversized.load(std::memory_order_relaxed);
+	}
+
+	return statistics;
+}
+
+void* PacketPool::pop(size_t sizeClass)
+{
+	if (!m_free[sizeClass]) drainRemote();
+
+	Block *block = m_free[sizeClass];
+	if (!block) {
+		bump(m_misses);
+		return nullptr;
+	}
+
+	m_free[sizeClass] = block->next;
+	--m_count[sizeClass];
+	bump(m_hits);
+
+	return block;
+}
+
+void PacketPool::push(Block *block, size_t sizeClass)
+{
+	if (m_count[sizeClass] >= maxCachedBlocks) {
+		::operator delete(block);
+		return;
+	}
+
+	block->next = m_free[sizeClass];
+	m_free[sizeClass] = block;
+	++m_count[sizeClass];
+}
+
+void PacketPool::pushRemote(Block *block)
+{
+	block->next = m_remote.load(std::memory_order_relaxed);
+	while (!m_remote.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed));
+
+	m_remoteReleases.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PacketPool::drainRemote()
+{
+	Block *block = m_remote.exchange(nullptr, std::memory_order_acquire);
+
+	while (block) {
+		Block *next = block->next;
+		push(block, block->header.sizeClass);
+		block = next;
+	}
+}
+
+void PacketPool::clear()
+{
+	drainRemote();
+
+	for (size_t i = 0; i < sizeClasses; ++i) {
+		while (m_free[i]) {
+			Block *next = m_free[i]->next;
+			::operator delete(m_free[i]);
+			m_free[i] = next;
+		}
+
+		m_count[i] = 0;
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+//! Per-thread pool of fixed size blocks, from which Packet buffers are allocated
+/**
+ * Each thread owns a pool with one free list per size class. Blocks are always returned to the pool that allocated them:
+ * releases from the owner thread go straight to its free list, while releases from any other thread are pushed into a
+ * lock-free list that the owner drains on its next miss.
+ */
+class PacketPool
+{
+public:
+	enum {
+		//! Size of the smallest block, in bytes
+		minBlockSize = 128,
+		//! Number of size classes. Blocks are powers of two, from minBlockSize up to 64KiB
+		sizeClasses = 10,
+		//! Maximum number of free blocks cached by a thread, per size class
+		maxCachedBlocks = 256
+	};
+
+	struct Statistics
+	{
+		//! Allocations served from a free list
+		uint64_t hits;
+		//! Allocations that had to go to the system allocator
+		uint64_t misses;
+		//! Blocks released by a thread other than the one which allocated them
+		uint64_t remoteReleases;
+		//! Allocations bigger than the largest size class
+		uint64_t oversized;
+	};
+
+	//! Allocates a block of at least size bytes from the calling thread's pool
+	static void* allocate(size_t size);
+	//! Returns a block to the pool that allocated it
+	static void deallocate(void *p);
+
+	//! Returns the counters summed across every pool
+	static Statistics getStatistics();
+
+private:
+	struct Block;
+	struct Header;
+	friend struct ThreadPoolHolder;
+
+	PacketPool();
+	~PacketPool();
+
+	static PacketPool* local();
+
+	void* pop(size_t sizeClass);
+	void push(Block *block, size_t sizeClass);
+	void pushRemote(Block *block);
+	void drainRemote();
+	void clear();
+
+	Block *m_free[sizeClasses];
+	size_t m_count[sizeClasses];
+	std::atomic<Block*> m_remote;
+
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_remoteReleases;
+	std::atomic<uint64_t> m_oversized;
+};
+
+//! Standard allocator that draws from PacketPool
+template <typename T>
+class PacketAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind { typedef PacketAllocator<U> other; };
+
+	PacketAllocator() {}
+	template <typename U>
+	PacketAllocator(const PacketAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(PacketPool::allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t) {
+		PacketPool::deallocate(p);
+	}
+
+	//! Default-initializes, so bytes added by resize(n) are left as they are instead of zeroed one by one
+	template <typename U>
+	void construct(U *p) {
+		::new((void*)p) U;
+	}
+
+	template <typename U, typename... Args>
+	void construct(U *p, Args&&... args) {
+		::new((void*)p) U(std::forward<Args>(args)...);
+	}
+
+	template <typename U>
+	bool operator==(const PacketAllocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const PacketAllocator<U>&) const { return false; }
+};
@@ -0,0 +1,104 @@
+#include "PacketReplay.h"
+#include "LoopbackConnection.h"
+#include "NetworkListener.h"
+#include "NetworkManager.h"
+#include "PacketCapture.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	//! Frames replayed between two sweeps of every connection's output
+	const uint64_t drainInterval = 1024;
+
+	void discardOutput(LoopbackConnection &connection)
+	{
+		PacketPtr packet;
+		while (connection.receive(packet)) {}
+	}
+}
+
+PacketReplay::PacketReplay(std::shared_ptr<NetworkManager> network)
+	: m_network(network), m_nextShard(0)
+{
+	m_statistics.frames = 0;
+	m_statistics.connections = 0;
+	m_statistics.skipped = 0;
+	m_statistics.seconds = 0;
+}
+
+bool PacketReplay::run(const std::string &path, Pace pace)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in || !PacketCapture::readHeader(in)) {
+		std::cout << ">>> PacketReplay: " << path << " is not a packet capture" << std::endl;
+		return false;
+	}
+
+	std::unordered_map<uint64_t, std::shared_ptr<LoopbackConnection>> connections;
+	auto started = Clock::now();
+
+	PacketCapture::Record record;
+	while (PacketCapture::read(in, record)) {
+		if (pace == Pace::Recorded)
+			std::this_thread::sleep_until(started + std::chrono::microseconds(record.time));
+
+		auto i = connections.find(record.connection);
+
+		if (record.type == PacketCapture::RecordType::Closed) {
+			if (i != connections.end()) {
+				i->second->peerClosed();
+				discardOutput(*i->second);
+				connections.erase(i);
+			}
+			continue;
+		}
+
+		if (i == connections.end()) {
+			std::shared_ptr<NetworkListener> listener;
+			for (auto &candidate : m_network->getListeners()) {
+				if (candidate->getPort() == record.port) listener = candidate;
+			}
+
+			if (!listener) {
+				m_statistics.skipped++;
+				continue;
+			}
+
+			unsigned int shard = m_nextShard++ % m_network->getShardCount();
+			auto connection = std::make_shared<LoopbackConnection>(m_network->getIoService(shard));
+			connection->shard(shard);
+			// Services that tell connections apart by their address need each to have its own
+			connection->remoteEndpoint(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), (unsigned short)(1 + record.connection % 65535)));
+
+			listener->serveConnection(connection);
+
+			i = connections.emplace(record.connection, connection).first;
+			m_statistics.connections++;
+		}
+
+		// A full queue means the service is behind: wait for it, unless it dropped the connection
+		while (!i->second->deliver(record.data) && i->second->isOpen()) {
+			discardOutput(*i->second);
+			std::this_thread::yield();
+		}
+		discardOutput(*i->second);
+
+		// Connections that only get broadcasts would otherwise fill up and fail their sends
+		if (++m_statistics.frames % drainInterval == 0) {
+			for (auto &connection : connections) discardOutput(*connection.second);
+		}
+	}
+
+	for (auto &connection : connections)
+		connection.second->peerClosed();
+
+	m_statistics.seconds = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - started).count();
+
+	return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "NetworkDefinitions.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class NetworkManager;
+
+//! Feeds a PacketCapture file back to the services of a NetworkManager, over loopback connections
+/**
+ * Each recorded connection gets a LoopbackConnection, served by the listener of the port it was accepted on, which
+ * receives its frames in the recorded order; when the capture says it was closed, the service sees its peer go away.
+ * Frames for ports no listener serves, e.g. those of outgoing connections, are skipped. Whatever the services send
+ * back is discarded. The replay runs on the calling thread while the network's workers serve the connections.
+ */
+class PacketReplay
+{
+public:
+	enum class Pace {
+		//! Each frame as soon as its connection can take it
+		Fast,
+		//! Frames spaced as they were recorded
+		Recorded
+	};
+
+	struct Statistics
+	{
+		uint64_t frames;
+		uint64_t connections;
+		//! Frames for ports no listener serves
+		uint64_t skipped;
+		double seconds;
+	};
+
+	PacketReplay(std::shared_ptr<NetworkManager> network);
+
+	//! Replays the whole capture at path. False when it can't be read
+	bool run(const std::string &path, Pace pace);
+
+	const Statistics& getStatistics() const { return m_statistics; }
+
+private:
+	std::shared_ptr<NetworkManager> m_network;
+	Statistics m_statistics;
+	unsigned int m_nextShard;
+};
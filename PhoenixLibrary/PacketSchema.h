@@ -0,0 +1,207 @@
+#pragma once
+
+#include "Packet.h"
+#include "SmallString.h"
+
+#include <boost/utility/string_ref.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+//! Encodes and decodes a single field type
+/**
+ * Every codec provides:
+ * . minSize: bytes the field takes at least, checked once for the whole message before reading
+ * . maxSize(value): bytes the field may take when writing value
+ * . write(out, value): writes value, returns the end of what was written
+ * . read(in, end, value): reads value, returns the end of what was read, or nullptr if it runs past end. minSize bytes
+ *   are always available, so only variable length fields need to look at end
+ *
+ * The default handles arithmetic and enum types, which are stored as their raw bytes.
+ */
+template <typename T, typename Enable = void>
+struct FieldCodec
+{
+	static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "No FieldCodec for this type");
+
+	enum { minSize = sizeof(T) };
+
+	static size_t maxSize(const T &) { return sizeof(T); }
+
+	static uint8_t* write(uint8_t *out, const T &value) {
+		std::memcpy(out, &value, sizeof(T));
+		return out + sizeof(T);
+	}
+
+	static const uint8_t* read(const uint8_t *in, const uint8_t *, T &value) {
+		std::memcpy(&value, in, sizeof(T));
+		return in + sizeof(T);
+	}
+};
+
+//! Booleans go on the wire as a single 0 or 1 byte
+template <>
+struct FieldCodec<bool>
+{
+	enum { minSize = 1 };
+
+	static size_t maxSize(const bool &) { return 1; }
+
+	static uint8_t* write(uint8_t *out, const bool &value) {
+		*out = value ? 1 : 0;
+		return out + 1;
+	}
+
+	static const uint8_t* read(const uint8_t *in, const uint8_t *, bool &value) {
+		value = *in != 0;
+		return in + 1;
+	}
+};
+
+//! Strings go on the wire as a 16 bit length followed by the characters
+struct StringCodec
+{
+	enum { minSize = sizeof(uint16_t) };
+
+	static size_t maxSize(boost::string_ref value) { return sizeof(uint16_t) + value.size(); }
+
+	static uint8_t* write(uint8_t *out, boost::string_ref value) {
+		uint16_t length = (uint16_t)value.size();
+		std::memcpy(out, &length, sizeof(length));
+		std::memcpy(out + sizeof(length), value.data(), length);
+		return out + sizeof(length) + length;
+	}
+
+	//! Reads the string as a view into the buffer
+	static const uint8_t* read(const uint8_t *in, const uint8_t *end, boost::string_ref &value) {
+		uint16_t length;
+		std::memcpy(&length, in, sizeof(length));
+		in += sizeof(length);
+
+		// The 2 length bytes were covered by minSize, the characters were not
+		if ((size_t)(end - in) < length) return nullptr;
+
+		value = boost::string_ref((const char*)in, length);
+		return in + length;
+	}
+};
+
+template <>
+struct FieldCodec<std::string> : StringCodec
+{
+	static const uint8_t* read(const uint8_t *in, const uint8_t *end, std::string &value) {
+		boost::string_ref view;
+		in = StringCodec::read(in, end, view);
+		if (in) value.assign(view.data(), view.size());
+		return in;
+	}
+};
+
+template <>
+struct FieldCodec<SmallString> : StringCodec
+{
+	static const uint8_t* read(const uint8_t *in, const uint8_t *end, SmallString &value) {
+		boost::string_ref view;
+		in = StringCodec::read(in, end, view);
+		if (in) value.assign(view.data(), view.size());
+		return in;
+	}
+};
+
+//! Binds a data member to its position in a message
+template <typename Class, typename T, T Class::*Member>
+struct Field
+{
+	typedef FieldCodec<T> Codec;
+
+	enum { minSize = Codec::minSize };
+
+	static size_t maxSize(const Class &object) { return Codec::maxSize(object.*Member); }
+	static uint8_t* write(uint8_t *out, const Class &object) { return Codec::write(out, object.*Member); }
+	static const uint8_t* read(const uint8_t *in, const uint8_t *end, Class &object) { return Codec::read(in, end, object.*Member); }
+};
+
+namespace detail {
+	template <typename Class, typename... Fields>
+	struct SchemaFields;
+
+	template <typename Class>
+	struct SchemaFields<Class>
+	{
+		enum { minSize = 0 };
+
+		static size_t maxSize(const Class &) { return 0; }
+		static uint8_t* write(uint8_t *out, const Class &) { return out; }
+		static const uint8_t* read(const uint8_t *in, const uint8_t *, Class &) { return in; }
+	};
+
+	template <typename Class, typename First, typename... Rest>
+	struct SchemaFields<Class, First, Rest...>
+	{
+		typedef SchemaFields<Class, Rest...> Next;
+
+		enum { minSize = First::minSize + Next::minSize };
+
+		static size_t maxSize(const Class &object) {
+			return First::maxSize(object) + Next::maxSize(object);
+		}
+
+		static uint8_t* write(uint8_t *out, const Class &object) {
+			return Next::write(First::write(out, object), object);
+		}
+
+		static const uint8_t* read(const uint8_t *in, const uint8_t *end, Class &object) {
+			// Whatever this field takes, the fixed part of the following ones must still fit
+			in = First::read(in, end - Next::minSize, object);
+			return in ? Next::read(in, end, object) : nullptr;
+		}
+	};
+}
+
+//! Message layout declared once, from which the encoder and decoder are generated
+/**
+ * Usage, inside the message class so private members can be bound:
+ *
+ *     typedef PacketSchema<Account,
+ *         Field<Account, bool, &Account::m_success>,
+ *         Field<Account, std::string, &Account::m_username>> Schema;
+ *
+ * Writing sizes the whole message first and grows the packet at most once. Reading checks the fixed size part of
+ * the message once, and only variable length fields check their own length.
+ */
+template <typename Class, typename... Fields>
+class PacketSchema
+{
+	typedef detail::SchemaFields<Class, Fields...> All;
+
+public:
+	//! Bytes the message takes when every variable length field is empty
+	enum { minSize = All::minSize };
+
+	static void write(Packet &packet, const Class &object) {
+		size_t size = All::maxSize(object);
+		uint8_t *out = packet.prepare(size);
+
+		packet.commit(All::write(out, object) - out);
+	}
+
+	//! Reads the message at the packet's position
+	/**
+	 * @returns false, leaving the packet position untouched, if the message runs past the end of the frame. A received
+	 * frame ends at size(); the buffer past it may hold the next frame of the same read
+	 */
+	static bool read(Packet &packet, Class &object) {
+		const uint8_t *in = packet.data() + packet.pos();
+		const uint8_t *end = packet.data() + packet.size();
+		if (in > end || (size_t)(end - in) < (size_t)minSize) return false;
+
+		const uint8_t *last = All::read(in, end, object);
+		if (!last) return false;
+
+		packet.skip(last - in);
+		return true;
+	}
+};
@@ -2,8 +2,10 @@
 
 #include "ComponentManager.h"
 #include "LuaNetworkService.h"
+#include "Metrics.h"
 #include "NetworkConnection.h"
 #include "NetworkManager.h"
+#include "PacketPool.h"
 #include "Settings.h"
 
 #include <boost/filesystem.hpp>
@@ -14,6 +16,9 @@
 #include <deque>
 #include <algorithm>
 
+//! Registry key of the Script lock, by its address
+static const char stateLockKey = 0;
+
 Script::Script()
 {
 	L = nullptr;
@@ -46,6 +51,10 @@ bool Script::initialize(const std::string &path, std::shared_ptr<Settings> setti
 
 	luaL_openlibs(L);
 
+	// Lets every Lua thread of this state find the lock, see lua_statelock
+	lua_pushlightuserdata(L, &m_lock);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &stateLockKey);
+
 	// Load common library folder
 	std::deque<std::string> libs, specific;
 	fs::path libDir(settings->getString("dataDirectory") + "/libs");
@@ -92,6 +101,7 @@ bool Script::initialize(const std::string &path, std::shared_ptr<Settings> setti
 void Script::deinitialize()
 {
 	if (!L) return;
+	std::lock_guard<std::recursive_mutex> lock(m_lock);
 
 	while (!m_envs.empty()) {
 		unload(m_envs.begin()->first);
@@ -104,6 +114,7 @@ void Script::deinitialize()
 bool Script::load(const std::string &path, const std::string &scriptId)
 {
 	if (!L) return false;
+	std::lock_guard<std::recursive_mutex> lock(m_lock);
 
 	// Get our first stack position
 	int start = lua_gettop(L);
@@ -148,6 +159,7 @@ bool Script::load(const std::string &path, const std::string &scriptId)
 
 bool Script::unload(const std::string &scriptId)
 {
+	std::lock_guard<std::recursive_mutex> lock(m_lock);
 	if (!prepareCall("scriptId", "onUnloaded") || !call(0, 0))
 		return false;
 
@@ -211,6 +223,14 @@ int createMetatable(lua_State *L, const char *tableName, const luaL_Reg *functio
 	return 1;
 }
 
+std::recursive_mutex& lua_statelock(lua_State *L)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &stateLockKey);
+	auto lock = (std::recursive_mutex*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return *lock;
+}
+
 LuaNetworkService* checkNetworkService(lua_State *L) {
 	auto udata = luaL_checkudata(L, 1, "PhoenixTibia.NetworkService");
 	luaL_argcheck(L, udata != NULL, 1, "`networkservice' expected");
@@ -308,6 +328,7 @@ int manager_callbackRegister(lua_State *L)
 		};
 
 		auto callback = [L, idx, type, getFunction]() {
+			std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 			getFunction(L, idx, type);
 			int call = lua_pcall(L, 0, 0, 0);
 
@@ -318,6 +339,7 @@ int manager_callbackRegister(lua_State *L)
 		};
 
 		auto callbackRegistering = [L, idx, type, getFunction](std::shared_ptr<NetworkService> service, std::shared_ptr<NetworkListener> listener) {
+			std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 			getFunction(L, idx, type);
 			// TODO: push a lua_userobject for both service and listener
 			lua_pushnil(L);
@@ -339,6 +361,7 @@ int manager_callbackRegister(lua_State *L)
 		};
 
 		auto callbackRegistered = [L, idx, type, getFunction](std::shared_ptr<NetworkService> service) {
+			std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 			getFunction(L, idx, type);
 			// TODO: push a lua_userobject for service
 			lua_pushnil(L);
@@ -352,6 +375,7 @@ int manager_callbackRegister(lua_State *L)
 		};
 
 		auto callbackUnregistering = [L, idx, type, getFunction](std::shared_ptr<NetworkService> service) {
+			std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 			getFunction(L, idx, type);
 			// TODO: push a lua_userobject for service
 			lua_pushnil(L);
@@ -371,6 +395,7 @@ int manager_callbackRegister(lua_State *L)
 		};
 
 		auto callbackClientConnected = [L, idx, type, getFunction](std::shared_ptr<NetworkListener> listener, NetworkConnectionPtr connection) {
+			std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 			getFunction(L, idx, type);
 			// TODO: push a lua_userobject for listener
 			lua_pushnil(L);
@@ -457,9 +482,78 @@ int manager_callbackUnregister(lua_State *L)
 	return 0;
 }
 
+int manager_metrics(lua_State *L)
+{
+	auto snapshot = manager->getMetrics()->snapshot();
+
+	lua_createtable(L, 0, (int)(snapshot.counters.size() + snapshot.gauges.size() + snapshot.histograms.size()));
+	for (auto &counter : snapshot.counters) {
+		lua_pushinteger(L, (lua_Integer)counter.second);
+		lua_setfield(L, -2, counter.first.c_str());
+	}
+	for (auto &gauge : snapshot.gauges) {
+		lua_pushinteger(L, (lua_Integer)gauge.second);
+		lua_setfield(L, -2, gauge.first.c_str());
+	}
+	for (auto &histogram : snapshot.histograms) {
+		lua_createtable(L, 0, 7);
+		lua_pushinteger(L, (lua_Integer)histogram.second.count);
+		lua_setfield(L, -2, "count");
+		lua_pushinteger(L, (lua_Integer)histogram.second.sum);
+		lua_setfield(L, -2, "sum");
+		lua_pushinteger(L, (lua_Integer)histogram.second.p50);
+		lua_setfield(L, -2, "p50");
+		lua_pushinteger(L, (lua_Integer)histogram.second.p90);
+		lua_setfield(L, -2, "p90");
+		lua_pushinteger(L, (lua_Integer)histogram.second.p99);
+		lua_setfield(L, -2, "p99");
+		lua_pushinteger(L, (lua_Integer)histogram.second.p999);
+		lua_setfield(L, -2, "p999");
+		lua_pushinteger(L, (lua_Integer)histogram.second.max);
+		lua_setfield(L, -2, "max");
+		lua_setfield(L, -2, histogram.first.c_str());
+	}
+
+	return 1;
+}
+
+int manager_count(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	lua_Integer count = luaL_optinteger(L, 2, 1);
+
+	manager->getMetrics()->counter(name).add((uint64_t)count);
+
+	return 0;
+}
+
+int manager_gauge(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	lua_Integer value = luaL_checkinteger(L, 2);
+
+	manager->getMetrics()->gauge(name).set((int64_t)value);
+
+	return 0;
+}
+
+int manager_observe(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	lua_Integer value = luaL_checkinteger(L, 2);
+
+	manager->getMetrics()->histogram(name).record(value > 0 ? (uint64_t)value : 0);
+
+	return 0;
+}
+
 const luaL_Reg managerLib[] = {
 	{ "register", manager_callbackRegister },
 	{ "unregister", manager_callbackUnregister },
+	{ "metrics", manager_metrics },
+	{ "count", manager_count },
+	{ "gauge", manager_gauge },
+	{ "observe", manager_observe },
 	{ NULL, NULL },
 };
 
@@ -515,6 +609,9 @@ int networkservice_setprop(lua_State *L) {
 	else if (stricmp(prop, "needChecksum") == 0) {
 		service->checksum = lua_toboolean(L, 3) != 0;
 	}
+	else if (stricmp(prop, "outputInterval") == 0) {
+		service->outputInterval = (unsigned int)luaL_checkinteger(L, 3);
+	}
 	else if (stricmp(prop, "canHandle") == 0 || stricmp(prop, "handleFirst") == 0 || stricmp(prop, "handle") == 0 || stricmp(prop, "removeConnection") == 0) {
 		luaL_checktype(L, 3, LUA_TFUNCTION);
 
@@ -540,6 +637,9 @@ int networkservice_getprop(lua_State *L) {
 	else if (stricmp(prop, "needChecksum") == 0) {
 		lua_pushboolean(L, service->needChecksum());
 	}
+	else if (stricmp(prop, "outputInterval") == 0) {
+		lua_pushinteger(L, service->outputInterval);
+	}
 	else if (stricmp(prop, "name") == 0) {
 		lua_pushstring(L, service->getName().c_str());
 	}
@@ -689,7 +789,8 @@ int packet_peekString(lua_State *L) {
 	auto packet = lua_topacket(L, 1);
 	lua_pop(L, 1);
 
-	lua_pushstring(L, packet->peek<std::string>().c_str());
+	auto value = packet->peek<boost::string_ref>();
+	lua_pushlstring(L, value.data(), value.size());
 
 	return 1;
 }
@@ -708,7 +809,8 @@ int packet_popString(lua_State *L) {
 	auto packet = lua_topacket(L, 1);
 	lua_pop(L, 1);
 
-	lua_pushstring(L, packet->pop<std::string>().c_str());
+	auto value = packet->pop<boost::string_ref>();
+	lua_pushlstring(L, value.data(), value.size());
 
 	return 1;
 }
@@ -899,7 +1001,7 @@ int connection_close(lua_State *L)
 int connection_send(lua_State *L)
 {
 	auto connection = checkNetworkConnection(L);
-	auto packet = std::shared_ptr<Packet>(new Packet((Packet*)lua_touserdata(L, 2)));
+	auto packet = Packet::create((Packet*)lua_touserdata(L, 2));
 	
 	connection->send(packet);
 
@@ -1025,12 +1127,30 @@ int network_restart(lua_State *L)
 	return 0;
 }
 
+int network_poolStatistics(lua_State *L)
+{
+	auto statistics = PacketPool::getStatistics();
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer)statistics.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, (lua_Integer)statistics.misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, (lua_Integer)statistics.remoteReleases);
+	lua_setfield(L, -2, "remoteReleases");
+	lua_pushinteger(L, (lua_Integer)statistics.oversized);
+	lua_setfield(L, -2, "oversized");
+
+	return 1;
+}
+
 const luaL_Reg networkLib[] = {
 	{ "register", network_register },
 	{ "unregister", network_unregister },
 	{ "start", network_start },
 	{ "stop", network_stop },
 	{ "restart", network_restart },
+	{ "poolStatistics", network_poolStatistics },
 	{ NULL, NULL }
 };
 
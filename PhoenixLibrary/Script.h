@@ -4,6 +4,7 @@
 
 #include <lua.hpp>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <string>
 
@@ -26,10 +27,13 @@ public:
 	bool load(const std::string &path, const std::string &scriptId);
 	bool unload(const std::string &scriptId);
 
+	//! Pushes a script's function for call. The caller holds getLock() from here until the call returns
 	bool prepareCall(const std::string &scriptId, const std::string &function);
 	bool call(int nArgs, int nResults = -1); // -1 = LUA_MULTRET
 
 	lua_State* getEnv() { return L; }
+	//! Held by whoever runs the script, as its Lua state is shared by every worker. See lua_statelock
+	std::recursive_mutex& getLock() { return m_lock; }
 
 	phoenix::callback<true, void(lua_State *L)> requestRegisterFunctions;
 
@@ -38,9 +42,13 @@ protected:
 
 private:
 	lua_State *L;
+	std::recursive_mutex m_lock;
 	std::unordered_map<std::string, int> m_envs;
 };
 
+//! Returns the lock of the script L belongs to, shared by all of its Lua threads. Held around every call into Lua,
+//! since a Lua state and its threads can only run on one OS thread at a time
+std::recursive_mutex& lua_statelock(lua_State *L);
 void copyFunction(lua_State *fromState, lua_State *toState);
 int createMetatable(lua_State *L, const char *tableName, const luaL_Reg *functions);
 Packet* lua_topacket(lua_State *L, int index);
@@ -64,6 +64,7 @@ bool ScriptComponent::internalLoad(std::shared_ptr<ComponentManager> manager, st
 			continue;
 		}
 
+		std::lock_guard<std::recursive_mutex> lock(m_scripts->getLock());
 		if (m_scripts->prepareCall(id, "onLoaded") && m_scripts->call(0, 0)) {
 			std::cout << ">> Script " << id << " initialized" << std::endl;
 		}
@@ -0,0 +1,15 @@
+#pragma once
+
+// Helpers for code paths selected at runtime through cpuSupports()
+
+#if (defined __GNUC__ || defined _MSC_VER) && (defined __x86_64__ || defined __i386__ || defined _M_X64 || defined _M_IX86)
+#define PHOENIX_SIMD_X86
+#include <immintrin.h>
+#endif
+
+//! Allows a function to use an instruction set that the rest of the program was not compiled for
+#if defined __GNUC__
+#define PHOENIX_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PHOENIX_TARGET(isa)
+#endif
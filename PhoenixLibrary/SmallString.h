@@ -0,0 +1,103 @@
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+//! Owning string that keeps short values inline, so names and addresses read from packets don't touch the heap
+class SmallString
+{
+public:
+	enum {
+		//! Longest string stored without allocating
+		inlineCapacity = 31
+	};
+
+	SmallString() : m_data(m_inline), m_size(0) {
+		m_inline[0] = '\0';
+	}
+	SmallString(const char *data, size_t size) : m_data(m_inline), m_size(0) {
+		assign(data, size);
+	}
+	SmallString(boost::string_ref value) : m_data(m_inline), m_size(0) {
+		assign(value.data(), value.size());
+	}
+	SmallString(const std::string &value) : m_data(m_inline), m_size(0) {
+		assign(value.data(), value.size());
+	}
+	SmallString(const SmallString &other) : m_data(m_inline), m_size(0) {
+		assign(other.m_data, other.m_size);
+	}
+	SmallString(SmallString &&other) : m_data(m_inline), m_size(0) {
+		*this = std::move(other);
+	}
+	~SmallString() {
+		release();
+	}
+
+	SmallString& operator=(const SmallString &other) {
+		if (this != &other) assign(other.m_data, other.m_size);
+
+		return *this;
+	}
+
+	SmallString& operator=(SmallString &&other) {
+		if (this == &other) return *this;
+
+		if (other.m_data != other.m_inline) {
+			// Steal the heap buffer
+			release();
+			m_data = other.m_data;
+			m_size = other.m_size;
+
+			other.m_data = other.m_inline;
+			other.m_size = 0;
+			other.m_inline[0] = '\0';
+		}
+		else assign(other.m_data, other.m_size);
+
+		return *this;
+	}
+
+	SmallString& assign(const char *data, size_t size) {
+		if (size > inlineCapacity) {
+			char *buffer = new char[size + 1];
+			std::memcpy(buffer, data, size);
+			release();
+			m_data = buffer;
+		}
+		else {
+			std::memmove(m_inline, data, size);
+			release();
+		}
+
+		m_size = size;
+		m_data[size] = '\0';
+
+		return *this;
+	}
+
+	const char* data() const { return m_data; }
+	const char* c_str() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+	operator boost::string_ref() const { return boost::string_ref(m_data, m_size); }
+	std::string str() const { return std::string(m_data, m_size); }
+
+	bool operator==(boost::string_ref other) const { return boost::string_ref(*this) == other; }
+	bool operator!=(boost::string_ref other) const { return boost::string_ref(*this) != other; }
+	bool operator<(const SmallString &other) const { return boost::string_ref(*this) < boost::string_ref(other); }
+
+private:
+	char *m_data;
+	size_t m_size;
+	char m_inline[inlineCapacity + 1];
+
+	void release() {
+		if (m_data != m_inline) delete[] m_data;
+		m_data = m_inline;
+	}
+};
@@ -0,0 +1,192 @@
+#include "TimerWheel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace {
+	//! Deadline of a cancelled timer, which never expires nor gets restarted
+	const std::int64_t cancelledDeadline = std::numeric_limits<std::int64_t>::max();
+}
+
+boost::asio::io_service::id TimerWheel::id;
+
+TimerWheel::Timer::Timer(boost::asio::io_service &ioService)
+	: m_wheel(boost::asio::use_service<TimerWheel>(ioService)), m_deadline(cancelledDeadline), m_linked(false)
+{
+	m_prev = m_next = nullptr;
+	m_slot = 0;
+}
+
+TimerWheel::Timer::~Timer()
+{
+	cancel();
+}
+
+void TimerWheel::Timer::expiresFromNow(std::int64_t msec)
+{
+	m_deadline.store(TimerWheel::now() + msec, std::memory_order_relaxed);
+
+	// An armed timer is simply found with a later deadline by the tick that walks its slot
+	if (m_linked.load(std::memory_order_acquire)) return;
+
+	std::lock_guard<std::mutex> lock(m_wheel.m_lock);
+	if (!m_linked.load(std::memory_order_relaxed)) m_wheel.link(this);
+}
+
+void TimerWheel::Timer::restart()
+{
+	std::lock_guard<std::mutex> lock(m_wheel.m_lock);
+	if (!m_linked.load(std::memory_order_relaxed) && m_deadline.load(std::memory_order_relaxed) != cancelledDeadline)
+		m_wheel.link(this);
+}
+
+void TimerWheel::Timer::cancel()
+{
+	std::lock_guard<std::mutex> lock(m_wheel.m_lock);
+	m_deadline.store(cancelledDeadline, std::memory_order_relaxed);
+	if (m_linked.load(std::memory_order_relaxed)) m_wheel.unlink(this);
+}
+
+bool TimerWheel::Timer::expired() const
+{
+	return m_deadline.load(std::memory_order_relaxed) <= TimerWheel::now();
+}
+
+TimerWheel::TimerWheel(boost::asio::io_service &ioService)
+	: boost::asio::io_service::service(ioService), m_tick(ioService), m_slots(TimerWheel::slotCount, nullptr)
+{
+	m_epoch = now();
+	m_processed = 0;
+	m_timers = 0;
+	m_ticking = m_shutdown = false;
+}
+
+TimerWheel::~TimerWheel()
+{
+}
+
+std::int64_t TimerWheel::now()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::shutdown_service()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_shutdown = true;
+
+	boost::system::error_code ec;
+	m_tick.cancel(ec);
+}
+
+void TimerWheel::shutdown()
+{
+	shutdown_service();
+}
+
+std::uint64_t TimerWheel::tickOf(std::int64_t time) const
+{
+	if (time <= m_epoch) return 0;
+
+	return (std::uint64_t)(time - m_epoch + TimerWheel::tickInterval - 1) / TimerWheel::tickInterval;
+}
+
+void TimerWheel::link(Timer *timer)
+{
+	// Must be called with m_lock held
+	if (!m_ticking) {
+		// Nothing was armed, so the slots skipped since the last tick are all empty
+		m_processed = std::max<std::uint64_t>(m_processed, (now() - m_epoch) / TimerWheel::tickInterval);
+	}
+
+	std::uint64_t tick = std::max(tickOf(timer->m_deadline.load(std::memory_order_relaxed)), m_processed + 1);
+	timer->m_slot = tick % TimerWheel::slotCount;
+	Timer *&head = m_slots[timer->m_slot];
+
+	timer->m_prev = nullptr;
+	timer->m_next = head;
+	if (head) head->m_prev = timer;
+	head = timer;
+	timer->m_linked.store(true, std::memory_order_release);
+
+	++m_timers;
+	if (!m_ticking && !m_shutdown) startTick();
+}
+
+void TimerWheel::unlink(Timer *timer)
+{
+	// Must be called with m_lock held
+	if (timer->m_prev) {
+		timer->m_prev->m_next = timer->m_next;
+	}
+	else {
+		m_slots[timer->m_slot] = timer->m_next;
+	}
+	if (timer->m_next) timer->m_next->m_prev = timer->m_prev;
+
+	timer->m_prev = timer->m_next = nullptr;
+	timer->m_linked.store(false, std::memory_order_release);
+	--m_timers;
+}
+
+void TimerWheel::startTick()
+{
+	m_ticking = true;
+
+	m_tick.expires_from_now(boost::posix_time::millisec((long)TimerWheel::tickInterval));
+	m_tick.async_wait([this](boost::system::error_code error) {
+		handleTick(error);
+	});
+}
+
+void TimerWheel::handleTick(boost::system::error_code error)
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+
+	if (error || m_shutdown) {
+		m_ticking = false;
+		return;
+	}
+
+	// Handlers of the expired timers, run once the wheel is unlocked so they may use timers themselves
+	std::vector<Timer::ExpiredHandler> expired;
+
+	std::int64_t time = now();
+	std::uint64_t current = (time - m_epoch) / TimerWheel::tickInterval;
+
+	// After a stall, one turn of the wheel already visits every slot
+	if (current > m_processed + TimerWheel::slotCount) m_processed = current - TimerWheel::slotCount;
+
+	while (m_processed < current) {
+		++m_processed;
+
+		Timer *timer = m_slots[m_processed % TimerWheel::slotCount];
+		m_slots[m_processed % TimerWheel::slotCount] = nullptr;
+
+		while (timer) {
+			Timer *next = timer->m_next;
+			timer->m_prev = timer->m_next = nullptr;
+			timer->m_linked.store(false, std::memory_order_release);
+			--m_timers;
+
+			if (timer->m_deadline.load(std::memory_order_relaxed) > time) {
+				// Restarted since it was linked here, or due on a later turn
+				link(timer);
+			}
+			else if (timer->m_handler) {
+				// Copied, as the timer may be gone by the time it runs
+				expired.push_back(timer->m_handler);
+			}
+
+			timer = next;
+		}
+	}
+
+	if (m_timers > 0) startTick();
+	else m_ticking = false;
+
+	lock.unlock();
+	for (auto &handler : expired)
+		handler();
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+//! Hashed timer wheel that expires idle timers in bulk, once per tick
+/**
+ * One wheel exists per io_service, so each network shard gets its own. Timers only record a deadline when they are
+ * restarted and are linked into the slot of the tick that covers it. Each tick walks a single slot: timers whose
+ * deadline was pushed back meanwhile are moved to the slot of their new deadline, the others are expired. Deadlines
+ * further away than a whole turn of the wheel simply stay in their slot until a later turn.
+ */
+class TimerWheel
+	: public boost::asio::io_service::service
+{
+public:
+	enum {
+		//! Resolution of the wheel, in milliseconds. Timers expire up to one tick late
+		tickInterval = 500,
+		//! Number of slots in the wheel
+		slotCount = 256
+	};
+
+	//! Timer owned by its user. Its handler is copied when it expires, so what the handler uses must outlive the call
+	class Timer
+	{
+	public:
+		typedef std::function<void()> ExpiredHandler;
+
+		Timer(boost::asio::io_service &ioService);
+		~Timer();
+
+		//! Sets what runs when the timer expires. Called from the wheel's tick, once the wheel is unlocked
+		/**
+		 * The handler may restart or destroy timers, even this one. It may still run right after the timer was cancelled,
+		 * if the tick expired the timer just before; it is meant to post the actual work somewhere that checks for that
+		 */
+		void onExpired(ExpiredHandler handler) { m_handler = handler; }
+
+		//! Moves the deadline to msec from now, arming the timer if needed
+		/**
+		 * Without locking when the timer is already armed. An earlier deadline than the armed one only takes effect once
+		 * the tick reaches the slot of the armed one
+		 */
+		void expiresFromNow(std::int64_t msec);
+		//! Re-arms the timer with its current deadline, e.g. when it was expired right as it was being restarted
+		void restart();
+		void cancel();
+
+		//! Whether the deadline has passed
+		bool expired() const;
+
+	private:
+		friend class TimerWheel;
+
+		TimerWheel &m_wheel;
+		ExpiredHandler m_handler;
+		std::atomic<std::int64_t> m_deadline;
+		//! Linked into a slot. Only changed with the wheel locked
+		std::atomic<bool> m_linked;
+		Timer *m_prev, *m_next;
+		size_t m_slot;
+	};
+
+	static boost::asio::io_service::id id;
+
+	explicit TimerWheel(boost::asio::io_service &ioService);
+	~TimerWheel();
+
+	//! Milliseconds on the monotonic clock used for every deadline
+	static std::int64_t now();
+
+	// Boost.Asio calls one or the other, depending on its version
+	void shutdown_service();
+	void shutdown();
+
+private:
+	boost::asio::deadline_timer m_tick;
+	std::mutex m_lock;
+	//! Head of each slot's list of timers
+	std::vector<Timer*> m_slots;
+	//! Time at which tick 0 ended
+	std::int64_t m_epoch;
+	//! Last tick whose slot was walked
+	std::uint64_t m_processed;
+	size_t m_timers;
+	bool m_ticking;
+	bool m_shutdown;
+
+	std::uint64_t tickOf(std::int64_t time) const;
+
+	void link(Timer *timer);
+	void unlink(Timer *timer);
+	void startTick();
+	void handleTick(boost::system::error_code error);
+};
@@ -1,10 +1,13 @@
 #include "Tools.h"
-#include "Packet.h"
 
 #include <libxml/xmlreader.h>
 #include <cstring>
 #include <sstream>
 
+#if defined _MSC_VER && (defined _M_X64 || defined _M_IX86)
+#include <intrin.h>
+#endif
+
 void XmlDocDeleter::operator()(void *p)
 {
 	xmlFreeDoc((xmlDocPtr)p);
@@ -61,27 +64,32 @@ bool getXmlContent(_xmlNode* node, std::string& output)
 	return true;
 }
 
-uint32_t adlerChecksum(uint8_t* data, size_t length)
+bool cpuSupports(CpuFeature feature)
 {
-	if (length > Packet::maxPacketSize || !length)
-		return 0;
-
-	const uint16_t adler = 65521;
-	uint32_t a = 1, b = 0;
-	while (length > 0)
-	{
-		size_t tmp = length > 5552 ? 5552 : length;
-		length -= tmp;
-		do
-		{
-			a += *data++;
-			b += a;
-		} while (--tmp);
-		a %= adler;
-		b %= adler;
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+	switch (feature) {
+	case CpuFeature::SSE2: return __builtin_cpu_supports("sse2") != 0;
+	case CpuFeature::SSSE3: return __builtin_cpu_supports("ssse3") != 0;
+	case CpuFeature::AVX2: return __builtin_cpu_supports("avx2") != 0;
+	}
+#elif defined _MSC_VER && (defined _M_X64 || defined _M_IX86)
+	int info[4];
+	__cpuid(info, 1);
+	switch (feature) {
+	case CpuFeature::SSE2: return (info[3] & (1 << 26)) != 0;
+	case CpuFeature::SSSE3: return (info[2] & (1 << 9)) != 0;
+	case CpuFeature::AVX2: {
+		// The OS must also save the YMM registers on context switches
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		if (!osxsave || (_xgetbv(0) & 6) != 6) return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
 	}
+	}
+#endif
 
-	return (b << 16) | a;
+	return false;
 }
 
 std::string getLastXMLError()
@@ -15,4 +15,16 @@ std::string getXmlAttribute(_xmlNode* node, const std::string& attribute, const
 bool getXmlAttribute(_xmlNode* node, const std::string& attribute, std::string& output);
 bool getXmlContent(_xmlNode* node, std::string& output);
 uint32_t adlerChecksum(uint8_t* data, size_t length);
+//! Continues an Adler-32 checksum over more data. Start with adler = 1
+uint32_t adlerUpdate(uint32_t adler, const uint8_t* data, size_t length);
 std::string getLastXMLError();
+
+//! Instruction set extensions that may be selected at runtime
+enum class CpuFeature {
+	SSE2,
+	SSSE3,
+	AVX2
+};
+
+//! Returns whether the processor running this program supports a feature
+bool cpuSupports(CpuFeature feature);
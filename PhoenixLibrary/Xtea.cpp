@@ -0,0 +1,334 @@
+#include "Xtea.h"
+#include "Simd.h"
+#include "Tools.h"
+
+#include <cstring>
+#include <vector>
+
+namespace {
+	const uint32_t delta = 0x61C88647;
+	const int rounds = 32;
+
+	//! The sum + key term of every round. It does not depend on the data, so it is shared by all blocks
+	struct RoundKeys
+	{
+		uint32_t first[rounds];
+		uint32_t second[rounds];
+	};
+
+	void encryptionKeys(const std::array<uint32_t, 4> &k, RoundKeys &out)
+	{
+		uint32_t sum = 0;
+		for (int i = 0; i < rounds; ++i) {
+			out.first[i] = sum + k[sum & 3];
+			sum -= delta;
+			out.second[i] = sum + k[(sum >> 11) & 3];
+		}
+	}
+
+	void decryptionKeys(const std::array<uint32_t, 4> &k, RoundKeys &out)
+	{
+		uint32_t sum = 0xC6EF3720;
+		for (int i = 0; i < rounds; ++i) {
+			out.first[i] = sum + k[(sum >> 11) & 3];
+			sum += delta;
+			out.second[i] = sum + k[sum & 3];
+		}
+	}
+
+	typedef void(*kernel_t)(uint8_t *data, size_t blocks, const RoundKeys &keys);
+
+	void encryptScalar(uint8_t *data, size_t blocks, const RoundKeys &keys)
+	{
+		for (; blocks > 0; --blocks, data += 8) {
+			uint32_t v[2];
+			std::memcpy(v, data, 8);
+
+			for (int i = 0; i < rounds; ++i) {
+				v[0] += ((v[1] << 4 ^ v[1] >> 5) + v[1]) ^ keys.first[i];
+				v[1] += ((v[0] << 4 ^ v[0] >> 5) + v[0]) ^ keys.second[i];
+			}
+
+			std::memcpy(data, v, 8);
+		}
+	}
+
+	void decryptScalar(uint8_t *data, size_t blocks, const RoundKeys &keys)
+	{
+		for (; blocks > 0; --blocks, data += 8) {
+			uint32_t v[2];
+			std::memcpy(v, data, 8);
+
+			for (int i = 0; i < rounds; ++i) {
+				v[1] -= ((v[0] << 4 ^ v[0] >> 5) + v[0]) ^ keys.first[i];
+				v[0] -= ((v[1] << 4 ^ v[1] >> 5) + v[1]) ^ keys.second[i];
+			}
+
+			std::memcpy(data, v, 8);
+		}
+	}
+
+#ifdef PHOENIX_SIMD_X86
+	// Blocks are stored as (v0, v1) pairs. These transpose two registers of pairs into one register of v0 and one of v1,
+	// and back. Shuffling with (3, 1, 2, 0) is its own inverse, and every step stays inside a 128 bit lane.
+#define XTEA_SPLIT(prefix, a, b, v0, v1) \
+	a = prefix##_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0)); \
+	b = prefix##_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0)); \
+	v0 = prefix##_unpacklo_epi64(a, b); \
+	v1 = prefix##_unpackhi_epi64(a, b)
+
+#define XTEA_JOIN(prefix, a, b, v0, v1) \
+	a = prefix##_shuffle_epi32(prefix##_unpacklo_epi64(v0, v1), _MM_SHUFFLE(3, 1, 2, 0)); \
+	b = prefix##_shuffle_epi32(prefix##_unpackhi_epi64(v0, v1), _MM_SHUFFLE(3, 1, 2, 0))
+
+	PHOENIX_TARGET("sse2")
+	void encryptSse2(uint8_t *data, size_t blocks, const RoundKeys &keys)
+	{
+		for (; blocks >= 4; blocks -= 4, data += 32) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+			__m128i v0, v1;
+			XTEA_SPLIT(_mm, a, b, v0, v1);
+
+			for (int i = 0; i < rounds; ++i) {
+				__m128i k0 = _mm_set1_epi32((int)keys.first[i]);
+				v0 = _mm_add_epi32(v0, _mm_xor_si128(_mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v1, 4), _mm_srli_epi32(v1, 5)), v1), k0));
+				__m128i k1 = _mm_set1_epi32((int)keys.second[i]);
+				v1 = _mm_add_epi32(v1, _mm_xor_si128(_mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v0, 4), _mm_srli_epi32(v0, 5)), v0), k1));
+			}
+
+			XTEA_JOIN(_mm, a, b, v0, v1);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(data), a);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(data + 16), b);
+		}
+
+		encryptScalar(data, blocks, keys);
+	}
+
+	PHOENIX_TARGET("sse2")
+	void decryptSse2(uint8_t *data, size_t blocks, const RoundKeys &keys)
+	{
+		for (; blocks >= 4; blocks -= 4, data += 32) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+			__m128i v0, v1;
+			XTEA_SPLIT(_mm, a, b, v0, v1);
+
+			for (int i = 0; i < rounds; ++i) {
+				__m128i k0 = _mm_set1_epi32((int)keys.first[i]);
+				v1 = _mm_sub_epi32(v1, _mm_xor_si128(_mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v0, 4), _mm_srli_epi32(v0, 5)), v0), k0));
+				__m128i k1 = _mm_set1_epi32((int)keys.second[i]);
+				v0 = _mm_sub_epi32(v0, _mm_xor_si128(_mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v1, 4), _mm_srli_epi32(v1, 5)), v1), k1));
+			}
+
+			XTEA_JOIN(_mm, a, b, v0, v1);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(data), a);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(data + 16), b);
+		}
+
+		decryptScalar(data, blocks, keys);
+	}
+
+	PHOENIX_TARGET("avx2")
+	void encryptAvx2(uint8_t *data, size_t blocks, const RoundKeys &keys)
+	{
+		// 16 blocks per step, as two independent chains of 8, so the latency of one hides behind the other
+		for (; blocks >= 16; blocks -= 16, data += 128) {
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+			__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 64));
+			__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 96));
+			__m256i v0, v1, w0, w1;
+			XTEA_SPLIT(_mm256, a, b, v0, v1);
+			XTEA_SPLIT(_mm256, c, d, w0, w1);
+
+			for (int i = 0; i < rounds; ++i) {
+				__m256i k0 = _mm256_set1_epi32((int)keys.first[i]);
+				v0 = _mm256_add_epi32(v0, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v1, 4), _mm256_srli_epi32(v1, 5)), v1), k0));
+				w0 = _mm256_add_epi32(w0, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(w1, 4), _mm256_srli_epi32(w1, 5)), w1), k0));
+				__m256i k1 = _mm256_set1_epi32((int)keys.second[i]);
+				v1 = _mm256_add_epi32(v1, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v0, 4), _mm256_srli_epi32(v0, 5)), v0), k1));
+				w1 = _mm256_add_epi32(w1, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(w0, 4), _mm256_srli_epi32(w0, 5)), w0), k1));
+			}
+
+			XTEA_JOIN(_mm256, a, b, v0, v1);
+			XTEA_JOIN(_mm256, c, d, w0, w1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data), a);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 32), b);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 64), c);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 96), d);
+		}
+
+		for (; blocks >= 8; blocks -= 8, data += 64) {
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+			__m256i v0, v1;
+			XTEA_SPLIT(_mm256, a, b, v0, v1);
+
+			for (int i = 0; i < rounds; ++i) {
+				__m256i k0 = _mm256_set1_epi32((int)keys.first[i]);
+				v0 = _mm256_add_epi32(v0, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v1, 4), _mm256_srli_epi32(v1, 5)), v1), k0));
+				__m256i k1 = _mm256_set1_epi32((int)keys.second[i]);
+				v1 = _mm256_add_epi32(v1, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v0, 4), _mm256_srli_epi32(v0, 5)), v0), k1));
+			}
+
+			XTEA_JOIN(_mm256, a, b, v0, v1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data), a);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 32), b);
+		}
+
+		encryptSse2(data, blocks, keys);
+	}
+
+	PHOENIX_TARGET("avx2")
+	void decryptAvx2(uint8_t *data, size_t blocks, const RoundKeys &keys)
+	{
+		for (; blocks >= 16; blocks -= 16, data += 128) {
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+			__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 64));
+			__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 96));
+			__m256i v0, v1, w0, w1;
+			XTEA_SPLIT(_mm256, a, b, v0, v1);
+			XTEA_SPLIT(_mm256, c, d, w0, w1);
+
+			for (int i = 0; i < rounds; ++i) {
+				__m256i k0 = _mm256_set1_epi32((int)keys.first[i]);
+				v1 = _mm256_sub_epi32(v1, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v0, 4), _mm256_srli_epi32(v0, 5)), v0), k0));
+				w1 = _mm256_sub_epi32(w1, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(w0, 4), _mm256_srli_epi32(w0, 5)), w0), k0));
+				__m256i k1 = _mm256_set1_epi32((int)keys.second[i]);
+				v0 = _mm256_sub_epi32(v0, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v1, 4), _mm256_srli_epi32(v1, 5)), v1), k1));
+				w0 = _mm256_sub_epi32(w0, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(w1, 4), _mm256_srli_epi32(w1, 5)), w1), k1));
+			}
+
+			XTEA_JOIN(_mm256, a, b, v0, v1);
+			XTEA_JOIN(_mm256, c, d, w0, w1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data), a);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 32), b);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 64), c);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 96), d);
+		}
+
+		for (; blocks >= 8; blocks -= 8, data += 64) {
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+			__m256i v0, v1;
+			XTEA_SPLIT(_mm256, a, b, v0, v1);
+
+			for (int i = 0; i < rounds; ++i) {
+				__m256i k0 = _mm256_set1_epi32((int)keys.first[i]);
+				v1 = _mm256_sub_epi32(v1, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v0, 4), _mm256_srli_epi32(v0, 5)), v0), k0));
+				__m256i k1 = _mm256_set1_epi32((int)keys.second[i]);
+				v0 = _mm256_sub_epi32(v0, _mm256_xor_si256(_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v1, 4), _mm256_srli_epi32(v1, 5)), v1), k1));
+			}
+
+			XTEA_JOIN(_mm256, a, b, v0, v1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data), a);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(data + 32), b);
+		}
+
+		decryptSse2(data, blocks, keys);
+	}
+#endif
+
+	struct Engine
+	{
+		const char *name;
+		kernel_t encrypt;
+		kernel_t decrypt;
+	};
+
+	//! The engines this processor can run, best first
+	std::vector<Engine> supportedEngines()
+	{
+		std::vector<Engine> engines;
+
+#ifdef PHOENIX_SIMD_X86
+		if (cpuSupports(CpuFeature::AVX2)) {
+			Engine avx2 = { "avx2", encryptAvx2, decryptAvx2 };
+			engines.push_back(avx2);
+		}
+		if (cpuSupports(CpuFeature::SSE2)) {
+			Engine sse2 = { "sse2", encryptSse2, decryptSse2 };
+			engines.push_back(sse2);
+		}
+#endif
+
+		Engine scalar = { "scalar", encryptScalar, decryptScalar };
+		engines.push_back(scalar);
+
+		return engines;
+	}
+
+	Engine& engine()
+	{
+		static Engine selected = supportedEngines().front();
+		return selected;
+	}
+}
+
+void xteaEncrypt(uint8_t *data, size_t length, const std::array<uint32_t, 4> &keys)
+{
+	RoundKeys roundKeys;
+	encryptionKeys(keys, roundKeys);
+
+	engine().encrypt(data, length / 8, roundKeys);
+}
+
+void xteaDecrypt(uint8_t *data, size_t length, const std::array<uint32_t, 4> &keys)
+{
+	RoundKeys roundKeys;
+	decryptionKeys(keys, roundKeys);
+
+	engine().decrypt(data, length / 8, roundKeys);
+}
+
+uint32_t xteaDecryptWithChecksum(uint8_t *data, size_t length, const std::array<uint32_t, 4> &keys)
+{
+	// 32 blocks: a multiple of every kernel's step, and a few cache lines
+	const size_t chunkSize = 256;
+
+	RoundKeys roundKeys;
+	decryptionKeys(keys, roundKeys);
+
+	auto decrypt = engine().decrypt;
+	uint32_t adler = 1;
+
+	while (length > 0) {
+		size_t chunk = length > chunkSize ? chunkSize : length;
+
+		adler = adlerUpdate(adler, data, chunk);
+		decrypt(data, chunk / 8, roundKeys);
+
+		data += chunk;
+		length -= chunk;
+	}
+
+	return adler;
+}
+
+const char* xteaImplementation()
+{
+	return engine().name;
+}
+
+std::vector<std::string> xteaImplementations()
+{
+	std::vector<std::string> names;
+	for (auto &engine : supportedEngines())
+		names.push_back(engine.name);
+
+	return names;
+}
+
+bool xteaUseImplementation(const std::string &name)
+{
+	for (auto &candidate : supportedEngines()) {
+		if (name == candidate.name) {
+			engine() = candidate;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//! Encrypts length bytes in place, as independent 8 byte XTEA blocks. length must be a multiple of 8
+void xteaEncrypt(uint8_t *data, size_t length, const std::array<uint32_t, 4> &keys);
+//! Decrypts length bytes in place, as independent 8 byte XTEA blocks. length must be a multiple of 8
+void xteaDecrypt(uint8_t *data, size_t length, const std::array<uint32_t, 4> &keys);
+
+//! Decrypts like xteaDecrypt, and returns the Adler-32 checksum of the ciphertext
+/**
+ * The buffer is walked once, in chunks small enough to stay in the L1 cache between checksumming and decrypting them
+ */
+uint32_t xteaDecryptWithChecksum(uint8_t *data, size_t length, const std::array<uint32_t, 4> &keys);
+
+//! Returns the name of the XTEA implementation selected for this processor
+const char* xteaImplementation();
+//! Returns the names of the XTEA implementations this processor can run, best first
+std::vector<std::string> xteaImplementations();
+//! Switches to the named implementation, for tests and benchmarks. Not safe while other threads encrypt or decrypt
+bool xteaUseImplementation(const std::string &name);
@@ -8,7 +8,33 @@ pluginsFile = "plugins.xml"
 scriptsFile = "scripts.xml"
 
 -- The number of threads to create. If zero, this value will be set to the number of logical processors
+-- Each connection runs its handlers on its own strand, and scripts take turns on their one Lua state, so any number
+-- of workers may share one io service
 workerCount = 2
+-- If not zero, each worker gets its own network shard: an io service with its own listening sockets and connections.
+-- Connections never leave the worker that accepted them. Services must be safe to use from several workers at once
+networkSharding = 0
+-- Connections per second accepted from a single address, and how many it may open at once. Zero disables the limit.
+-- Disabled by default, since clients behind one NAT share their address. 5 and 20 suit a public server
+admissionAddressRate = 0
+admissionAddressBurst = 0
+-- Connections per second accepted overall, and how many may be opened at once. Zero disables the limit
+admissionGlobalRate = 0
+admissionGlobalBurst = 0
+-- If set, a server started with the same setting takes the listening sockets over from the one already running, which
+-- then stops accepting and exits once its connections are gone. Empty disables it. Not available on Windows
+hotRestartSocket = ""
+-- If not zero, idle connections are handed over to the new server as well, instead of staying with the old one.
+-- What services kept about them is not, e.g. the capabilities registered with the interserver, which must be registered again
+hotRestartConnections = 0
+-- If set, every frame received by connections opened from now on is recorded into this file, to be replayed later.
+-- Frames are recorded before decryption, so a replay needs the same RSA key. Empty disables it
+captureFile = ""
+-- If set, the frames recorded in this file are fed to the services once the server is ready, over in-memory
+-- connections. replayPace is "fast", sending each frame as soon as the service can take it, or "recorded", keeping
+-- the recorded spacing between frames
+replayFile = ""
+replayPace = "fast"
 
 -- The amount of information to be logged. This should be one of these values: 0 - None, 1 - Fatal, 2 - Error, 3 - Warning, 4 - Information, 5 - Debug
 loggerLevel = 5
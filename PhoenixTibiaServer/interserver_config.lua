@@ -5,7 +5,11 @@ dofile('config.lua')
 pluginsFile = "interserver_plugins.xml"
 
 -- The number of threads to create. If zero, this value will be set to the number of logical processors
+-- Each connection runs its handlers on its own strand, so any number of workers may share one io service
 workerCount = 1
+-- If not zero, each worker gets its own network shard: an io service with its own listening sockets and connections.
+-- Connections never leave the worker that accepted them. Services must be safe to use from several workers at once
+networkSharding = 0
 
 -- The file that logging information should be outputted to
 loggerFile = "phoenixserver-interserver-" .. os.date('%Y%m%d%H%M%S') .. ".log"
@@ -1,6 +1,9 @@
 #include "ComponentManager.h"
 #include "Component.h"
+#include "AdmissionControl.h"
 #include "NetworkManager.h"
+#include "PacketCapture.h"
+#include "PacketReplay.h"
 #include "Settings.h"
 
 #include <iostream>
@@ -39,10 +42,30 @@ int main(int argc, char* argv[])
 	}
 	std::cout << std::endl;
 
+	// Give each worker a network shard of its own, instead of having them all share the main io service
+	if (settings->getUnsigned("networkSharding") != 0)
+		network->setShardCount(threadCount);
+
+	AdmissionControl::Limits limits;
+	limits.addressRate = settings->getNumber("admissionAddressRate");
+	limits.addressBurst = settings->getNumber("admissionAddressBurst");
+	limits.globalRate = settings->getNumber("admissionGlobalRate");
+	limits.globalBurst = settings->getNumber("admissionGlobalBurst");
+	network->getAdmissionControl()->setLimits(limits);
+
+	// Chosen when building, with PHOENIX_IO_URING
+	std::cout << "> Network backend: " << NetworkManager::getBackendName() << std::endl;
+
+	network->enableHotRestart(settings->getString("hotRestartSocket"), settings->getUnsigned("hotRestartConnections") != 0);
+
+	std::string captureFile = settings->getString("captureFile");
+	if (!captureFile.empty() && PacketCapture::start(captureFile))
+		std::cout << "> Capturing received packets into " << captureFile << std::endl;
+
 	std::vector<std::thread> threads(threadCount);
 
-	for (auto &thread : threads)
-		thread = std::thread([network]() { network->getIoService().run(); });
+	for (unsigned int i = 0; i < threadCount; ++i)
+		threads[i] = std::thread([network, i]() { network->getIoService(i % network->getShardCount()).run(); });
 
 	manager->OnBeforeNetworkStart();
 
@@ -52,13 +75,37 @@ int main(int argc, char* argv[])
 
 	manager->OnServerReady();
 
+	// Feeds a capture to the services once they are up, alongside whatever the listeners accept
+	std::thread replay;
+	std::string replayFile = settings->getString("replayFile");
+	if (!replayFile.empty()) {
+		auto pace = settings->getString("replayPace") == "recorded" ? PacketReplay::Pace::Recorded : PacketReplay::Pace::Fast;
+
+		replay = std::thread([network, replayFile, pace]() {
+			std::cout << "> Replaying " << replayFile << std::endl;
+
+			PacketReplay replayer(network);
+			if (!replayer.run(replayFile, pace)) return;
+
+			auto &statistics = replayer.getStatistics();
+			std::cout << "> Replayed " << statistics.frames << " frames of " << statistics.connections << " connections in " << statistics.seconds << " seconds";
+			if (statistics.seconds > 0) std::cout << " (" << statistics.frames / statistics.seconds << " frames per second)";
+			if (statistics.skipped > 0) std::cout << ", skipped " << statistics.skipped << " frames for ports no service listens on";
+			std::cout << std::endl;
+		});
+	}
+
 	for (auto &thread : threads)
 		thread.join();
 
+	if (replay.joinable()) replay.join();
+
 	std::cout << "> Terminating" << std::endl;
 
 	manager->OnServerTerminating();
 
+	PacketCapture::stop();
+
 	network.reset();
 
 	manager->unloadComponents();
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <random>
 #include <sstream>
+#include <vector>
 
 #include <openssl/engine.h>
 #include <openssl/hmac.h>
@@ -18,10 +19,28 @@
 extern std::weak_ptr<Settings> g_settings;
 extern LoggerComponent *g_logger;
 
+namespace {
+	//! Releases an HMAC context from encipher, however this OpenSSL allocates it
+	void freeHmac(HMAC_CTX *hmac)
+	{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		HMAC_CTX_cleanup(hmac);
+#else
+		HMAC_CTX_free(hmac);
+#endif
+	}
+}
+
 std::mt19937 g_random(0);
 
-InterserverService::InterserverService()
+InterserverService::InterserverService(std::shared_ptr<Metrics> metrics)
+	: m_metricsRegistry(metrics)
 {
+	m_relayed = &metrics->counter("interserver.relayed");
+	m_relayRequests = &metrics->counter("interserver.requests");
+	m_relayAnswers = &metrics->counter("interserver.answered");
+	m_pendingRelays = &metrics->gauge("interserver.pending_relays");
+
 	// Try to reseed the RNG
 	try {
 		std::random_device rd;
@@ -37,7 +56,7 @@ InterserverService::InterserverService()
 	// Register keepalive handler
 	m_handlers[0] = [](NetworkConnectionPtr c, PacketPtr p) {
 		std::stringstream ss;
-		ss << "Heartbeat received from " << c->socket().remote_endpoint().address().to_string() << ":" << c->socket().remote_endpoint().port();
+		ss << "Heartbeat received from " << c->remoteEndpoint().address().to_string() << ":" << c->remoteEndpoint().port();
 		if (g_logger) g_logger->log(LogLevel::Debug, ss.str());
 
 		return true;
@@ -60,9 +79,10 @@ InterserverService::InterserverService()
 		p->get(capability);
 		capability.connection = c;
 
+		std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 		auto i = m_capabilities.equal_range(capability.name);
 		if (i.first != i.second) {
-			auto remote = c->socket().remote_endpoint();
+			auto remote = c->remoteEndpoint();
 			for (auto iCap = i.first; iCap != i.second; ++iCap) {
 				auto ep = iCap->second.serviceEndpoint;
 				if (ep.port() == capability.serviceEndpoint.port() && ep.address().to_string().compare(capability.serviceEndpoint.address().to_string()) == 0) {
@@ -84,6 +104,7 @@ InterserverService::InterserverService()
 	m_handlers[3] = [this](NetworkConnectionPtr c, PacketPtr p) {
 		auto size = p->pop<uint16_t>();
 
+		std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 		for (uint16_t i = 0; i < size; i++) {
 			Capability capability;
 			p->get(capability);
@@ -99,26 +120,25 @@ InterserverService::InterserverService()
 	m_handlers[4] = [this](NetworkConnectionPtr c, PacketPtr p) {
 		auto capability = p->pop<std::string>();
 
+		std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 		auto i = m_capabilities.equal_range(capability);
-		PacketPtr response(new Packet);
+		PacketPtr response = Packet::create();
 		response->push<uint16_t>(0x0004);
 
 		if (i.first != i.second) {
-			auto len = p->size() - p->pos();
-			uint8_t* b = new uint8_t[len];
-			p->get(len, b);
-			
+			// Serialize the relayed message once and share it with every destination
+			PacketPtr relay = Packet::create();
+			relay->push<uint16_t>(0x0005).copy(p->data() + p->pos(), p->size() - p->pos());
+
+			std::vector<NetworkConnectionPtr> destinations;
 			for (auto connection = i.first; connection != i.second; ++connection) {
-				if (auto con = connection->second.connection.lock()) {
-					PacketPtr sendPacket(new Packet);
-					sendPacket->push<uint16_t>(0x0005).copy(b, len);
-					con->send(sendPacket);
-				}
+				if (auto con = connection->second.connection.lock())
+					destinations.push_back(con);
 			}
+			NetworkConnection::broadcast(relay, destinations);
+			m_relayed->add();
 
 			response->push<bool>(true);
-
-			delete[] b;
 		}
 		else {
 			response->push<bool>(false);
@@ -134,6 +154,7 @@ InterserverService::InterserverService()
 		Capability capability;
 		p->get(capability);
 
+		std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 		m_capabilityNotify.emplace(capability.name, capability);
 
 		return true;
@@ -144,21 +165,24 @@ InterserverService::InterserverService()
 		Capability capability;
 		p->get(capability);
 
+		std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 		auto i = m_capabilities.equal_range(capability.name);
 		for (auto con = i.first; con != i.second; ++con) {
 			auto connection = con->second.connection.lock();
-			if (connection && connection->socket().is_open()) {
+			if (connection && connection->isOpen()) {
 				while (true) {
 					uint32_t requestIndex = g_random();
 
 					if (m_relay.find(requestIndex) != m_relay.end()) continue;
 
 					m_relay.emplace(requestIndex, c);
+					m_relayRequests->add();
+					m_pendingRelays->set((int64_t)m_relay.size());
 
 					auto len = p->size() - p->pos();
 					uint8_t* b = new uint8_t[len];
 					p->get(len, b);
-					PacketPtr out(new Packet);
+					PacketPtr out = Packet::create();
 					out->push<uint16_t>(0x0007).push<uint32_t>(requestIndex).copy(b, len);
 					delete[] b;
 					connection->send(out);
@@ -174,6 +198,7 @@ InterserverService::InterserverService()
 	m_handlers[8] = [this](NetworkConnectionPtr c, PacketPtr p) {
 		uint32_t index = p->pop<uint32_t>();
 
+		std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 		auto requester = m_relay.find(index);
 		if (requester == m_relay.end()) return true;
 
@@ -181,13 +206,15 @@ InterserverService::InterserverService()
 		if (len > 0) {
 			uint8_t* b = new uint8_t[len];
 			p->get(len, b);
-			PacketPtr out(new Packet);
+			PacketPtr out = Packet::create();
 			out->push<uint16_t>(0x0008).copy(b, len);
 			delete[] b;
 			requester->second->send(out);
 		}
 
 		m_relay.erase(requester);
+		m_relayAnswers->add();
+		m_pendingRelays->set((int64_t)m_relay.size());
 
 		return true;
 	};
@@ -228,29 +255,33 @@ bool InterserverService::handleFirst(NetworkConnectionPtr connection, PacketPtr
 	uint16_t protocolVersion = packet->pop<uint16_t>();
 
 	if (protocolVersion < InterserverService::minProtocolVersion || protocolVersion > InterserverService::maxProtocolVersion) {
-		ss << "Interserver: Received invalid protocol version from " << connection->socket().remote_endpoint().address().to_string();
+		ss << "Interserver: Received invalid protocol version from " << connection->remoteEndpoint().address().to_string();
 		if (g_logger) g_logger->log(LogLevel::Information, ss.str());
 
 		return false;
 	}
 
 	// Request authentication
-	std::string receivedUsername = packet->pop<std::string>();
-	std::string receivedPassword = packet->pop<std::string>();
+	auto receivedUsername = packet->pop<boost::string_ref>();
+	auto receivedPassword = packet->pop<boost::string_ref>();
 
 	// Verify data
 	std::string username, password;
 	if (auto settings = g_settings.lock()) {
-		username = encipher(settings->getString("interserver_username"));
-		password = encipher(settings->getString("interserver_password"));
+		if (!encipher(settings->getString("interserver_username"), username) || !encipher(settings->getString("interserver_password"), password)) {
+			ss << "Interserver: Refused connection from " << connection->remoteEndpoint().address().to_string() << ", the credentials can't be enciphered";
+			if (g_logger) g_logger->log(LogLevel::Error, ss.str());
+
+			return false;
+		}
 	}
 
-	if (username.compare(receivedUsername) != 0 || password.compare(receivedPassword) != 0) {
-		ss << "Interserver: Failed connection attempt from " << connection->socket().remote_endpoint().address().to_string();
+	if (receivedUsername != username || receivedPassword != password) {
+		ss << "Interserver: Failed connection attempt from " << connection->remoteEndpoint().address().to_string();
 		if (g_logger) g_logger->log(LogLevel::Warning, ss.str());
 	}
 
-	ss << "InterserverService: Connection success from " << connection->socket().remote_endpoint().address().to_string();
+	ss << "InterserverService: Connection success from " << connection->remoteEndpoint().address().to_string();
 	if (g_logger) g_logger->log(LogLevel::Information, ss.str());
 	std::cout << ">>> " << ss.str() << std::endl;
 
@@ -293,93 +324,97 @@ void InterserverService::removeHandler(uint16_t code)
 
 void InterserverService::removeConnection(NetworkConnectionPtr connection)
 {
-	auto remote = connection->socket().remote_endpoint();
-	for (auto i = m_capabilities.begin(); i != m_capabilities.end(); ++i) {
-		if (auto con = i->second.connection.lock()) {
-			auto ep = con->socket().remote_endpoint();
-			if (ep.port() == remote.port() && ep.address().to_string().compare(remote.address().to_string()) == 0) {
-				m_capabilities.erase(i);
-				i = m_capabilities.begin();
-			}
-		}
-		else {
-			m_capabilities.erase(i);
-			i = m_capabilities.begin();
-		}
+	// Compared by identity, as a connection released to another process no longer has an endpoint
+	std::unique_lock<std::recursive_mutex> lock(m_registryLock);
+	for (auto i = m_capabilities.begin(); i != m_capabilities.end();) {
+		auto con = i->second.connection.lock();
+		if (!con || con == connection) i = m_capabilities.erase(i);
+		else ++i;
 	}
+	lock.unlock();
 
-	std::cout << ">>> InterserverService: Connection closed from " << connection->socket().remote_endpoint().address().to_string() << std::endl;
+	std::cout << ">>> InterserverService: Connection closed from " << connection->remoteEndpoint().address().to_string() << std::endl;
 }
 
-std::string InterserverService::encipher(const std::string &what)
+bool InterserverService::encipher(const std::string &what, std::string &enciphered)
 {
 	std::string key, algo;
 	if (auto settings = g_settings.lock()) {
 		key = settings->getString("interserver_key");
 		algo = settings->getString("interserver_algorithm");
 	}
-	else return what;
+	else return false;
 
-	unsigned char *digest = new unsigned char[EVP_MAX_MD_SIZE];
+	unsigned char digest[EVP_MAX_MD_SIZE];
 	unsigned int len = EVP_MAX_MD_SIZE;
 
-	HMAC_CTX hmac;
-	HMAC_CTX_init(&hmac);
+	// OpenSSL 1.1 made HMAC_CTX opaque, so it can only be allocated by the library
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	HMAC_CTX context;
+	HMAC_CTX_init(&context);
+	HMAC_CTX *hmac = &context;
+#else
+	HMAC_CTX *hmac = HMAC_CTX_new();
+#endif
 #pragma region HMAC initializers
 #ifndef OPENSSL_NO_SHA
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 	if (algo.compare("sha") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha(), NULL);
-	else if (algo.compare("sha1") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha1(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha(), NULL);
+	else
+#endif
+	if (algo.compare("sha1") == 0)
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha1(), NULL);
 #else
 	if (false) {}
 #endif
 #ifndef OPENSSL_NO_SHA256
 	else if (algo.compare("sha-224") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha224(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha224(), NULL);
 	else if (algo.compare("sha-256") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha256(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha256(), NULL);
 #endif
 #ifndef OPENSSL_NO_SHA512
 	else if (algo.compare("sha-384") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha384(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha384(), NULL);
 	else if (algo.compare("sha-512") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha512(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha512(), NULL);
 #endif
 #ifndef OPENSSL_NO_WHIRLPOOL
 	else if (algo.compare("whirlpool") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_whirlpool(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_whirlpool(), NULL);
 #endif
 #ifndef OPENSSL_NO_MD4
 	else if (algo.compare("md4") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_md4(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_md4(), NULL);
 #endif
 #ifndef OPENSSL_NO_MD5
 	else if (algo.compare("md5") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_md5(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_md5(), NULL);
 #endif
 #ifndef OPENSSL_NO_RIPEMD
 	else if (algo.compare("ripemd160") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_ripemd160(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_ripemd160(), NULL);
 #endif
 	else {
-		HMAC_CTX_cleanup(&hmac);
-		std::cout << "InterserverService::encipher: invalid algorithm! using plaintext!" << std::endl;
-		return what;
+		// Never falls back to plaintext, which would send the credentials in the clear
+		freeHmac(hmac);
+		std::cout << "InterserverService::encipher: interserver_algorithm \"" << algo << "\" is not supported by this OpenSSL" << std::endl;
+		return false;
 	}
 #pragma endregion
-	HMAC_Update(&hmac, (const unsigned char*)what.c_str(), what.length());
-	HMAC_Final(&hmac, digest, &len);
-	HMAC_CTX_cleanup(&hmac);
+	HMAC_Update(hmac, (const unsigned char*)what.c_str(), what.length());
+	HMAC_Final(hmac, digest, &len);
+	freeHmac(hmac);
 
 	char *buffer = new char[len * sizeof (char)* 2 + 1];
 	
 	for (unsigned int i = 0; i < len; i++)
 		sprintf(buffer + i, "%02x", digest[i]);
 
-	std::string digeststr(buffer);
+	enciphered = buffer;
 	delete[] buffer;
-	return digeststr;
+	return true;
 }
 
 void InterserverService::registerCapability(const Capability &capability)
@@ -388,6 +423,7 @@ void InterserverService::registerCapability(const Capability &capability)
 	ss << "Adding capability " << capability.name << " to " << capability.serviceEndpoint.address().to_string() << ":" << capability.serviceEndpoint.port();
 	if (g_logger) g_logger->log(LogLevel::Information, ss.str());
 
+	std::lock_guard<std::recursive_mutex> lock(m_registryLock);
 	auto i = this->m_capabilities.equal_range(capability.name);
 	if (i.first == i.second) {
 		m_capabilities.emplace(capability.name, capability);
@@ -415,11 +451,15 @@ void InterserverService::registerCapability(const Capability &capability)
 	
 	// Notify that a capability was registered
 	i = m_capabilityNotify.equal_range(capability.name);
+	std::vector<NetworkConnectionPtr> subscribers;
 	for (auto iCap = i.first; iCap != i.second; ++iCap) {
-		if (auto connection = iCap->second.connection.lock()) {
-			PacketPtr packet(new Packet);
-			packet->push<uint8_t>(5).push<bool>(true).push<PacketSerializable>(capability);
-			connection->send(packet);
-		}
+		if (auto connection = iCap->second.connection.lock())
+			subscribers.push_back(connection);
+	}
+
+	if (!subscribers.empty()) {
+		PacketPtr packet = Packet::create();
+		packet->push<uint8_t>(5).push<bool>(true).push<PacketSerializable>(capability);
+		NetworkConnection::broadcast(packet, subscribers);
 	}
 }
@@ -4,6 +4,7 @@
 
 #include <cstdint>
 #include <map>
+#include <mutex>
 #include <functional>
 
 class InterserverService
@@ -12,7 +13,8 @@ class InterserverService
 public:
 	typedef std::function<bool(NetworkConnectionPtr, PacketPtr)> PacketHandler;
 
-	InterserverService();
+	//! Records relay traffic in metrics, as interserver.relayed, .requests, .answered and .pending_relays
+	InterserverService(std::shared_ptr<Metrics> metrics);
 	virtual ~InterserverService();
 
 	virtual std::string getName() const { return "interserver"; }
@@ -20,6 +22,8 @@ public:
 	virtual std::string getBindAddress();
 	virtual unsigned short getBindPort();
 
+	virtual std::vector<uint8_t> getProtocolIds() { return std::vector<uint8_t>(1, 0xF1); }
+
 	virtual bool canHandle(NetworkConnectionPtr connection, PacketPtr packet);
 	virtual bool handleFirst(NetworkConnectionPtr connection, PacketPtr packet);
 	virtual bool handle(NetworkConnectionPtr connection, PacketPtr packet);
@@ -39,8 +43,18 @@ private:
 	std::multimap<std::string, Capability> m_capabilities;
 	std::multimap<std::string, Capability> m_capabilityNotify;
 	std::map<uint32_t, NetworkConnectionPtr> m_relay;
-
-	std::string encipher(const std::string &what);
+	//! Guards the capability and relay registries, as the handlers of several connections may run at once
+	std::recursive_mutex m_registryLock;
+
+	//! Kept alive for the metrics below
+	std::shared_ptr<Metrics> m_metricsRegistry;
+	//! Messages relayed to a capability, relay requests forwarded, and answers routed back to their requester
+	Metrics::Counter *m_relayed, *m_relayRequests, *m_relayAnswers;
+	//! Relay requests still waiting for their answer
+	Metrics::Gauge *m_pendingRelays;
+
+	//! HMACs what with the interserver key. Fails on an algorithm this OpenSSL lacks, instead of leaving it in plaintext
+	bool encipher(const std::string &what, std::string &enciphered);
 	void registerCapability(const Capability &capability);
 };
 
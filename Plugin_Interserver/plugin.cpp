@@ -31,7 +31,7 @@ PLUGIN_ONLOADING
 		if (component)
 			g_logger = component->asLogger();
 
-		g_service.reset(new InterserverService);
+		g_service.reset(new InterserverService(manager->getMetrics()));
 
 		// Even if network ready callback is called only once, we unregister it later to save a bit of memory, in case of the plugin is unloaded/reloaded
 		g_beforeNetworkStart = manager->OnBeforeNetworkStart.push([]() {
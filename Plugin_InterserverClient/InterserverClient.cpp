@@ -15,6 +15,18 @@ extern std::weak_ptr<Settings> g_settings;
 extern std::weak_ptr<Script> g_script;
 extern std::shared_ptr<InterserverClient> g_client;
 
+namespace {
+	//! Releases an HMAC context from encipher, however this OpenSSL allocates it
+	void freeHmac(HMAC_CTX *hmac)
+	{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		HMAC_CTX_cleanup(hmac);
+#else
+		HMAC_CTX_free(hmac);
+#endif
+	}
+}
+
 using boost::asio::ip::tcp;
 
 Capability lua_tocapability(lua_State *L, int index)
@@ -100,6 +112,7 @@ int interserverclient_requestNotify(lua_State *L)
 	createInterserverclientTable(L, "notify", cap.name.c_str());
 	
 	auto notifyCallback = [L, cap](bool status) {
+		std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 		getFunction(L, 1, "notify", cap.name.c_str());
 		lua_pushboolean(L, status);
 
@@ -122,9 +135,12 @@ int interserverclient_requestPacketSerializable(lua_State *L)
 	createInterserverclientTable(L, "request", className.c_str());
 
 	auto callback = [L, className](PacketPtr packet) {
+		std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 		getFunction(L, 1, "request", className.c_str());
 
-		lua_pushpacket(L, packet.get());
+		// No packet when the request failed
+		if (packet) lua_pushpacket(L, packet.get());
+		else lua_pushnil(L);
 
 		lua_pcall(L, 1, 0, 0);
 	};
@@ -141,6 +157,7 @@ int interserverclient_registerPacketSerializableHandler(lua_State *L)
 	createInterserverclientTable(L, "handler", className.c_str());
 
 	auto callback = [L, className](PacketPtr inpacket, PacketPtr outpacket) {
+		std::lock_guard<std::recursive_mutex> lock(lua_statelock(L));
 		getFunction(L, 1, "handler", className.c_str());
 
 		lua_pushpacket(L, inpacket.get());
@@ -191,6 +208,7 @@ InterserverClient::~InterserverClient()
 void InterserverClient::initialize()
 {
 	if (auto script = g_script.lock()) {
+		std::lock_guard<std::recursive_mutex> lock(script->getLock());
 		luaL_requiref(script->getEnv(), "interserverclient", interserverclient_registerLib, 1);
 		lua_pop(script->getEnv(), 1);
 	}
@@ -200,11 +218,11 @@ void InterserverClient::startConnect()
 {
 	// Connection closed, reschedule reconnection in 5 seconds
 	m_keepalive.expires_from_now(boost::posix_time::seconds(5));
-	m_keepalive.async_wait([this](boost::system::error_code ec) {
+	m_keepalive.async_wait(strand().wrap([this](boost::system::error_code ec) {
 		if (!ec) {
 			this->connect();
 		}
-	});
+	}));
 }
 
 void InterserverClient::connect()
@@ -213,14 +231,20 @@ void InterserverClient::connect()
 	boost::system::error_code ec;
 	if (auto settings = g_settings.lock()) {
 		auto iEndpoint = resolver.resolve({ settings->getString("interserver_address"), settings->getString("interserver_port") }, ec);
-		std::string username = encipher(settings->getString("interserver_username")), password = encipher(settings->getString("interserver_password"));
+		std::string username, password;
+		if (!encipher(settings->getString("interserver_username"), username) || !encipher(settings->getString("interserver_password"), password)) {
+			// A setting to fix, retrying would not help
+			ConnectionFailed();
+			std::cout << "InterserverClient::connect: not logging in, the credentials can't be enciphered" << std::endl;
+			return;
+		}
 
 		if (!ec) {
-			boost::asio::async_connect(socket(), iEndpoint, [this, username, password](boost::system::error_code ec, tcp::resolver::iterator i) {
+			boost::asio::async_connect(socket(), iEndpoint, strand().wrap([this, username, password](boost::system::error_code ec, tcp::resolver::iterator i) {
 				if (!ec) {
 					ConnectionSuccess();
 
-					PacketPtr packet(new Packet);
+					PacketPtr packet = Packet::create();
 
 					packet->push<uint8_t>(0xF1)
 						.push<uint16_t>(protocolVersion)
@@ -243,7 +267,7 @@ void InterserverClient::connect()
 					std::cout << "InterserverClient::async_connect error: " << ec.message() << std::endl;
 					startConnect();
 				}
-			});
+			}));
 		}
 		else {
 			ConnectionFailed();
@@ -259,10 +283,28 @@ void InterserverClient::close()
 	m_keepalive.expires_from_now(boost::posix_time::seconds(0));
 
 	NetworkConnection::close();
+
+	// Replies can't come through a closed connection
+	cancelRelays();
+}
+
+void InterserverClient::cancelRelays()
+{
+	std::map<uint32_t, Relay> relays;
+	{
+		std::lock_guard<std::mutex> lock(m_stateLock);
+		relays.swap(m_relays);
+	}
+
+	for (auto &relay : relays) {
+		if (relay.second.timer) relay.second.timer->cancel();
+		relay.second.callback(PacketPtr());
+	}
 }
 
 void InterserverClient::addCapability(const Capability &capability)
 {
+	std::lock_guard<std::mutex> lock(m_stateLock);
 	auto iCapability = m_capabilities.find(capability);
 	if (iCapability != m_capabilities.end()) iCapability->second++;
 	else {
@@ -270,7 +312,7 @@ void InterserverClient::addCapability(const Capability &capability)
 
 		// If connected, send to the server that we now accept a new capability
 		if (socket().is_open()) {
-			PacketPtr packet(new Packet);
+			PacketPtr packet = Packet::create();
 
 			packet->push<uint16_t>(0x0001).push<PacketSerializable>(capability);
 
@@ -281,6 +323,7 @@ void InterserverClient::addCapability(const Capability &capability)
 
 void InterserverClient::removeCapability(const Capability &capability)
 {
+	std::lock_guard<std::mutex> lock(m_stateLock);
 	auto iCapability = m_capabilities.find(capability);
 
 	if (iCapability != m_capabilities.end()) {
@@ -289,7 +332,7 @@ void InterserverClient::removeCapability(const Capability &capability)
 
 			// If connected, send to the server that we do not accept anymore a capability
 			if (socket().is_open()) {
-				PacketPtr packet(new Packet);
+				PacketPtr packet = Packet::create();
 
 				packet->push<uint16_t>(0x0002).push<PacketSerializable>(capability);
 
@@ -301,39 +344,70 @@ void InterserverClient::removeCapability(const Capability &capability)
 
 void InterserverClient::requestNotify(const Capability &capability, notification_t::function_type &&callback)
 {
-	PacketPtr packet(new Packet);
+	PacketPtr packet = Packet::create();
 	packet->push<uint16_t>(0x0005).push<PacketSerializable>(capability);
 	send(packet);
 
+	std::lock_guard<std::mutex> lock(m_stateLock);
 	m_notifications[capability].push(callback);
 }
 
-void InterserverClient::requestPacketSerializable(const Capability &capability, const std::string &className, const PacketSerializable& data, requestpacket_t callback)
+void InterserverClient::requestPacketSerializable(const Capability &capability, const std::string &className, const PacketSerializable& data, requestpacket_t callback, unsigned int timeout)
 {
 	static uint32_t id = 0;
 
-	PacketPtr packet(new Packet);
+	Relay relay;
+	relay.callback = callback;
+	if (timeout > 0) relay.timer = std::make_shared<boost::asio::deadline_timer>(m_keepalive.get_io_service());
+
+	uint32_t requestId;
+	{
+		std::lock_guard<std::mutex> lock(m_stateLock);
+		requestId = ++id;
+		m_relays[requestId] = relay;
+	}
+
+	if (relay.timer) {
+		relay.timer->expires_from_now(boost::posix_time::millisec((long)timeout));
+		relay.timer->async_wait(strand().wrap([this, requestId](boost::system::error_code ec) {
+			if (ec) return;
+
+			std::unique_lock<std::mutex> lock(m_stateLock);
+			auto iRelay = m_relays.find(requestId);
+			if (iRelay == m_relays.end())
+				return;
+
+			// The reply is ignored if it comes after all
+			auto callback = iRelay->second.callback;
+			m_relays.erase(iRelay);
+			lock.unlock();
+
+			callback(PacketPtr());
+		}));
+	}
+
+	PacketPtr packet = Packet::create();
 	packet->push<uint16_t>(0x0007)
 		.push<PacketSerializable>(capability)
 		.push<uint8_t>((uint8_t)RelayOperation::RequestPacketSerializable)
-		.push<uint32_t>(++id)
+		.push<uint32_t>(requestId)
 		.push(className)
 		.push<PacketSerializable>(data);
 
-	m_relays[id] = callback;
-
 	send(packet);
 }
 
 void InterserverClient::registerPacketSerializableHandler(const std::string& className, requestpackethandler_t handler)
 {
+	std::lock_guard<std::mutex> lock(m_stateLock);
 	m_handlers[className] = handler;
 }
 
 void InterserverClient::sendCapabilityList()
 {
+	std::lock_guard<std::mutex> lock(m_stateLock);
 	if (!m_capabilities.empty()) {
-		PacketPtr packet(new Packet);
+		PacketPtr packet = Packet::create();
 
 		packet->push<uint16_t>(0x0003).push<uint16_t>(m_capabilities.size());
 
@@ -348,11 +422,11 @@ void InterserverClient::sendCapabilityList()
 void InterserverClient::keepalive()
 {
 	m_keepalive.expires_from_now(boost::posix_time::seconds(4));
-	m_keepalive.async_wait([this](boost::system::error_code ec) {
+	m_keepalive.async_wait(strand().wrap([this](boost::system::error_code ec) {
 		if (!ec) {
 			setTimeout(NetworkConnection::readTimeout);
 
-			PacketPtr packet(new Packet);
+			PacketPtr packet = Packet::create();
 			
 			packet->push<uint16_t>(0x0000);
 
@@ -366,15 +440,15 @@ void InterserverClient::keepalive()
 			});
 		}
 		else this->keepalive();
-	});
+	}));
 }
 
 void InterserverClient::receive()
 {
 	beginReading([this](PacketPtr packet, boost::system::error_code e) {
 		if (!e) {
-			uint32_t checksum = packet->pop<uint32_t>();
-			if (this->getLastChecksum() != checksum)
+			packet->skip(4);
+			if (!packet->validChecksum())
 				return;
 
 			uint16_t handle = packet->pop<uint16_t>();
@@ -386,10 +460,16 @@ void InterserverClient::receive()
 				packet->get(cap);
 				bool state = packet->pop<bool>();
 
-				auto range = m_notifications.equal_range(cap);
-				for (auto cb = range.first; cb != range.second; ++cb) {
-					cb->second(state);
-				}
+				std::unique_lock<std::mutex> lock(m_stateLock);
+				auto notification = m_notifications.find(cap);
+				if (notification == m_notifications.end())
+					break;
+
+				// Callbacks may register new requests, so they run without the lock held
+				auto callbacks = notification->second;
+				lock.unlock();
+
+				callbacks(state);
 
 				break;
 			}
@@ -402,19 +482,22 @@ void InterserverClient::receive()
 					uint32_t clientId = packet->pop<uint32_t>();
 					std::string className = packet->pop<std::string>();
 
-					auto handler = m_handlers.find(className);
-					if (handler == m_handlers.end())
+					std::unique_lock<std::mutex> lock(m_stateLock);
+					auto iHandler = m_handlers.find(className);
+					if (iHandler == m_handlers.end())
 						break;
 
-					PacketPtr outPacket(new Packet);
+					auto handler = iHandler->second;
+					m_handlers.erase(iHandler);
+					lock.unlock();
+
+					PacketPtr outPacket = Packet::create();
 					outPacket->push<uint16_t>(0x0008)
 						.push<uint32_t>(serverId)
 						.push<uint8_t>((uint8_t)RelayOperation::RequestPacketSerializable)
 						.push<uint32_t>(clientId);
-					handler->second(packet, outPacket);
+					handler(packet, outPacket);
 					send(outPacket);
-
-					m_handlers.erase(handler);
 				}
 				}
 
@@ -427,12 +510,18 @@ void InterserverClient::receive()
 				case RelayOperation::RequestPacketSerializable: {
 					uint32_t clientId = packet->pop<uint32_t>();
 
-					auto relay = m_relays.find(clientId);
-					if (relay != m_relays.end())
-						relay->second(packet);
-					break;
+					std::unique_lock<std::mutex> lock(m_stateLock);
+					auto iRelay = m_relays.find(clientId);
+					if (iRelay == m_relays.end())
+						break;
 
-					m_relays.erase(relay);
+					auto relay = iRelay->second;
+					m_relays.erase(iRelay);
+					lock.unlock();
+
+					if (relay.timer) relay.timer->cancel();
+					relay.callback(packet);
+					break;
 				}
 				}
 			}
@@ -446,73 +535,83 @@ void InterserverClient::receive()
 	});
 }
   
-std::string InterserverClient::encipher(const std::string &what)
+bool InterserverClient::encipher(const std::string &what, std::string &enciphered)
 {
 	std::string key, algo;
 	if (auto settings = g_settings.lock()) {
 		key = settings->getString("interserver_key");
 		algo = settings->getString("interserver_algorithm");
 	}
-	else return what;
+	else return false;
 
-	unsigned char *digest = new unsigned char[EVP_MAX_MD_SIZE];
+	unsigned char digest[EVP_MAX_MD_SIZE];
 	unsigned int len = EVP_MAX_MD_SIZE;
 
-	HMAC_CTX hmac;
-	HMAC_CTX_init(&hmac);
+	// OpenSSL 1.1 made HMAC_CTX opaque, so it can only be allocated by the library
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	HMAC_CTX context;
+	HMAC_CTX_init(&context);
+	HMAC_CTX *hmac = &context;
+#else
+	HMAC_CTX *hmac = HMAC_CTX_new();
+#endif
 #pragma region HMAC initializers
 #ifndef OPENSSL_NO_SHA
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 	if (algo.compare("sha") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha(), NULL);
-	else if (algo.compare("sha1") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha1(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha(), NULL);
+	else
+#endif
+	if (algo.compare("sha1") == 0)
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha1(), NULL);
 #else
 	if (false) {}
 #endif
 #ifndef OPENSSL_NO_SHA256
 	else if (algo.compare("sha-224") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha224(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha224(), NULL);
 	else if (algo.compare("sha-256") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha256(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha256(), NULL);
 #endif
 #ifndef OPENSSL_NO_SHA512
 	else if (algo.compare("sha-384") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha384(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha384(), NULL);
 	else if (algo.compare("sha-512") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_sha512(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_sha512(), NULL);
 #endif
 #ifndef OPENSSL_NO_WHIRLPOOL
 	else if (algo.compare("whirlpool") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_whirlpool(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_whirlpool(), NULL);
 #endif
 #ifndef OPENSSL_NO_MD4
 	else if (algo.compare("md4") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_md4(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_md4(), NULL);
 #endif
 #ifndef OPENSSL_NO_MD5
 	else if (algo.compare("md5") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_md5(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_md5(), NULL);
 #endif
 #ifndef OPENSSL_NO_RIPEMD
 	else if (algo.compare("ripemd160") == 0)
-		HMAC_Init_ex(&hmac, key.c_str(), key.length(), EVP_ripemd160(), NULL);
+		HMAC_Init_ex(hmac, key.c_str(), key.length(), EVP_ripemd160(), NULL);
 #endif
 	else {
-		HMAC_CTX_cleanup(&hmac);
-		std::cout << "InterserverClient::encipher: invalid algorithm! using plaintext!" << std::endl;
-		return what;
+		// Never falls back to plaintext, which would send the credentials in the clear
+		freeHmac(hmac);
+		std::cout << "InterserverClient::encipher: interserver_algorithm \"" << algo << "\" is not supported by this OpenSSL" << std::endl;
+		return false;
 	}
 #pragma endregion
-	HMAC_Update(&hmac, (const unsigned char*)what.c_str(), what.length());
-	HMAC_Final(&hmac, digest, &len);
-	HMAC_CTX_cleanup(&hmac);
+	HMAC_Update(hmac, (const unsigned char*)what.c_str(), what.length());
+	HMAC_Final(hmac, digest, &len);
+	freeHmac(hmac);
 
 	char *buffer = new char[len * sizeof (char)* 2 + 1];
 
 	for (unsigned int i = 0; i < len; i++)
 		sprintf(buffer + i, "%02x", digest[i]);
 
-	std::string digeststr(buffer);
+	enciphered = buffer;
 	delete[] buffer;
-	return digeststr;
+	return true;
 }
@@ -4,8 +4,10 @@
 #include "Callback.h"
 #include "NetworkDefinitions.h"
 #include "NetworkConnection.h"
+#include "Coroutine.h"
 
 #include <map>
+#include <mutex>
 #include <string>
 
 #if defined _WIN32 || defined _WIN64
@@ -42,26 +44,86 @@ public:
 
 	void requestNotify(const Capability &capability, notification_t::function_type &&callback);
 
-	void requestPacketSerializable(const Capability &capability, const std::string& className, const PacketSerializable& data, requestpacket_t callback);
+	//! Asks the server holding capability for a className. The reply is passed to callback
+	/**
+	 * Callback gets a null packet instead if no reply came within timeout milliseconds, or if the connection to the
+	 * interserver was lost meanwhile. A timeout of zero waits for as long as the connection lasts
+	 */
+	void requestPacketSerializable(const Capability &capability, const std::string& className, const PacketSerializable& data, requestpacket_t callback, unsigned int timeout = 0);
 	void registerPacketSerializableHandler(const std::string& className, requestpackethandler_t handler);
 
 	enum {
-		protocolVersion = 0x0001
+		protocolVersion = 0x0001,
+		//! Milliseconds a request waits for its reply, by default, before giving up
+		requestTimeout = 5000
 	};
 
+#ifdef PHOENIX_COROUTINES
+	//! Awaitable version of requestPacketSerializable, resuming with the reply or with a null packet
+	/**
+	 * Holds on to capability, className and data until it is awaited, so it must be awaited right away. Resumes on the
+	 * client's strand
+	 */
+	class RequestAwaitable
+	{
+	public:
+		RequestAwaitable(InterserverClient &client, const Capability &capability, const std::string &className, const PacketSerializable &data, unsigned int timeout)
+			: m_client(client), m_capability(capability), m_className(className), m_data(data), m_timeout(timeout) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			PacketPtr *result = &m_reply;
+			m_client.requestPacketSerializable(m_capability, m_className, m_data, [result, handle](PacketPtr packet) {
+				*result = packet;
+				handle.resume();
+			}, m_timeout);
+		}
+
+		PacketPtr await_resume() { return std::move(m_reply); }
+
+	private:
+		InterserverClient &m_client;
+		const Capability &m_capability;
+		const std::string &m_className;
+		const PacketSerializable &m_data;
+		unsigned int m_timeout;
+		PacketPtr m_reply;
+	};
+
+	RequestAwaitable request(const Capability &capability, const std::string &className, const PacketSerializable &data, unsigned int timeout = requestTimeout)
+	{
+		return RequestAwaitable(*this, capability, className, data, timeout);
+	}
+#endif
+
 private:
-	std::string encipher(const std::string &what);
+	//! HMACs what with the interserver key. Fails on an algorithm this OpenSSL lacks, instead of leaving it in plaintext
+	bool encipher(const std::string &what, std::string &enciphered);
 
 	void sendCapabilityList();
 
 	void keepalive();
 	void receive();
+	//! Fails every request still waiting for its reply
+	void cancelRelays();
 
 	std::map<Capability, notification_t> m_notifications;
 	std::map<Capability, uint32_t> m_capabilities;
 	boost::asio::deadline_timer m_keepalive;
-	std::map<uint32_t, requestpacket_t> m_relays;
+	struct Relay
+	{
+		requestpacket_t callback;
+		//! Set for requests with a timeout
+		std::shared_ptr<boost::asio::deadline_timer> timer;
+	};
+
+	//! Requests waiting for their reply, by id
+	std::map<uint32_t, Relay> m_relays;
 	std::map<std::string, requestpackethandler_t> m_handlers;
+	//! Guards the registries above, which are filled from scripts while the connection's strand reads them
+	std::mutex m_stateLock;
 
 	enum class RelayOperation : uint8_t {
 		RequestPacketSerializable = 1
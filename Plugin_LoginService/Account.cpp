@@ -13,14 +13,12 @@ Account::~Account()
 
 void Account::read(Packet &packet)
 {
-	m_success = packet.pop<uint8_t>() != 0;
-	m_username = packet.pop<std::string>();
-	m_password = packet.pop<std::string>();
+	Schema::read(packet, *this);
 }
 
 void Account::write(Packet &packet) const
 {
-	packet.push<uint8_t>(m_success ? 1 : 0).push(m_username).push(m_password);
+	Schema::write(packet, *this);
 }
 
 const std::string& Account::username() const
@@ -28,9 +26,9 @@ const std::string& Account::username() const
 	return m_username;
 }
 
-void Account::username(const std::string &name)
+void Account::username(boost::string_ref name)
 {
-	m_username = name;
+	m_username.assign(name.data(), name.size());
 }
 
 const std::string& Account::password() const
@@ -38,9 +36,9 @@ const std::string& Account::password() const
 	return m_password;
 }
 
-void Account::password(const std::string &name)
+void Account::password(boost::string_ref name)
 {
-	m_password = name;
+	m_password.assign(name.data(), name.size());
 }
 
 bool Account::success() const
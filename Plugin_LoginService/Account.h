@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Packet.h"
+#include "PacketSchema.h"
 
 #include <string>
 #include <list>
@@ -18,10 +19,10 @@ public:
 	virtual void write(Packet &packet) const;
 
 	const std::string& username() const;
-	void username(const std::string &name);
+	void username(boost::string_ref name);
 		
 	const std::string& password() const;
-	void password(const std::string &name);
+	void password(boost::string_ref name);
 
 	bool success() const;
 
@@ -29,5 +30,10 @@ private:
 	std::string m_username;
 	std::string m_password;
 	bool m_success;
+
+	typedef PacketSchema<Account,
+		Field<Account, bool, &Account::m_success>,
+		Field<Account, std::string, &Account::m_username>,
+		Field<Account, std::string, &Account::m_password>> Schema;
 };
 
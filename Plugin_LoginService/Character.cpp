@@ -3,6 +3,30 @@
 
 extern std::map<uint32_t, std::shared_ptr<World>> g_worlds;
 
+//! Worlds go on the wire as their id, and are looked up in g_worlds when read
+template <>
+struct FieldCodec<std::shared_ptr<World>>
+{
+	enum { minSize = sizeof(uint32_t) };
+
+	static size_t maxSize(const std::shared_ptr<World> &) { return sizeof(uint32_t); }
+
+	static uint8_t* write(uint8_t *out, const std::shared_ptr<World> &value) {
+		return FieldCodec<uint32_t>::write(out, value ? value->id() : 0);
+	}
+
+	static const uint8_t* read(const uint8_t *in, const uint8_t *end, std::shared_ptr<World> &value) {
+		uint32_t id;
+		in = FieldCodec<uint32_t>::read(in, end, id);
+
+		auto iWorld = g_worlds.find(id);
+		if (iWorld == g_worlds.end()) value = nullptr;
+		else value = iWorld->second;
+
+		return in;
+	}
+};
+
 Character::Character()
 {
 }
@@ -13,18 +37,15 @@ Character::~Character()
 
 void Character::read(Packet &packet)
 {
-	m_name = packet.pop<std::string>();
-	auto iWorld = g_worlds.find(packet.pop<uint32_t>());
-	if (iWorld == g_worlds.end()) m_world = nullptr;
-	else m_world = iWorld->second;
+	Schema::read(packet, *this);
 }
 
-void Character::write(Packet &packet)
+void Character::write(Packet &packet) const
 {
-	packet.push(m_name).push<uint32_t>(m_world ? m_world->id() : 0);
+	Schema::write(packet, *this);
 }
 
-const std::string& Character::name()
+const SmallString& Character::name()
 {
 	return m_name;
 }
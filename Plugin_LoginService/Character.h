@@ -4,6 +4,7 @@
 #include <string>
 
 #include "Packet.h"
+#include "PacketSchema.h"
 
 class World;
 
@@ -15,13 +16,17 @@ public:
 	~Character();
 
 	virtual void read(Packet &packet);
-	virtual void write(Packet &packet);
+	virtual void write(Packet &packet) const;
 
-	const std::string& name();
+	const SmallString& name();
 	std::shared_ptr<World> world();
 
 private:
-	std::string m_name;
+	SmallString m_name;
 	std::shared_ptr<World> m_world;
+
+	typedef PacketSchema<Character,
+		Field<Character, SmallString, &Character::m_name>,
+		Field<Character, std::shared_ptr<World>, &Character::m_world>> Schema;
 };
 
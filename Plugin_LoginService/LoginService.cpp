@@ -82,8 +82,8 @@ bool LoginService::handleFirst(NetworkConnectionPtr connection, PacketPtr packet
 	std::array<uint32_t, 4> keys = { packet->pop<uint32_t>(), packet->pop<uint32_t>(), packet->pop<uint32_t>(), packet->pop<uint32_t>() };
 	connection->setKeys(keys);
 
-	std::string accountName = packet->pop<std::string>();
-	std::string password = packet->pop<std::string>();
+	auto accountName = packet->pop<boost::string_ref>();
+	auto password = packet->pop<boost::string_ref>();
 	std::string country;
 	country.append(1, packet->pop<char>()); // Always $
 	// 3 letters country code
@@ -101,8 +101,9 @@ bool LoginService::handleFirst(NetworkConnectionPtr connection, PacketPtr packet
 	// always 0x0101 <-- unknown
 	packet->skip(2); 
 
-	std::string videoCard = packet->pop<std::string>();
-	std::string videoDriver = packet->pop<std::string>();
+	// Video card and driver, unused. Popped rather than skipped, so a bad length can't move past the frame
+	packet->pop<boost::string_ref>();
+	packet->pop<boost::string_ref>();
 
 	// Starting second RSA block
 	pos = packet->pos();
@@ -110,53 +111,36 @@ bool LoginService::handleFirst(NetworkConnectionPtr connection, PacketPtr packet
 		return false;
 	}
 
-	std::string authToken = packet->pop<std::string>();
+	// Authenticator token, unused
+	packet->pop<boost::string_ref>();
 	bool stayLoggedIn = packet->pop<bool>();
 
 	// Padding bytes
 	packet->skip(128 - packet->pos() + pos);
 
 	if (auto client = g_client.lock()) { 
+#ifdef PHOENIX_COROUTINES
+		login(connection, client, accountName.to_string(), password.to_string());
+#else
 		Account account;
 		account.username(accountName);
 		account.password(password);
 		client->requestPacketSerializable(Capability("account"), "Account", account, [connection](PacketPtr inPacket) {
+			if (!inPacket) {
+				disconnectClient(connection, 0x0a, "Internal server error. Please try again later.");
+				return;
+			}
+
 			Account account;
 			account.read(*inPacket);
 			if (account.success()) {
-				PacketPtr outPacket(new Packet);
-
-				// Send MOTD
-				outPacket->push<uint8_t>(0x14).push("1\nPhoenixTibiaServer v0.1");
-
-				// Send character list
-				outPacket->push<uint8_t>(0x64)
-					// Add Worlds
-					.push<uint8_t>((uint8_t)g_worlds.size());
-				for (auto &&world : g_worlds) {
-					outPacket->push<uint8_t>((uint8_t)world.first)
-						.push(world.second->name())
-						.push(world.second->endpoint().address().to_string())
-						.push<uint16_t>(world.second->endpoint().port())
-						.push<uint8_t>(0);
-				}
-
-				// Add characters
-				outPacket->push<uint8_t>((uint8_t)g_worlds.size());
-				for (auto &&world : g_worlds) {
-					outPacket->push<uint8_t>((uint8_t)world.first)
-						.push("Test on " + world.second->name());
-				}
-
-				// Add premium days
-				outPacket->push<uint16_t>(0xffff);
-
-				connection->send(outPacket, [connection](boost::system::error_code ec, size_t) {
+				connection->send(characterList(), [connection](boost::system::error_code ec, size_t) {
 					connection->close();
 				});
 			}
 			else disconnectClient(connection, 0x0a, "Invalid account name or password.");
-		});
+		}, InterserverClient::requestTimeout);
+#endif
 	}
 	else {
 		disconnectClient(connection, 0x0a, "Internal server error. Please try again later.");
@@ -166,9 +150,69 @@ bool LoginService::handleFirst(NetworkConnectionPtr connection, PacketPtr packet
 	return true;
 }
 
+#ifdef PHOENIX_COROUTINES
+phoenix::Task LoginService::login(NetworkConnectionPtr connection, std::shared_ptr<InterserverClient> client, std::string accountName, std::string password)
+{
+	Account account;
+	account.username(accountName);
+	account.password(password);
+
+	PacketPtr reply = co_await client->request(Capability("account"), "Account", account);
+
+	// The reply comes in on the interserver connection
+	co_await phoenix::resumeOn(connection->strand());
+
+	if (!reply) {
+		disconnectClient(connection, 0x0a, "Internal server error. Please try again later.");
+		co_return;
+	}
+
+	account.read(*reply);
+	if (!account.success()) {
+		disconnectClient(connection, 0x0a, "Invalid account name or password.");
+		co_return;
+	}
+
+	co_await phoenix::send(*connection, characterList());
+	connection->close();
+}
+#endif
+
+PacketPtr LoginService::characterList()
+{
+	PacketPtr packet = Packet::create();
+
+	// Send MOTD
+	packet->push<uint8_t>(0x14).push("1\nPhoenixTibiaServer v0.1");
+
+	// Send character list
+	packet->push<uint8_t>(0x64)
+		// Add Worlds
+		.push<uint8_t>((uint8_t)g_worlds.size());
+	for (auto &&world : g_worlds) {
+		packet->push<uint8_t>((uint8_t)world.first)
+			.push(world.second->name())
+			.push(world.second->endpoint().address().to_string())
+			.push<uint16_t>(world.second->endpoint().port())
+			.push<uint8_t>(0);
+	}
+
+	// Add characters
+	packet->push<uint8_t>((uint8_t)g_worlds.size());
+	for (auto &&world : g_worlds) {
+		packet->push<uint8_t>((uint8_t)world.first)
+			.push("Test on " + world.second->name());
+	}
+
+	// Add premium days
+	packet->push<uint16_t>(0xffff);
+
+	return packet;
+}
+
 void LoginService::disconnectClient(NetworkConnectionPtr connection, uint8_t error, const std::string& message)
 {
-	PacketPtr packet(new Packet);
+	PacketPtr packet = Packet::create();
 
 	packet->push(error).push(message);
 
@@ -183,7 +227,7 @@ bool LoginService::RSAdecrypt(NetworkConnectionPtr connection, PacketPtr packet)
 	if (RSA_private_decrypt(128, encData.get(), packet->data() + pos, g_rsa, RSA_NO_PADDING) == -1 || packet->pop<uint8_t>() != 0) {
 		if (g_logger) {
 			std::stringstream ss;
-			ss << "Client " + connection->socket().remote_endpoint().address().to_string() + " sent invalid RSA encrypted data";
+			ss << "Client " + connection->remoteEndpoint().address().to_string() + " sent invalid RSA encrypted data";
 			g_logger->log(LogLevel::Information, ss.str());
 		}
 
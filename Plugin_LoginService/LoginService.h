@@ -1,6 +1,9 @@
 #pragma once
 
 #include "NetworkService.h"
+#include "Coroutine.h"
+
+class InterserverClient;
 
 class LoginService :
 	public NetworkService
@@ -16,6 +19,8 @@ public:
 
 	virtual bool needChecksum();
 
+	virtual std::vector<uint8_t> getProtocolIds() { return std::vector<uint8_t>(1, 0x01); }
+
 	virtual bool canHandle(NetworkConnectionPtr connection, PacketPtr packet);
 	virtual bool handleFirst(NetworkConnectionPtr connection, PacketPtr packet);
 
@@ -24,6 +29,14 @@ private:
 
 	static bool RSAdecrypt(NetworkConnectionPtr connection, PacketPtr packet);
 
+	//! Builds the MOTD and character list sent once the account is accepted
+	static PacketPtr characterList();
+
+#ifdef PHOENIX_COROUTINES
+	//! Checks the account against the interserver, then answers the client
+	static phoenix::Task login(NetworkConnectionPtr connection, std::shared_ptr<InterserverClient> client, std::string accountName, std::string password);
+#endif
+
 	uint16_t requiredClientVersion;
 	std::string requiredClientVersionString;
 };
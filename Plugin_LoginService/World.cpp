@@ -18,14 +18,12 @@ World::~World()
 
 void World::read(Packet &packet)
 {
-	m_name = packet.pop<std::string>();
-	m_endpoint = tcp::endpoint(address::from_string(packet.pop<std::string>()), packet.pop<unsigned short>());
-	m_id = packet.pop<uint32_t>();
+	Schema::read(packet, *this);
 }
 
-void World::write(Packet &packet)
+void World::write(Packet &packet) const
 {
-	packet.push(name()).push(m_endpoint.address().to_string()).push<unsigned short>(m_endpoint.port()).push<uint32_t>(m_id);
+	Schema::write(packet, *this);
 }
 
 const std::string& World::name()
@@ -3,7 +3,9 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <string>
 
+#include "NetworkDefinitions.h"
 #include "Packet.h"
+#include "PacketSchema.h"
 
 class World
 	: public PacketSerializable
@@ -15,7 +17,7 @@ public:
 	virtual ~World();
 
 	virtual void read(Packet &packet);
-	virtual void write(Packet &packet);
+	virtual void write(Packet &packet) const;
 
 	const std::string& name();
 	boost::asio::ip::tcp::endpoint endpoint();
@@ -25,5 +27,10 @@ private:
 	std::string m_name;
 	boost::asio::ip::tcp::endpoint m_endpoint;
 	uint32_t m_id;
+
+	typedef PacketSchema<World,
+		Field<World, std::string, &World::m_name>,
+		Field<World, boost::asio::ip::tcp::endpoint, &World::m_endpoint>,
+		Field<World, uint32_t, &World::m_id>> Schema;
 };
 
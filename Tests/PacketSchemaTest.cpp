@@ -0,0 +1,89 @@
+// Checks that PacketSchema reads a message back the way it wrote it, and refuses one that runs past the end of its
+// frame even when the read buffer holds more bytes after it, as it does when the next frame arrived in the same read.
+//
+// Exits with 0 when it does, and prints the mismatches otherwise.
+
+#include "NetworkDefinitions.h"
+#include "Packet.h"
+#include "PacketSchema.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+	struct Message
+	{
+		bool flag;
+		uint32_t number;
+		std::string text;
+
+		typedef PacketSchema<Message,
+			Field<Message, bool, &Message::flag>,
+			Field<Message, uint32_t, &Message::number>,
+			Field<Message, std::string, &Message::text>> Schema;
+	};
+
+	//! The bytes Schema::write produces for message
+	std::vector<uint8_t> encode(const Message &message)
+	{
+		PacketPtr packet = Packet::create();
+		Message::Schema::write(*packet, message);
+
+		const uint8_t *begin = packet->data() + packet->start();
+		return std::vector<uint8_t>(begin, begin + packet->size());
+	}
+
+	//! A received frame holding the first length bytes of body, laid out the way NetworkConnection hands frames over:
+	//! the whole of body follows the header in the buffer, but the frame ends after length bytes
+	PacketPtr frame(const std::vector<uint8_t> &body, size_t length)
+	{
+		PacketPtr packet = Packet::create();
+		packet->reserve(Packet::headerSize + body.size());
+
+		uint16_t header = (uint16_t)length;
+		std::memcpy(packet->data(), &header, sizeof(header));
+		std::memcpy(packet->data() + Packet::headerSize, body.data(), body.size());
+
+		packet->start(0).size(Packet::headerSize + length).pos(Packet::headerSize);
+		return packet;
+	}
+
+	bool check(bool condition, const std::string &what)
+	{
+		if (!condition) std::cout << what << std::endl;
+		return condition;
+	}
+}
+
+int main()
+{
+	bool passed = true;
+
+	Message sent = { true, 0xDEADBEEF, "a string long enough to be cut in the middle" };
+	std::vector<uint8_t> body = encode(sent);
+	passed &= check(body.size() == Message::Schema::minSize + sent.text.size(), "write produced the wrong number of bytes");
+
+	Message received = { false, 0, std::string() };
+	PacketPtr whole = frame(body, body.size());
+	passed &= check(Message::Schema::read(*whole, received), "a whole message was refused");
+	passed &= check(received.flag == sent.flag && received.number == sent.number && received.text == sent.text,
+		"a whole message was misread");
+	passed &= check(whole->pos() == whole->size(), "reading a whole message did not move to the end of the frame");
+
+	// Every truncation, within the fixed part and within the string, must be refused without moving
+	for (size_t length = 0; length < body.size(); ++length) {
+		PacketPtr truncated = frame(body, length);
+		size_t position = truncated->pos();
+
+		passed &= check(!Message::Schema::read(*truncated, received),
+			"a message cut to " + std::to_string(length) + " bytes was read from past the end of its frame");
+		passed &= check(truncated->pos() == position,
+			"refusing a message cut to " + std::to_string(length) + " bytes moved the packet");
+	}
+
+	std::cout << (passed ? "ok" : "FAILED") << std::endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// Checks that both NetworkConnection::ReceiveModes decode the same encrypted frame to the same message, and agree on
+// whether its checksum is valid.
+//
+// Exits with 0 when they do, and prints the mismatches otherwise.
+
+#include "LoopbackConnection.h"
+#include "Packet.h"
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+
+namespace {
+	std::array<uint32_t, 4> keys = { { 0x01234567, 0x89ABCDEF, 0xFEDCBA98, 0x76543210 } };
+	const std::string message = "a message long enough to span several XTEA blocks, and then some";
+
+	//! Encrypts message into a frame, the way a client with the same keys would send it
+	PacketPtr encode(boost::asio::io_service &ioService)
+	{
+		auto sender = std::make_shared<LoopbackConnection>(ioService, true);
+		sender->setKeys(keys);
+
+		PacketPtr packet = Packet::create();
+		packet->push<uint8_t>(0x2A).push(message);
+		sender->send(packet);
+		ioService.poll();
+		ioService.reset();
+
+		PacketPtr frame;
+		sender->receive(frame);
+		return frame;
+	}
+
+	//! What a connection in mode makes of frame
+	struct Received
+	{
+		bool read;
+		bool validChecksum;
+		uint8_t code;
+		std::string text;
+	};
+
+	Received receive(boost::asio::io_service &ioService, NetworkConnection::ReceiveMode mode, PacketPtr frame)
+	{
+		Received received = { false, false, 0, std::string() };
+
+		auto receiver = std::make_shared<LoopbackConnection>(ioService, true);
+		receiver->setKeys(keys);
+		receiver->receiveMode(mode);
+		receiver->deliver(Packet::create(frame.get()));
+
+		receiver->beginReading([&received](PacketPtr packet, boost::system::error_code error) {
+			if (error) return;
+
+			received.read = true;
+			received.validChecksum = packet->validChecksum();
+			packet->skip(4);
+			received.code = packet->pop<uint8_t>();
+			received.text = packet->pop<std::string>();
+		});
+		ioService.poll();
+		ioService.reset();
+
+		receiver->close();
+		return received;
+	}
+
+	bool check(bool condition, const char *what)
+	{
+		if (!condition) std::cout << what << std::endl;
+		return condition;
+	}
+}
+
+int main()
+{
+	boost::asio::io_service ioService;
+	bool passed = true;
+
+	PacketPtr frame = encode(ioService);
+	if (!check(frame != nullptr, "the sender did not produce a frame")) return 1;
+
+	auto separate = receive(ioService, NetworkConnection::ReceiveMode::Separate, frame);
+	auto fused = receive(ioService, NetworkConnection::ReceiveMode::Fused, frame);
+
+	passed &= check(separate.read && fused.read, "a mode rejected a valid frame");
+	passed &= check(separate.validChecksum && fused.validChecksum, "a mode found a valid frame's checksum invalid");
+	passed &= check(separate.code == 0x2A && separate.text == message, "Separate misread the message");
+	passed &= check(fused.code == 0x2A && fused.text == message, "Fused misread the message");
+
+	// A flipped bit of ciphertext must fail the checksum the same way in both modes
+	PacketPtr corrupted = Packet::create(frame.get());
+	corrupted->data()[corrupted->start() + corrupted->size() - 1] ^= 0x01;
+
+	separate = receive(ioService, NetworkConnection::ReceiveMode::Separate, corrupted);
+	fused = receive(ioService, NetworkConnection::ReceiveMode::Fused, corrupted);
+	passed &= check(separate.read && fused.read, "a mode dropped a frame with a bad checksum, instead of flagging it");
+	passed &= check(!separate.validChecksum && !fused.validChecksum, "a mode accepted a corrupted frame's checksum");
+
+	std::cout << (passed ? "ok" : "FAILED") << std::endl;
+	return passed ? 0 : 1;
+}
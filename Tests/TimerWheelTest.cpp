@@ -0,0 +1,62 @@
+// Checks that TimerWheel expires timers, and that their handlers may use the wheel: restart another timer, or destroy
+// the last owner of their own timer, as a connection's read timeout does when it drops the last reference to it.
+//
+// Exits with 0 when they do, and prints what failed otherwise. A handler that deadlocks the wheel fails after a while.
+
+#include "TimerWheel.h"
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+namespace {
+	struct Owner
+	{
+		Owner(boost::asio::io_service &ioService) : timeout(ioService) {}
+
+		TimerWheel::Timer timeout;
+	};
+
+	bool check(bool condition, const char *what)
+	{
+		if (!condition) std::cout << what << std::endl;
+		return condition;
+	}
+}
+
+int main()
+{
+	boost::asio::io_service ioService;
+	bool passed = true;
+
+	// Destroys the timer it belongs to
+	auto owner = std::make_shared<Owner>(ioService);
+	std::weak_ptr<Owner> watched = owner;
+	owner->timeout.onExpired([&owner]() { owner.reset(); });
+	owner->timeout.expiresFromNow(0);
+
+	// Restarts another timer, which then expires on a later tick
+	TimerWheel::Timer first(ioService), second(ioService);
+	bool secondExpired = false;
+	first.onExpired([&second]() { second.expiresFromNow(0); });
+	second.onExpired([&secondExpired]() { secondExpired = true; });
+	first.expiresFromNow(0);
+
+	auto finished = std::async(std::launch::async, [&ioService]() { ioService.run(); });
+	if (finished.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+		std::cout << "the wheel deadlocked running a handler" << std::endl;
+		std::cout << "FAILED" << std::endl;
+		std::_Exit(1);
+	}
+
+	passed &= check(watched.expired(), "a handler could not destroy the owner of its timer");
+	passed &= check(secondExpired, "a timer restarted from a handler did not expire");
+
+	std::cout << (passed ? "ok" : "FAILED") << std::endl;
+	return passed ? 0 : 1;
+}
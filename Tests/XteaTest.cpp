@@ -0,0 +1,90 @@
+// Checks every XTEA implementation this processor can run against ciphertext produced by the original scalar code
+// that NetworkConnection::encrypt used before the kernels were vectorized.
+//
+// Exits with 0 when all of them match, and prints the mismatches otherwise.
+
+#include "Xtea.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace {
+	const std::array<uint32_t, 4> keys = { { 0x01234567, 0x89ABCDEF, 0xFEDCBA98, 0x76543210 } };
+
+	//! 16 + 8 + 4 + 3 blocks, enough to go through every step of every kernel
+	enum { blocks = 31 };
+
+	const uint8_t ciphertext[blocks * 8] = {
+		0x8B, 0xF3, 0xB8, 0x10, 0xC8, 0x84, 0x85, 0x6C, 0x43, 0x13, 0x80, 0x36, 0x90, 0xDA, 0x8B, 0xDE,
+		0x09, 0xD1, 0x32, 0xE7, 0x47, 0xB0, 0x94, 0xA3, 0xC5, 0x4F, 0x04, 0xF4, 0xF0, 0x9E, 0x1C, 0xC0,
+		0x2D, 0x5D, 0x6F, 0xC8, 0xAA, 0x2E, 0x86, 0xE6, 0xD1, 0x9D, 0x18, 0x8D, 0x25, 0x21, 0x6C, 0x10,
+		0x1D, 0xAA, 0x4C, 0x77, 0x6E, 0xC6, 0x1A, 0x32, 0xAF, 0x28, 0xC0, 0xBC, 0xDE, 0xFA, 0xD4, 0xCD,
+		0x57, 0x18, 0xF1, 0x5D, 0x16, 0xFF, 0xC9, 0x2B, 0x96, 0x33, 0x86, 0xCF, 0x87, 0xDD, 0x8A, 0x79,
+		0xC0, 0x51, 0x9D, 0x8C, 0x7A, 0x2D, 0x61, 0xD0, 0x21, 0x5F, 0xBC, 0x7D, 0x5F, 0xA8, 0xF6, 0x27,
+		0x8C, 0x4C, 0x41, 0xD6, 0xAF, 0xA8, 0x74, 0x32, 0x97, 0x84, 0xBB, 0xE3, 0x47, 0x3C, 0x6C, 0x85,
+		0x8E, 0x78, 0x14, 0x31, 0xB6, 0x0E, 0x36, 0xC6, 0x7B, 0xC4, 0xDB, 0xD3, 0x82, 0x81, 0x0A, 0xC1,
+		0xB0, 0xE2, 0xFF, 0x07, 0xAC, 0x65, 0x5C, 0xFC, 0x77, 0x20, 0x61, 0xBD, 0x28, 0x56, 0xCE, 0x9E,
+		0x42, 0x20, 0x7F, 0xD6, 0x86, 0xAB, 0x23, 0x0A, 0x8A, 0x5E, 0x82, 0x93, 0xB6, 0x8C, 0x23, 0x1F,
+		0x59, 0x07, 0xF8, 0x92, 0x88, 0xBB, 0x40, 0x10, 0x94, 0x26, 0xD7, 0xB1, 0x71, 0xBA, 0x86, 0x86,
+		0x8A, 0x43, 0xD7, 0x3C, 0x78, 0xF9, 0x98, 0x16, 0x44, 0xFD, 0xD3, 0xD8, 0xD0, 0x3C, 0x26, 0xD1,
+		0x65, 0x40, 0x6A, 0x38, 0xF8, 0xD0, 0xD1, 0x96, 0xDD, 0xBD, 0x95, 0x08, 0x23, 0xEC, 0xE3, 0x58,
+		0x89, 0xC6, 0xF6, 0xB6, 0xDB, 0xE6, 0x1C, 0xE7, 0xE3, 0x8C, 0x51, 0xDA, 0xBA, 0x1D, 0x2C, 0x99,
+		0xA2, 0xD0, 0x03, 0x83, 0x40, 0xE4, 0x6F, 0xFC, 0xEF, 0xE4, 0x76, 0xE8, 0xFE, 0x44, 0x4D, 0x8F,
+		0xE8, 0x0A, 0xDF, 0x6A, 0xDC, 0xA5, 0xC3, 0xA8
+	};
+
+	//! Adler-32 of ciphertext
+	const uint32_t ciphertextChecksum = 0x75CB82C6;
+
+	void plaintext(uint8_t *out)
+	{
+		for (size_t i = 0; i < blocks * 8; ++i)
+			out[i] = (uint8_t)(i * 131 + 7);
+	}
+
+	bool check(bool condition, const std::string &implementation, const char *what)
+	{
+		if (!condition) std::cout << implementation << ": " << what << " does not match the original implementation" << std::endl;
+		return condition;
+	}
+}
+
+int main()
+{
+	bool passed = true;
+
+	for (auto &implementation : xteaImplementations()) {
+		if (!xteaUseImplementation(implementation)) {
+			std::cout << implementation << ": could not be selected" << std::endl;
+			passed = false;
+			continue;
+		}
+
+		bool matches = true;
+		uint8_t expected[blocks * 8], data[blocks * 8];
+		plaintext(expected);
+
+		// Every length, so each kernel also runs with the blocks left over by the wider ones
+		for (size_t count = 1; count <= blocks; ++count) {
+			plaintext(data);
+			xteaEncrypt(data, count * 8, keys);
+			matches &= check(std::memcmp(data, ciphertext, count * 8) == 0, implementation, "xteaEncrypt");
+
+			xteaDecrypt(data, count * 8, keys);
+			matches &= check(std::memcmp(data, expected, count * 8) == 0, implementation, "xteaDecrypt");
+		}
+
+		std::memcpy(data, ciphertext, sizeof(data));
+		uint32_t checksum = xteaDecryptWithChecksum(data, sizeof(data), keys);
+		matches &= check(checksum == ciphertextChecksum, implementation, "xteaDecryptWithChecksum's checksum");
+		matches &= check(std::memcmp(data, expected, sizeof(data)) == 0, implementation, "xteaDecryptWithChecksum");
+
+		std::cout << implementation << ": " << (matches ? "ok" : "FAILED") << std::endl;
+		passed &= matches;
+	}
+
+	return passed ? 0 : 1;
+}